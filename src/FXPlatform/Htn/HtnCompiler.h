@@ -138,7 +138,7 @@ public:
             }
         }
         
-        PrologCompilerBase<VariableRule>::m_state->AddRule(PrologCompilerBase<VariableRule>::CreateTermFromFunctor(PrologCompilerBase<VariableRule>::m_termFactory, head), list);
+        PrologCompilerBase<VariableRule>::AddRule(PrologCompilerBase<VariableRule>::CreateTermFromFunctor(PrologCompilerBase<VariableRule>::m_termFactory, head), list);
     }
     
     ValueProperty(private, HtnDomain *, domain);
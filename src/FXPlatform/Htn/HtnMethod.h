@@ -11,6 +11,7 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include "FXPlatform/Prolog/HtnHeadProgram.h"
 class HtnTerm;
 
 enum class HtnMethodType
@@ -31,6 +32,7 @@ public:
         m_condition(condition),
         m_documentOrder(0),
         m_head(head),
+        m_headProgram(HtnHeadProgram::Compile(head)),
         m_isDefault(isDefault),
         m_methodType(methodType),
         m_tasks(tasks)
@@ -41,6 +43,7 @@ public:
         m_condition(condition),
         m_documentOrder(documentOrder),
         m_head(head),
+        m_headProgram(HtnHeadProgram::Compile(head)),
         m_isDefault(isDefault),
         m_methodType(methodType),
         m_tasks(tasks)
@@ -49,8 +52,10 @@ public:
     
     const std::vector<std::shared_ptr<HtnTerm>> &condition() const { return m_condition; }
     int documentOrder() { return m_documentOrder; }
-    int64_t dynamicSize() { return sizeof(HtnMethod) + (m_condition.size() + m_tasks.size()) * sizeof(std::shared_ptr<HtnTerm>); };
+    int64_t dynamicSize() { return sizeof(HtnMethod) + (m_condition.size() + m_tasks.size()) * sizeof(std::shared_ptr<HtnTerm>) + m_headProgram->instructions().size() * sizeof(HtnHeadProgram::Instruction); };
     const std::shared_ptr<HtnTerm> head() const { return m_head; }
+    // Compiled when the method is created, for HtnGoalResolver::UnifyCompiled()
+    const HtnHeadProgram &headProgram() const { return *m_headProgram; }
     bool isDefault() const { return m_isDefault; }
     HtnMethodType methodType() const { return m_methodType; }
     const std::vector<std::shared_ptr<HtnTerm>> tasks() const { return m_tasks; }
@@ -61,6 +66,7 @@ private:
     std::vector<std::shared_ptr<HtnTerm>> m_condition;
     int m_documentOrder; // Order they were written down in the document.  Monotonically increasing within a method, not guaranteed so outside of the method
     std::shared_ptr<HtnTerm> m_head;
+    std::shared_ptr<HtnHeadProgram> m_headProgram;
     bool m_isDefault;
     HtnMethodType m_methodType;
     std::vector<std::shared_ptr<HtnTerm>> m_tasks;
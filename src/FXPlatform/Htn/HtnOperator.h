@@ -11,6 +11,7 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include "FXPlatform/Prolog/HtnHeadProgram.h"
 class HtnTerm;
 
 // Operators are immutable
@@ -24,14 +25,17 @@ public:
         m_additions(additions),
         m_deletions(deletions),
         m_head(head),
+        m_headProgram(HtnHeadProgram::Compile(head)),
         m_isHidden(hidden)
     {
     }
     
     const std::vector<std::shared_ptr<HtnTerm>> additions() const { return m_additions; }
     const std::vector<std::shared_ptr<HtnTerm>> deletions() const { return m_deletions; }
-    int64_t dynamicSize() { return sizeof(HtnOperator) + (m_additions.size() + m_deletions.size()) * sizeof(std::shared_ptr<HtnTerm>); }
+    int64_t dynamicSize() { return sizeof(HtnOperator) + (m_additions.size() + m_deletions.size()) * sizeof(std::shared_ptr<HtnTerm>) + m_headProgram->instructions().size() * sizeof(HtnHeadProgram::Instruction); }
     const std::shared_ptr<HtnTerm> head() const { return m_head; }
+    // Compiled when the operator is created, for HtnGoalResolver::UnifyCompiled()
+    const HtnHeadProgram &headProgram() const { return *m_headProgram; }
     std::string ToString() const;    
     bool isHidden() { return m_isHidden; }
     
@@ -39,6 +43,7 @@ private:
     std::vector<std::shared_ptr<HtnTerm>> m_additions;
     std::vector<std::shared_ptr<HtnTerm>> m_deletions;
     std::shared_ptr<HtnTerm> m_head;
+    std::shared_ptr<HtnHeadProgram> m_headProgram;
     bool m_isHidden;
 };
 
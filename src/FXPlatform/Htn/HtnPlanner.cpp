@@ -8,6 +8,7 @@
 #include <algorithm>
 #include "Logger.h"
 #include "HtnGoalResolver.h"
+#include "HtnImage.h"
 #include "HtnMethod.h"
 #include "HtnOperator.h"
 #include "HtnPlanner.h"
@@ -17,6 +18,9 @@
 #include "FXPlatform/NanoTrace.h"
 using namespace std;
 
+// 'DOMN' so a reader can tell it is at the methods and operators
+static const uint32_t DomainImageTag = 0x4E4D4F44;
+
 uint8_t HtnPlanner::m_abort = 0;
 
 const int indentSpaces = 11;
@@ -278,6 +282,8 @@ PlanState::PlanState(HtnTermFactory *factoryArg, shared_ptr<HtnRuleSet> initialS
     furthestCriteriaFailure(-1),
     deepestTaskFailure(-1),
     factory(factoryArg),
+    factoryBudgetedSizeAtStart(factoryArg->budgetedSize()),
+    factorySizeAtStart(factoryArg->dynamicSize()),
     highestMemoryUsed(0),
     initialState(initialStateArg),
     memoryBudget(memoryBudgetArg),
@@ -311,8 +317,8 @@ int64_t PlanState::dynamicSize()
     int64_t currentMemory = sizeof(PlanState) +
         // locked rules shared by all nodes
         initialState->dynamicSharedSize() +
-        // memory used by all terms
-        factory->dynamicSize() +
+        // memory used by all terms, only the ones this thread created are added if the factory is shared
+        factorySizeAtStart + (factory->budgetedSize() - factoryBudgetedSizeAtStart) +
         // memory used for failurecontext
         furthestCriteriaFailureContext.size() * sizeof(std::shared_ptr<HtnTerm>) +
         // memory used by everything on the stack
@@ -388,7 +394,7 @@ bool HtnPlanner::CheckForOperator(PlanState *planState)
         HtnOperator *op = (*foundOperator).second;
         
         // Get the "Most General Unifier" for the operator and the task and make sure it is ground (otherwise it is invalid)
-        shared_ptr<UnifierType> mgu = HtnGoalResolver::Unify(factory, node->task, op->head());
+        shared_ptr<UnifierType> mgu = HtnGoalResolver::UnifyCompiled(factory, op->headProgram(), node->task, true);
         if(mgu != nullptr && HtnGoalResolver::IsGround(mgu.get()))
         {
             // Substitute the MGU into any variables in the operator
@@ -438,7 +444,7 @@ bool HtnPlanner::CheckForSpecialTask(PlanState *planState)
     shared_ptr<vector<shared_ptr<PlanNode>>> stack = planState->stack;
     
     shared_ptr<PlanNode> node = stack->back();
-    if(node->task->name() == "try")
+    if(node->task->isAtom(HtnAtom::Try))
     {
         // We model try() as a node which has two alternative branches: one where its subtasks are run and one where they aren't.
         // We only run the second alternative if the first fails. I.e.:
@@ -449,7 +455,7 @@ bool HtnPlanner::CheckForSpecialTask(PlanState *planState)
         //    - So, we give each try() an id, and we add a tryEnd(id) at the end to accomplish this
         shared_ptr<vector<shared_ptr<HtnTerm>>> tasks = shared_ptr<vector<shared_ptr<HtnTerm>>>(new vector<shared_ptr<HtnTerm>>());
         tasks->insert(tasks->begin(), node->task->arguments().begin(), node->task->arguments().end());
-        tasks->push_back(factory->CreateFunctor("tryEnd", { factory->CreateConstant(lexical_cast<string>(node->nodeID()))}));
+        tasks->push_back(factory->CreateFunctor("tryEnd", { factory->CreateConstant(node->nodeID())}));
         Trace0("TRY        ", "", stack->size());
         
         // try() pushes a node because it needs a chance to backtrack if the branch fails
@@ -459,11 +465,11 @@ bool HtnPlanner::CheckForSpecialTask(PlanState *planState)
         node->retry = true;
         return true;
     }
-    else if(node->task->name() == "tryEnd")
+    else if(node->task->isAtom(HtnAtom::TryEnd))
     {
         // tryEnd() is a system bookkeeping task which marks the end of a try clause.
         // Resolving a tryEnd() means we made it through the try() clause successfully
-        int tryNodeID = lexical_cast<int>(node->task->arguments()[0]->name());
+        int tryNodeID = (int) node->task->arguments()[0]->GetInt();
         
         // Tell the try() clause not to retry by finding the node that represents it and marking it
         FindNodeWithID(*stack, tryNodeID)->retry = false;
@@ -472,22 +478,22 @@ bool HtnPlanner::CheckForSpecialTask(PlanState *planState)
         node->continuePoint = PlanNodeContinuePoint::NextTask;
         return true;
     }
-    else if(node->task->name() == "countAnyOf")
+    else if(node->task->isAtom(HtnAtom::CountAnyOf))
     {
         // countAnyOf(nodeID) is a bookkeeping task that increments a count on an anyOf node to indicate that one of the conditions resolved
         // Analogous to the way tryEnd() works
-        int anyOfNodeID = lexical_cast<int>(node->task->arguments()[0]->name());
+        int anyOfNodeID = (int) node->task->arguments()[0]->GetInt();
         FindNodeWithID(*stack, anyOfNodeID)->tryAnyOfSuccessCount++;
         
         // Get the next task, no node is pushed because we were just doing bookkeeping
         node->continuePoint = PlanNodeContinuePoint::NextTask;
         return true;
     }
-    else if(node->task->name() == "failIfNoneOf")
+    else if(node->task->isAtom(HtnAtom::FailIfNoneOf))
     {
         // failIfNoneOf is a bookkeeping task also used to implement anyOf
         // If none of the countAnyOf() clauses succeeded, then this clause fails since none of the conditions resolved
-        int anyOfNodeID = lexical_cast<int>(node->task->arguments()[0]->name());
+        int anyOfNodeID = (int) node->task->arguments()[0]->GetInt();
         if(FindNodeWithID(*stack, anyOfNodeID)->tryAnyOfSuccessCount == 0)
         {
             Trace0("FAIL       ", "AnyOf had zero solutions", stack->size());
@@ -529,7 +535,7 @@ shared_ptr<vector<pair<HtnMethod *, UnifierType>>> HtnPlanner::FindAllMethodsTha
     shared_ptr<vector<pair<HtnMethod *, UnifierType>>> foundMethods = shared_ptr<vector<pair<HtnMethod *, UnifierType>>>(new vector<pair<HtnMethod *, UnifierType>>());
     for(map<HtnTerm::HtnTermID, HtnMethod *>::iterator iter = m_methods.begin(); iter != m_methods.end(); ++iter)
     {
-        shared_ptr<UnifierType> sub = HtnGoalResolver::Unify(termFactory, iter->second->head(), goal);
+        shared_ptr<UnifierType> sub = HtnGoalResolver::UnifyCompiled(termFactory, iter->second->headProgram(), goal);
         
         if(sub != nullptr)
         {
@@ -630,6 +636,8 @@ shared_ptr<HtnPlanner::SolutionsType> HtnPlanner::FindAllPlans(HtnTermFactory *f
                                                                int64_t *highestMemoryUsedReturn, int *furthestFailureIndex, std::vector<std::shared_ptr<HtnTerm>> *furthestFailureContext)
 {
     Trace1("ALL BEGIN  ", "Goals:{0}", 0, HtnTerm::ToString(initialGoals));
+    // Most of the terms created while planning are gone by the time we return
+    HtnTermArenaScope arenaScope(factory);
     shared_ptr<HtnPlanner::SolutionsType> finalSolutions;
     shared_ptr<PlanState> planState = shared_ptr<PlanState>(new PlanState(factory, initialState, initialGoals, memoryBudget));
     Trace0("BEGIN      ", "Find next plan", 0);
@@ -674,6 +682,10 @@ shared_ptr<HtnPlanner::SolutionsType> HtnPlanner::FindAllPlans(HtnTermFactory *f
     }
     
     Trace3("ALL END    ", "Solution:'{0}', Budget:{1}, HighestMemory:{2}", 0, HtnPlanner::ToStringSolutions(finalSolutions), memoryBudget, planState->highestMemoryUsed);
+    // Everything planning created that isn't in finalSolutions is released in bulk
+    arenaScope.Release();
+    nextSolution = nullptr;
+    planState = nullptr;
     return finalSolutions;
 }
 
@@ -1071,14 +1083,14 @@ void HtnPlanner::HandleAnyOf(PlanState *planState)
         shared_ptr<vector<shared_ptr<HtnTerm>>> boundSubtasks = HtnGoalResolver::SubstituteUnifiers(factory, condition, *headBoundSubtasks);
         
         // And add an countAnyOf() after so we count if it succeded
-        boundSubtasks->push_back(factory->CreateFunctor("countAnyOf", { factory->CreateConstant(lexical_cast<string>(anyOfNodeID)) }));
+        boundSubtasks->push_back(factory->CreateFunctor("countAnyOf", { factory->CreateConstant(anyOfNodeID) }));
         
         // Then wrap them in try
         combinedSubtasks->push_back(factory->CreateFunctor("try", *boundSubtasks));
     }
     
     // Then add a final check at the end to make sure at least one of the try() blocks worked
-    combinedSubtasks->push_back(factory->CreateFunctor("failIfNoneOf", { factory->CreateConstant(lexical_cast<string>(anyOfNodeID)) }));
+    combinedSubtasks->push_back(factory->CreateFunctor("failIfNoneOf", { factory->CreateConstant(anyOfNodeID) }));
     
     // Here is where we track how many succeeded
     node->tryAnyOfSuccessCount = 0;
@@ -1144,43 +1156,140 @@ string HtnPlanner::ToStringFacts(shared_ptr<SolutionsType> solutions)
     }
 }
 
-string HtnPlanner::ToStringSolution(shared_ptr<SolutionType> solution, bool json)
+void HtnPlanner::AppendSolution(string &output, shared_ptr<SolutionType> solution, bool json)
 {
     if(solution == nullptr)
     {
-        return json ? "" : "null";
+        output.append(json ? "" : "null");
     }
     else
     {
-        return HtnTerm::ToString(solution->first, json ? false : true, json);
+        HtnTerm::AppendString(output, solution->first, json ? false : true, json);
     }
 }
 
-string HtnPlanner::ToStringSolutions(shared_ptr<SolutionsType> solutions, bool json)
+void HtnPlanner::AppendSolutions(string &output, shared_ptr<SolutionsType> solutions, bool json)
 {
     if(solutions == nullptr)
     {
-        return json ? "" : "null";
+        output.append(json ? "" : "null");
     }
     else
     {
-        stringstream result;
-        result << "[ ";
+        output.append("[ ");
         bool hasSolution = false;
-        for(shared_ptr<SolutionType> solution : *solutions)
+        for(const shared_ptr<SolutionType> &solution : *solutions)
         {
             if (json)
             {
-                result << (hasSolution ? "," : "") << "[ " + ToStringSolution(solution, true) + " ] ";
+                output.append(hasSolution ? ",[ " : "[ ");
+                AppendSolution(output, solution, true);
+                output.append(" ] ");
             }
             else
             {
-                result << "{ " + ToStringSolution(solution) + " } ";
+                output.append("{ ");
+                AppendSolution(output, solution);
+                output.append(" } ");
             }
             hasSolution = true;
         }
-        result << "]";
-        
-        return result.str();
+        output.push_back(']');
+    }
+}
+
+string HtnPlanner::ToStringSolution(shared_ptr<SolutionType> solution, bool json)
+{
+    string result;
+    AppendSolution(result, solution, json);
+    return result;
+}
+
+string HtnPlanner::ToStringSolutions(shared_ptr<SolutionsType> solutions, bool json)
+{
+    string result;
+    AppendSolutions(result, solutions, json);
+    return result;
+}
+
+bool HtnPlanner::LoadImage(HtnImageReader &reader)
+{
+    if(reader.ReadWord() != DomainImageTag)
+    {
+        reader.SetError("image doesn't have methods and operators where expected");
+        return false;
+    }
+
+    vector<shared_ptr<HtnTerm>> condition;
+    vector<shared_ptr<HtnTerm>> tasks;
+    uint32_t methodCount = reader.ReadWord();
+    for(uint32_t index = 0; index < methodCount; ++index)
+    {
+        shared_ptr<HtnTerm> head = reader.ReadTerm();
+        uint32_t methodType = reader.ReadWord();
+        bool isDefault = reader.ReadWord() != 0;
+        reader.ReadTerms(condition);
+        reader.ReadTerms(tasks);
+        if(reader.failed() || methodType > (uint32_t) HtnMethodType::AnySetOf)
+        {
+            reader.SetError("image has a bad method");
+            return false;
+        }
+
+        AddMethod(head, condition, tasks, (HtnMethodType) methodType, isDefault);
+    }
+
+    vector<shared_ptr<HtnTerm>> additions;
+    vector<shared_ptr<HtnTerm>> deletions;
+    uint32_t operatorCount = reader.ReadWord();
+    for(uint32_t index = 0; index < operatorCount; ++index)
+    {
+        shared_ptr<HtnTerm> head = reader.ReadTerm();
+        bool isHidden = reader.ReadWord() != 0;
+        reader.ReadTerms(additions);
+        reader.ReadTerms(deletions);
+        if(reader.failed())
+        {
+            return false;
+        }
+
+        AddOperator(head, additions, deletions, isHidden);
+    }
+
+    return !reader.failed();
+}
+
+void HtnPlanner::WriteImage(HtnImageWriter &writer)
+{
+    // Methods are kept by head, put them back in document order so they are numbered the same way when loaded
+    vector<HtnMethod *> methods;
+    for(auto method : m_methods)
+    {
+        methods.push_back(method.second);
+    }
+
+    sort(methods.begin(), methods.end(), [](HtnMethod *left, HtnMethod *right)
+    {
+        return left->documentOrder() < right->documentOrder();
+    });
+
+    writer.Write(DomainImageTag);
+    writer.Write((uint32_t) methods.size());
+    for(HtnMethod *method : methods)
+    {
+        writer.WriteTerm(method->head());
+        writer.Write((uint32_t) method->methodType());
+        writer.Write(method->isDefault() ? 1 : 0);
+        writer.WriteTerms(method->condition());
+        writer.WriteTerms(method->tasks());
+    }
+
+    writer.Write((uint32_t) m_operators.size());
+    for(auto op : m_operators)
+    {
+        writer.WriteTerm(op.second->head());
+        writer.Write(op.second->isHidden() ? 1 : 0);
+        writer.WriteTerms(op.second->additions());
+        writer.WriteTerms(op.second->deletions());
     }
 }
@@ -13,6 +13,8 @@
 #include "FXPlatform/Prolog/HtnGoalResolver.h"
 #include <memory>
 #include <vector>
+class HtnImageReader;
+class HtnImageWriter;
 class HtnMethod;
 enum class HtnMethodType;
 class HtnOperator;
@@ -44,6 +46,9 @@ private:
     std::vector<std::shared_ptr<HtnTerm>> furthestCriteriaFailureContext;
     int deepestTaskFailure;
     HtnTermFactory *factory;
+    // factory->dynamicSize() when planning started, plus the change in factory->budgetedSize() is the term memory the plan is charged for
+    int64_t factoryBudgetedSizeAtStart;
+    int64_t factorySizeAtStart;
     int64_t highestMemoryUsed;
     std::shared_ptr<HtnRuleSet> initialState;
     double startTimeSeconds;
@@ -88,6 +93,9 @@ public:
     static void Abort() { m_abort = true; }
     virtual HtnMethod *AddMethod(std::shared_ptr<HtnTerm> head, const std::vector<std::shared_ptr<HtnTerm>> &condition, const std::vector<std::shared_ptr<HtnTerm>> &tasks, HtnMethodType methodType, bool isDefault);
     virtual HtnOperator *AddOperator(std::shared_ptr<HtnTerm>head, const std::vector<std::shared_ptr<HtnTerm>> &addList, const std::vector<std::shared_ptr<HtnTerm>> &deleteList, bool hidden = false);
+    // Same text as ToStringSolution(s)() but appended to output so a caller can reuse one buffer for a whole result
+    static void AppendSolution(std::string &output, std::shared_ptr<SolutionType> solution, bool json = false);
+    static void AppendSolutions(std::string &output, std::shared_ptr<SolutionsType> solutions, bool json = false);
     virtual void ClearAll();
     // Always check factory->outOfMemory() after calling to see if we ran out of memory during processing and the plan might not be complete
     std::shared_ptr<SolutionsType> FindAllPlans(HtnTermFactory *factory, std::shared_ptr<HtnRuleSet> initialState, const std::vector<std::shared_ptr<HtnTerm>> &initialGoals, int memoryBudget = 5000000,
@@ -97,6 +105,8 @@ public:
     // Always check factory->outOfMemory() after calling to see if we ran out of memory during processing and the plan might not be complete
     std::shared_ptr<SolutionType> FindNextPlan(PlanState *planState);
     bool HasGoal(const std::string &term);
+    // Adds the methods and operators that were written by WriteImage(), returns false and sets the reader error if they can't be read
+    bool LoadImage(HtnImageReader &reader);
     // Very inefficient but useful for testing
     bool DebugHasMethod(const std::string &head, const std::string &constraints, const std::string &tasks);
     bool HasOperator(const std::string &head, const std::string &deletions, const std::string &additions);
@@ -104,6 +114,8 @@ public:
     static std::string ToStringSolutions(std::shared_ptr<SolutionsType> solutions, bool json = false);
     static std::string ToStringFacts(std::shared_ptr<SolutionType> solution);
     static std::string ToStringFacts(std::shared_ptr<SolutionsType> solutions);
+    // Writes all the methods in document order and all the operators so they can be loaded later without compiling them
+    void WriteImage(HtnImageWriter &writer);
 
     HtnGoalResolver *goalResolver() { return m_resolver.get(); }
     virtual void AllMethods(std::function<bool(HtnMethod *)> handler)
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+class MappedFileImpl;
+
+// Read only view of a whole file mapped into memory so it can be used without reading it first.
+// data() is valid until Close() is called or the MappedFile is destroyed
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+    void Close();
+    const uint8_t *data() const;
+    // Returns false if the file can't be opened or is empty
+    bool Open(const std::string &pathAndFile);
+    size_t size() const;
+
+private:
+    MappedFile(const MappedFile &other);
+    MappedFile &operator=(const MappedFile &rhs);
+    MappedFileImpl *m_impl;
+};
@@ -0,0 +1,75 @@
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+class MappedFileImpl
+{
+public:
+    MappedFileImpl() :
+        data(nullptr),
+        size(0)
+    {
+    }
+
+    void *data;
+    size_t size;
+};
+
+MappedFile::MappedFile() :
+    m_impl(new MappedFileImpl())
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+    delete m_impl;
+}
+
+void MappedFile::Close()
+{
+    if(m_impl->data != nullptr)
+    {
+        munmap(m_impl->data, m_impl->size);
+        m_impl->data = nullptr;
+        m_impl->size = 0;
+    }
+}
+
+const uint8_t *MappedFile::data() const
+{
+    return (const uint8_t *) m_impl->data;
+}
+
+bool MappedFile::Open(const string &pathAndFile)
+{
+    Close();
+    int file = open(pathAndFile.c_str(), O_RDONLY);
+    if(file == -1)
+    {
+        return false;
+    }
+
+    // The mapping keeps the file open so it can be closed right away
+    struct stat fileInfo;
+    if(fstat(file, &fileInfo) == 0 && fileInfo.st_size > 0)
+    {
+        void *data = mmap(nullptr, (size_t) fileInfo.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if(data != MAP_FAILED)
+        {
+            m_impl->data = data;
+            m_impl->size = (size_t) fileInfo.st_size;
+        }
+    }
+
+    close(file);
+    return m_impl->data != nullptr;
+}
+
+size_t MappedFile::size() const
+{
+    return m_impl->size;
+}
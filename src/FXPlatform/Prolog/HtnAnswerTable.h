@@ -0,0 +1,88 @@
+//
+//  HtnAnswerTable.h
+//  GameLib
+//
+
+#ifndef HtnAnswerTable_hpp
+#define HtnAnswerTable_hpp
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "HtnRule.h"
+#include "HtnTerm.h"
+
+// The answers found so far for calls to tabled predicates. A RuleSet gets a new one whenever its facts change so the answers
+// are only ever replayed in the state they were found in or in copies of it that haven't changed.
+// Filled in by HtnGoalResolver, which holds the mutex while it uses it since copies of a state can be resolved from many threads
+class HtnAnswerTable
+{
+public:
+    class Entry
+    {
+    public:
+        Entry() : complete(false), depth(-1), lowLink(-1) {}
+        // Answers are stored as facts in the order they were found, with variables renamed like calls so duplicates are the same term
+        std::vector<std::shared_ptr<HtnRule>> answers;
+        std::unordered_set<HtnTerm::HtnTermID> answerIDs;
+        // Keeps the term the entry is keyed by alive
+        std::shared_ptr<HtnTerm> call;
+        // Once complete, answers never changes again
+        bool complete;
+        // Position on the evaluation stack while it is being evaluated, -1 otherwise
+        int depth;
+        // Lowest depth of an incomplete entry that this one used answers from
+        int lowLink;
+    };
+
+    HtnAnswerTable() : answerCount(0), expanding(nullptr), m_dynamicSize(sizeof(HtnAnswerTable)) {}
+
+    // Adds the answer if it is new, returns true if it was
+    bool AddAnswer(Entry *entry, std::shared_ptr<HtnTerm> answer)
+    {
+        if(!entry->answerIDs.insert(answer->GetUniqueID()).second)
+        {
+            return false;
+        }
+
+        entry->answers.push_back(std::shared_ptr<HtnRule>(new HtnRule(answer, {})));
+        answerCount++;
+        m_dynamicSize += sizeof(HtnTerm::HtnTermID) + sizeof(std::shared_ptr<HtnRule>) + entry->answers.back()->dynamicSize();
+        return true;
+    }
+
+    Entry *Find(std::shared_ptr<HtnTerm> call, bool *created)
+    {
+        std::pair<std::unordered_map<HtnTerm::HtnTermID, Entry>::iterator, bool> found = entries.emplace(call->GetUniqueID(), Entry());
+        if(found.second)
+        {
+            found.first->second.call = call;
+            m_dynamicSize += sizeof(std::pair<HtnTerm::HtnTermID, Entry>);
+        }
+
+        *created = found.second;
+        return &found.first->second;
+    }
+
+    // Read without the mutex by resolvers that are measuring their memory
+    int64_t dynamicSize() const { return m_dynamicSize; }
+
+    // Total answers in all entries, used to tell when evaluating didn't find anything new
+    int64_t answerCount;
+    // Entries are never erased so pointers to them stay valid
+    std::unordered_map<HtnTerm::HtnTermID, Entry> entries;
+    // Entry whose clauses the next call should be resolved against instead of its answers
+    Entry *expanding;
+    // Evaluated but waiting for an entry they depend on, lower on the stack, to be complete
+    std::vector<Entry *> incomplete;
+    std::recursive_mutex mutex;
+    // Entries being evaluated, innermost last
+    std::vector<Entry *> stack;
+
+private:
+    std::atomic<int64_t> m_dynamicSize;
+};
+
+#endif /* HtnAnswerTable_hpp */
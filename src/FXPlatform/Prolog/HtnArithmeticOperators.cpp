@@ -17,7 +17,7 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Float(HtnTermFactory *factory, share
     shared_ptr<HtnTerm> leftEval = left->Eval(factory);
     if(leftEval != nullptr)
     {
-        return factory->CreateConstant(lexical_cast<string>(leftEval->GetDouble()));
+        return factory->CreateConstant(leftEval->GetDouble());
     }
     
     return nullptr;
@@ -28,7 +28,7 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Integer(HtnTermFactory *factory, sha
     shared_ptr<HtnTerm> leftEval = left->Eval(factory);
     if(leftEval != nullptr)
     {
-        return factory->CreateConstant(lexical_cast<string>(leftEval->GetInt()));
+        return factory->CreateConstant(leftEval->GetInt());
     }
     
     return nullptr;
@@ -42,11 +42,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Abs(HtnTermFactory *factory, shared_
         HtnTermType leftType = leftEval->GetTermType();
         if(leftType == HtnTermType::IntType)
         {
-            return factory->CreateConstant(lexical_cast<string>(abs(leftEval->GetInt())));
+            return factory->CreateConstant((int64_t) abs(leftEval->GetInt()));
         }
         else
         {
-            return factory->CreateConstant(lexical_cast<string>(abs(leftEval->GetDouble())));
+            return factory->CreateConstant(abs(leftEval->GetDouble()));
         }
     }
     
@@ -65,11 +65,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Divide(HtnTermFactory *factory, shar
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetInt() / rightEval->GetInt()));
+                return factory->CreateConstant(leftEval->GetInt() / rightEval->GetInt());
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetDouble() / rightEval->GetDouble()));
+                return factory->CreateConstant(leftEval->GetDouble() / rightEval->GetDouble());
             }
         }
     }
@@ -206,11 +206,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Max(HtnTermFactory *factory, shared_
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(std::max(leftEval->GetInt(), rightEval->GetInt())));
+                return factory->CreateConstant(std::max(leftEval->GetInt(), rightEval->GetInt()));
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(std::max(leftEval->GetDouble(), rightEval->GetDouble())));
+                return factory->CreateConstant(std::max(leftEval->GetDouble(), rightEval->GetDouble()));
             }
         }
     }
@@ -230,11 +230,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Min(HtnTermFactory *factory, shared_
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(std::min(leftEval->GetInt(), rightEval->GetInt())));
+                return factory->CreateConstant(std::min(leftEval->GetInt(), rightEval->GetInt()));
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(std::min(leftEval->GetDouble(), rightEval->GetDouble())));
+                return factory->CreateConstant(std::min(leftEval->GetDouble(), rightEval->GetDouble()));
             }
         }
     }
@@ -255,11 +255,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Minus(HtnTermFactory *factory, share
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetInt() - rightEval->GetInt()));
+                return factory->CreateConstant(leftEval->GetInt() - rightEval->GetInt());
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetDouble() - rightEval->GetDouble()));
+                return factory->CreateConstant(leftEval->GetDouble() - rightEval->GetDouble());
             }
         }
     }
@@ -279,11 +279,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Multiply(HtnTermFactory *factory, sh
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetInt() * rightEval->GetInt()));
+                return factory->CreateConstant(leftEval->GetInt() * rightEval->GetInt());
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetDouble() * rightEval->GetDouble()));
+                return factory->CreateConstant(leftEval->GetDouble() * rightEval->GetDouble());
             }
         }
     }
@@ -304,11 +304,11 @@ shared_ptr<HtnTerm> HtnArithmeticOperators::Plus(HtnTermFactory *factory, shared
             HtnTermType rightType = rightEval->GetTermType();
             if(leftType == HtnTermType::IntType && rightType == HtnTermType::IntType)
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetInt() + rightEval->GetInt()));
+                return factory->CreateConstant(leftEval->GetInt() + rightEval->GetInt());
             }
             else
             {
-                return factory->CreateConstant(lexical_cast<string>(leftEval->GetDouble() + rightEval->GetDouble()));
+                return factory->CreateConstant(leftEval->GetDouble() + rightEval->GetDouble());
             }
         }
     }
@@ -20,6 +20,12 @@
 const int indentSpaces = 11;
 const string initialVariablePrefix = "orig*";
 
+// True if the TraceN() macros below will write, so expensive arguments can be skipped otherwise
+static bool IsTraceOn(bool fullTrace)
+{
+    return ((int) SystemTraceType::Solver & NanoTrace::Global().allowedTraceType()) && ((fullTrace ? TraceDetail::Normal : TraceDetail::Diagnostic) <= NanoTrace::Global().detailLevel());
+}
+
 #define Trace0(status, trace, indent, fullTrace) \
 TraceString("HtnGoalResolver::Resolve " + string((indent) * indentSpaces, ' ') + status + trace, \
 SystemTraceType::Solver, (fullTrace ? TraceDetail::Normal :TraceDetail::Diagnostic));
@@ -65,8 +71,10 @@ SystemTraceType::Solver, (fullTrace ? TraceDetail::Normal :TraceDetail::Diagnost
 arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8);
 
 ResolveNode::ResolveNode(shared_ptr<vector<shared_ptr<HtnTerm>>> resolventArg, shared_ptr<UnifierType> unifierArg) :
+    checkedFrameBelow(false),
     continuePoint(ResolveContinuePoint::NextGoal),
     currentRuleIndex(-1),
+    droppedFrames(0),
     originalGoalCount((int) resolventArg->size() - 1),
     unifier(unifierArg),
     cachedDynamicSize(-1),
@@ -78,6 +86,59 @@ ResolveNode::ResolveNode(shared_ptr<vector<shared_ptr<HtnTerm>>> resolventArg, s
 {
 }
 
+// A cut start stays since the cut goes back to it, Return nodes only pop and NextRuleThatUnifies nodes that don't have any
+// rules left would only fail once their child is done. Looking at the next clause without unifying it may say there is
+// one when it won't unify, that only means the node is kept
+bool ResolveNode::IsDeterminate()
+{
+    shared_ptr<HtnTerm> goal = currentGoal();
+    if(goal != nullptr && goal->isAtom(HtnAtom::CutStart))
+    {
+        return false;
+    }
+    else if(continuePoint == ResolveContinuePoint::Return)
+    {
+        return true;
+    }
+    else if(continuePoint == ResolveContinuePoint::NextRuleThatUnifies)
+    {
+        if(ruleCursor != nullptr)
+        {
+            return ruleCursor->Peek() == nullptr;
+        }
+        else
+        {
+            return rulesThatUnify == nullptr || currentRuleIndex + 1 >= (int) rulesThatUnify->size();
+        }
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool ResolveNode::SetNextRule(HtnTermFactory *termFactory)
+{
+    currentRuleIndex++;
+    if(ruleCursor == nullptr)
+    {
+        return rulesThatUnify != nullptr && currentRuleIndex < (int) rulesThatUnify->size();
+    }
+
+    shared_ptr<HtnTerm> goal = currentGoal();
+    for(const HtnRule *rule = ruleCursor->Next(); rule != nullptr; rule = ruleCursor->Next())
+    {
+        if(HtnGoalResolver::UnifyRule(termFactory, *rule, goal, cursorRule))
+        {
+            return true;
+        }
+    }
+
+    ruleCursor = nullptr;
+    cursorRule = RuleBindingType();
+    return false;
+}
+
 void ResolveNode::AddToSolutions(shared_ptr<vector<UnifierType>> &solutions)
 {
     if(solutions == nullptr)
@@ -170,12 +231,9 @@ shared_ptr<ResolveNode> ResolveNode::CreateChildNode(HtnTermFactory *termFactory
     shared_ptr<UnifierType> simplifiedUnifier = RemoveUnusedUnifiers(variablesToKeep, *childUnifier, originalGoals, *childResolvent);
     
     // Apply new substitutions to new Resolvent
-    for(auto assignment : additionalSubstitution)
+    for(shared_ptr<HtnTerm> &goal : *childResolvent)
     {
-        for(shared_ptr<HtnTerm> &goal : *childResolvent)
-        {
-            goal = goal->SubstituteTermForVariable(termFactory, assignment.second, assignment.first);
-        }
+        goal = HtnGoalResolver::SubstituteUnifiers(termFactory, additionalSubstitution, goal);
     }
     
     shared_ptr<ResolveNode> newNode = shared_ptr<ResolveNode>(new ResolveNode(childResolvent, simplifiedUnifier));
@@ -324,6 +382,7 @@ ResolveState::ResolveState(HtnTermFactory *termFactoryArg, HtnRuleSet *progArg,
     highestMemoryUsed(0),
     initialIndent(initialIndentArg),
     memoryBudget(memoryBudgetArg),
+    measuredNodesSize(0),
     prog(progArg),
     resolveStack(shared_ptr<vector<shared_ptr<ResolveNode>>>(new vector<shared_ptr<ResolveNode>>())),
     ruleMemoryUsed(0),
@@ -366,6 +425,38 @@ string ResolveState::GetStackString()
     return stackString.str();
 }
 
+void ResolveState::RemeasureStackFrom(size_t index)
+{
+    while(measuredNodes.size() > index)
+    {
+        measuredNodesSize -= measuredNodes.back().second;
+        measuredNodes.pop_back();
+    }
+}
+
+// Nodes are only pushed onto the top of the stack and popped or erased from it, never put under another node. So a node that
+// is still where it was last measured has only had nodes above it change. Its size hasn't changed either since only the top node is
+// worked on, except for the node a cut stops, which RemeasureStackFrom() handles. Only the nodes above it need to be measured again,
+// along with the old top node since it was being worked on. This keeps a running total that only changes for the nodes that changed.
+void ResolveState::UpdateStackMemory()
+{
+    vector<shared_ptr<ResolveNode>> &stack = *resolveStack;
+    size_t unchangedCount = std::min(measuredNodes.size() == 0 ? 0 : measuredNodes.size() - 1, stack.size());
+    while(unchangedCount > 0 && measuredNodes[unchangedCount - 1].first != stack[unchangedCount - 1])
+    {
+        unchangedCount--;
+    }
+    
+    RemeasureStackFrom(unchangedCount);
+    for(size_t index = unchangedCount; index < stack.size(); ++index)
+    {
+        stack[index]->CalcDynamicSize();
+        int64_t size = stack[index]->dynamicSize();
+        measuredNodes.push_back(MeasuredNodeType(stack[index], size));
+        measuredNodesSize += size;
+    }
+}
+
 void ResolveState::RecordFailure(shared_ptr<HtnTerm> goal, shared_ptr<ResolveNode> currentNode)
 {
     // Which original goal is failing? It is the one *before* the goalsLeftToProcess
@@ -375,7 +466,7 @@ void ResolveState::RecordFailure(shared_ptr<HtnTerm> goal, shared_ptr<ResolveNod
     FailFastAssert(originalGoalIndex >= 0 && originalGoalIndex < initialGoals->size());
     
     shared_ptr<HtnTerm> originalGoalInProgress = (*initialGoals)[originalGoalIndex];
-    int stackDepth = (int) resolveStack->size();
+    int stackDepth = (int) resolveStack->size() + currentNode->droppedFrames;
     
     // Replace the failure context if we've gotten to a new original goal OR
     // If we've gotten farther along in the current original goal since that will be a better error
@@ -408,7 +499,7 @@ void ResolveState::RecordFailure(shared_ptr<HtnTerm> goal, shared_ptr<ResolveNod
 int64_t ResolveState::RecordMemoryUsage(int64_t &initialTermMemory, int64_t &initialRuleSetMemory)
 {
     stackMemoryUsed = dynamicSize();
-    int currentTermMemory = (int) termFactory->dynamicSize();
+    int currentTermMemory = (int) termFactory->budgetedSize();
     int currentRuleSetMemory = (int) prog->dynamicSize();
     
     termMemoryUsed += currentTermMemory - initialTermMemory;
@@ -417,7 +508,12 @@ int64_t ResolveState::RecordMemoryUsage(int64_t &initialTermMemory, int64_t &ini
     int64_t totalMemoryUsed = termMemoryUsed + ruleMemoryUsed + stackMemoryUsed;
     if(totalMemoryUsed > highestMemoryUsed)
     {
-        highestMemoryUsedStack = GetStackString();        
+        // Building the stack string walks the whole stack, so only do it if a trace will report it
+        if(IsTraceOn(fullTrace))
+        {
+            highestMemoryUsedStack = GetStackString();
+        }
+        
         highestMemoryUsed = totalMemoryUsed;
 //        Trace5("MEMORY     ", "ResolveState::RecordMemoryUsage Highpoint: highestMemoryUsed:{0}, termMemoryUsed:{1}, ruleMemoryUsed:{2}, stackMemoryUsed:{3}, highestMemoryUsedStack:{4}", 0, true,
 //               totalMemoryUsed, termMemoryUsed, ruleMemoryUsed, stackMemoryUsed, GetStackString());
@@ -523,7 +619,7 @@ void HtnGoalResolver::AddCustomRule(const string &name, HtnGoalResolver::CustomR
 }
 
 // Finds all rules where the head can be unified with goal, returns the rule and the substitutions required to do it
-shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTermFactory *termFactory, HtnRuleSet *prog, shared_ptr<HtnTerm> goal, int *uniquifier, int indentLevel, int memoryBudget, bool fullTrace, int64_t *highestMemoryUsedReturn)
+shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTermFactory *termFactory, HtnRuleSet *prog, shared_ptr<HtnTerm> goal, int indentLevel, int memoryBudget, bool fullTrace, int64_t *highestMemoryUsedReturn)
 {
     int64_t memoryValue;
     if(highestMemoryUsedReturn == nullptr) { highestMemoryUsedReturn = &memoryValue; }
@@ -580,7 +676,7 @@ shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTe
         // OK, Now we actually try to look up real rules.
         // Because this could use a lot of memory, we actually watch for memory usage here and
         // fail out if we hit the budget
-        int64_t initialTermMemory = termFactory->dynamicSize();
+        int64_t initialTermMemory = termFactory->budgetedSize();
         int64_t initialRuleSetMemory = prog->dynamicSize();
         int64_t memoryUsed = 0;
         
@@ -589,7 +685,7 @@ shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTe
         prog->AllRulesThatCouldUnify(goal.get(), [&](const HtnRule &item)
         {
             // If we ran out of memory budget, return whatever we found
-            int64_t totalMemoryUsed = (termFactory->dynamicSize() - initialTermMemory) + (prog->dynamicSize() - initialRuleSetMemory) + memoryUsed;
+            int64_t totalMemoryUsed = (termFactory->budgetedSize() - initialTermMemory) + (prog->dynamicSize() - initialRuleSetMemory) + memoryUsed;
             *highestMemoryUsedReturn = std::max(*highestMemoryUsedReturn, totalMemoryUsed);
             if(totalMemoryUsed > memoryBudget)
             {
@@ -600,26 +696,15 @@ shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTe
         
             // Unify
             foundRule = true;
-            shared_ptr<UnifierType> substitutions = HtnGoalResolver::Unify(termFactory, item.head(), goal);
-            if(substitutions != nullptr)
-            {
-                // IF the unification works, make the variables in the rule unique,
-                // since this is expensive in the inner loop
-                string uniquifierString = goal->name() + lexical_cast<string>(*uniquifier) + "_";
-                std::map<std::string, std::shared_ptr<HtnTerm>> variableMap;
-                shared_ptr<HtnRule> currentRule = item.MakeVariablesUnique(termFactory, uniquifierString, variableMap);
-                *uniquifier = (*uniquifier) + 1;
-
-                // Also need to fix up the substitutions to use the new values since we renamed them
-                for(UnifierItemType &item : *substitutions)
-                {
-                    item.first = item.first->RenameVariables(termFactory, variableMap);
-                    item.second = item.second->RenameVariables(termFactory, variableMap);
-                }
-
-                foundRules->push_back(RuleBindingType(currentRule, *substitutions));
+            foundRules->push_back(RuleBindingType());
+            if(UnifyRule(termFactory, item, goal, foundRules->back()))
+            {
                 memoryUsed += sizeof(RuleBindingType) + foundRules->back().second.size() * sizeof(UnifierItemType);
             }
+            else
+            {
+                foundRules->pop_back();
+            }
                 
             // Keep going
             return true;
@@ -635,6 +720,149 @@ shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllRulesThatUnify(HtnTe
     }
 }
 
+// Tabled calls are resolved against the answers in the table, which are found the first time the call (or one that only differs
+// by the names of its variables) is made in this state. Answers are just facts so they are handled like FindAllRulesThatUnify() handles facts.
+// Returns nullptr if the goal should be resolved against its clauses instead
+shared_ptr<vector<RuleBindingType>> HtnGoalResolver::FindAllTabledAnswers(ResolveState *state, shared_ptr<HtnTerm> goal, int indentLevel, int memoryBudget, int64_t *highestMemoryUsedReturn)
+{
+    HtnTermFactory *termFactory = state->termFactory;
+    shared_ptr<HtnAnswerTable> table = state->prog->answerTable();
+    lock_guard<recursive_mutex> lock(table->mutex);
+    bool created;
+    HtnAnswerTable::Entry *entry = table->Find(TableVariant(termFactory, goal), &created);
+    if(table->expanding == entry)
+    {
+        // This is the call EvaluateTable() is finding answers for
+        table->expanding = nullptr;
+        return nullptr;
+    }
+
+    *highestMemoryUsedReturn = 0;
+    if(!entry->complete)
+    {
+        if(entry->depth == -1)
+        {
+            EvaluateTable(state, table.get(), entry, indentLevel, memoryBudget, highestMemoryUsedReturn);
+        }
+        else
+        {
+            // Recursive call: use the answers found so far and the entry being evaluated will go again if they weren't all of them
+            HtnAnswerTable::Entry *caller = table->stack.back();
+            caller->lowLink = std::min(caller->lowLink, entry->depth);
+        }
+    }
+
+    Trace3("TABLE      ", "goal:{0}, {1} answers, complete:{2}", indentLevel, state->fullTrace, goal->ToString(), entry->answers.size(), entry->complete);
+    shared_ptr<vector<RuleBindingType>> foundRules(new vector<RuleBindingType>());
+    for(const shared_ptr<HtnRule> &answer : entry->answers)
+    {
+        shared_ptr<HtnRule> rule = answer;
+        if(!answer->head()->isGround())
+        {
+            // Rename before unifying since the answer has the same variable names every time
+            vector<HtnTerm *> variables;
+            vector<shared_ptr<HtnTerm>> newVariables;
+            rule = answer->RenameVariables(termFactory, variables, newVariables);
+        }
+
+        shared_ptr<UnifierType> substitutions = HtnGoalResolver::Unify(termFactory, rule->head(), goal);
+        if(substitutions != nullptr)
+        {
+            foundRules->push_back(RuleBindingType(rule, *substitutions));
+        }
+    }
+
+    return foundRules;
+}
+
+// Finds all the answers for the call in entry by resolving it against its clauses. If that used answers from an entry that was still
+// being evaluated (i.e. it is recursive), it is repeated until no new answers are found, which is what makes left recursion terminate.
+// Entries that used answers from an entry lower on the stack aren't complete until that one is
+// The answers are counted in the memory of the RuleSet, highestMemoryUsedReturn is the most the resolves used along the way
+void HtnGoalResolver::EvaluateTable(ResolveState *state, HtnAnswerTable *table, HtnAnswerTable::Entry *entry, int indentLevel, int memoryBudget, int64_t *highestMemoryUsedReturn)
+{
+    HtnTermFactory *termFactory = state->termFactory;
+    int64_t initialTableMemory = table->dynamicSize();
+    entry->depth = (int) table->stack.size();
+    entry->lowLink = entry->depth + 1;
+    table->stack.push_back(entry);
+    size_t firstIncomplete = table->incomplete.size();
+    int64_t answerCount;
+    do
+    {
+        answerCount = table->answerCount;
+        // Answers from earlier passes are part of the budget for this one
+        int64_t tableMemoryUsed = table->dynamicSize() - initialTableMemory;
+        int64_t resolveMemoryUsed = 0;
+        table->expanding = entry;
+        shared_ptr<vector<UnifierType>> solutions = ResolveAll(termFactory, state->prog, { entry->call }, indentLevel, (int) (memoryBudget - tableMemoryUsed), &resolveMemoryUsed);
+        *highestMemoryUsedReturn = std::max(*highestMemoryUsedReturn, tableMemoryUsed + resolveMemoryUsed);
+        
+        // Running out of memory can stop the resolve before it gets to the call
+        table->expanding = nullptr;
+        if(solutions != nullptr)
+        {
+            for(const UnifierType &solution : *solutions)
+            {
+                table->AddAnswer(entry, TableVariant(termFactory, SubstituteUnifiers(termFactory, solution, entry->call)));
+            }
+        }
+    } while(!termFactory->outOfMemory() && entry->lowLink <= entry->depth && table->answerCount != answerCount);
+
+    table->stack.pop_back();
+    entry->depth = -1;
+    if(termFactory->outOfMemory())
+    {
+        // The answers so far are right but there may be more, everything will be evaluated again the next time it is called
+        table->incomplete.resize(firstIncomplete);
+    }
+    else if(entry->lowLink >= (int) table->stack.size())
+    {
+        // Nothing lower on the stack was used, so this entry and the ones that were waiting on it have all their answers
+        entry->complete = true;
+        for(size_t index = firstIncomplete; index < table->incomplete.size(); ++index)
+        {
+            table->incomplete[index]->complete = true;
+        }
+
+        table->incomplete.resize(firstIncomplete);
+    }
+    else
+    {
+        table->incomplete.push_back(entry);
+        table->stack.back()->lowLink = std::min(table->stack.back()->lowLink, entry->lowLink);
+    }
+}
+
+bool HtnGoalResolver::UnifyRule(HtnTermFactory *termFactory, const HtnRule &rule, const shared_ptr<HtnTerm> &goal, RuleBindingType &binding)
+{
+    shared_ptr<UnifierType> substitutions = HtnGoalResolver::UnifyCompiled(termFactory, *rule.headProgram(), goal);
+    if(substitutions == nullptr)
+    {
+        return false;
+    }
+
+    // IF the unification works, make the variables in the rule unique,
+    // since this is expensive in the inner loop. The rule numbers its variables once so renaming
+    // only needs one new variable per slot, in a new frame
+    vector<HtnTerm *> variables;
+    vector<shared_ptr<HtnTerm>> newVariables;
+    binding.first = rule.RenameVariables(termFactory, variables, newVariables);
+
+    // Also need to fix up the substitutions to use the new values since we renamed them
+    if(variables.size() > 0)
+    {
+        for(UnifierItemType &item : *substitutions)
+        {
+            item.first = item.first->RenameVariables(termFactory, variables, newVariables);
+            item.second = item.second->RenameVariables(termFactory, variables, newVariables);
+        }
+    }
+
+    binding.second = std::move(*substitutions);
+    return true;
+}
+
 shared_ptr<HtnTerm> HtnGoalResolver::FindTermEquivalence(const UnifierType &unifier, const HtnTerm &termToFind)
 {
     for(auto item : unifier)
@@ -723,6 +951,8 @@ bool HtnGoalResolver::IsGround(UnifierType *unifier)
 shared_ptr<vector<UnifierType>> HtnGoalResolver::ResolveAll(HtnTermFactory *termFactory, HtnRuleSet *prog, const vector<shared_ptr<HtnTerm>> &initialGoals, int initialIndent, int memoryBudget, int64_t *highestMemoryUsedReturn, int *furthestFailureIndex, std::vector<std::shared_ptr<HtnTerm>> *farthestFailureContext)
 {
     Trace3("ALL BEGIN  ", "goals:{0}, termStringsMemorySize:{1}, termOtherMemorySize:{2}", initialIndent, false, HtnTerm::ToString(initialGoals), termFactory->stringSize(), termFactory->otherAllocationSize());
+    // Most of the terms created while resolving are gone by the time we return
+    HtnTermArenaScope arenaScope(termFactory);
 
     shared_ptr<ResolveState> state = shared_ptr<ResolveState>(new ResolveState(termFactory, prog, initialGoals, initialIndent, memoryBudget));
     shared_ptr<vector<UnifierType>> solutions = shared_ptr<vector<UnifierType>>(new vector<UnifierType>());
@@ -778,7 +1008,9 @@ shared_ptr<vector<UnifierType>> HtnGoalResolver::ResolveAll(HtnTermFactory *term
                HtnTerm::ToString(state->farthestFailureContext));
     }
         
-    // Get a read on memory after we release state which is what it will look like when we return
+    // Get a read on memory after we release state which is what it will look like when we return. What it created that isn't
+    // in solutions is released in bulk
+    arenaScope.Release();
     state = nullptr;
     
     Trace5("ALL END    ", "Query: {0} -> {1}, termStrings:{2}, termOther:{3}", initialIndent, false, HtnTerm::ToString(initialGoals), false, ToString(solutions.get()), termFactory->stringSize(), termFactory->otherAllocationSize());
@@ -817,7 +1049,7 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
 
     // Because terms and rules can be created in between calls to ResolveNext,
     // we need to determine how much of these we use each time
-    int64_t initialTermMemory = termFactory->dynamicSize();
+    int64_t initialTermMemory = termFactory->budgetedSize();
     int64_t initialRuleSetMemory = prog->dynamicSize();
     
     while(resolveStack->size() > 0)
@@ -826,13 +1058,34 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
         int indentLevel = (int) (initialIndent + resolveStack->size());
         shared_ptr<ResolveNode> currentNode = resolveStack->back();
 
+        // Last call optimization: the first time a node is at the top, the nodes under it are dropped if they have nothing left to do but pop
+        // when this one is done, so tail recursion and long conjunctions run in constant stack space. There can be more than one since a cut
+        // leaves the node it cut with nothing to do. Except under a cut start since the cut stops the alternatives of the node under it
+        if(!currentNode->checkedFrameBelow)
+        {
+            currentNode->checkedFrameBelow = true;
+            if(resolveStack->size() > 1)
+            {
+                currentNode->droppedFrames = (*resolveStack)[resolveStack->size() - 2]->droppedFrames;
+                shared_ptr<HtnTerm> goal = currentNode->currentGoal();
+                if(goal == nullptr || !goal->isAtom(HtnAtom::CutStart))
+                {
+                    while(resolveStack->size() > 1 && (*resolveStack)[resolveStack->size() - 2]->IsDeterminate())
+                    {
+                        currentNode->droppedFrames++;
+                        resolveStack->erase(resolveStack->end() - 2);
+                    }
+                }
+            }
+        }
+
         // Consistent place to check for memory used so it is checked regularly but not constantly
         int64_t totalMemoryUsed = state->RecordMemoryUsage(initialTermMemory, initialRuleSetMemory);
         if(totalMemoryUsed > state->memoryBudget)
         {
             // Out of memory: don't return the current solution since it is not done, and don't allow continuing
             // Since we're in an unknown state
-            Trace6("MEMORY     ", "***** OUT OF MEMORY ***** used:{0}, budget:{1}, totalTermMemory:{2}, totalRulesetMemory:{3}, stackMemory:{4}, highestMemoryStack:{5}", indentLevel, true, totalMemoryUsed, state->memoryBudget, termFactory->dynamicSize(), prog->dynamicSize(), state->stackMemoryUsed, state->highestMemoryUsedStack);
+            Trace6("MEMORY     ", "***** OUT OF MEMORY ***** used:{0}, budget:{1}, totalTermMemory:{2}, totalRulesetMemory:{3}, stackMemory:{4}, highestMemoryStack:{5}", indentLevel, true, totalMemoryUsed, state->memoryBudget, termFactory->dynamicSize(), prog->dynamicSize(), state->stackMemoryUsed, state->GetStackString());
             state->termFactory->outOfMemory(true);
             currentNode->continuePoint = ResolveContinuePoint::ProgramError;
             return nullptr;
@@ -847,41 +1100,6 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
             }
             break;
 
-			case ResolveContinuePoint::Cut:
-			{
-				// We have returned from processing after a cut and reached the cut point again
-				// Now we need to pop the stack until we get to the point where the rule that contains 
-				// this cut was introduced and remove them all so that we don't backtrack on them
-				// The part of the stack that will get skipped is bounded by goals "!>(ID)" at the beginning
-				// and "!<(ID)" at the end (this node)
-				// Thus, we pop the stack until we find the start node that matches the ID of this one
-				string cutID = currentNode->currentGoal()->arguments()[0]->name();
-				bool found = false;
-				while (resolveStack->size() > 0)
-				{
-					shared_ptr<HtnTerm> goal = resolveStack->back()->currentGoal();
-					resolveStack->pop_back();
-					if(goal != nullptr && goal->name() == "!>" && goal->arguments()[0]->name() == cutID)
-					{
-						// Found it!
-						found = true;
-						break;
-					}
-				}
-
-				// Now, we need to stop the last node before the cut from processing any alternatives
-				// If the stack is empty we encountered a degenerate case where the entire thing we were
-				// asked to resolve started with "!", which is meaningless so we can ignore
-				FailFastAssert(found);
-				if(resolveStack->size() > 0)
-				{
-					resolveStack->back()->SetCut();
-				}
-
-				// And then let it continue on processing this node
-			}
-			break;
-
             case ResolveContinuePoint::NextGoal:
             {
                 // Get the next goal on the list of resolvents
@@ -898,7 +1116,7 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
                     }
                 }
 				// If it is the start of a cut we just ignore it and keep going since it is just a marker on the stack
-				else if (goal->name() == "!>")
+				else if (goal->isAtom(HtnAtom::CutStart))
 				{
 					// There must always be at least one goal after a start, even if it is only "!"
 					FailFastAssert(!currentNode->IsLastGoalInResolvent());
@@ -910,19 +1128,54 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
 
 					Trace2("CUTSTART   ", "goal:{0}, resolvent:{1}", indentLevel, state->fullTrace, goal->ToString(), HtnTerm::ToString(*currentNode->resolvent()));
 				}
-				// We are executing a cut end, nothing happens until we get back to this point
-				else if (goal->name() == "!<")
+				// We are executing a cut end
+				else if (goal->isAtom(HtnAtom::CutEnd))
 				{
 					// When we reach a goal that is a cut, we should prevent all backtracking before this point
-					// *for this clause*.  So, succeed for this goal, continue processing goals, 
-					// but when we get back to this point on the tree again, jump back to the stack frame which
-					// represents the start of the "fence" for this cut, which is right before the goal
-					// just return whatever solutions we have found
-					currentNode->continuePoint = ResolveContinuePoint::Cut;
+					// *for this clause*.  So remove the part of the stack that would have been backtracked into now, so it
+					// doesn't stay on the stack while the rest of the clause runs and tail recursion after a cut doesn't grow it.
+					// It is bounded by goals "!>(ID)" at the beginning and "!<(ID)" at the end (this node).
+					// IDs are interned so they can be compared by pointer
+					const string *cutID = goal->arguments()[0]->m_namePtr;
+					int cutStartIndex = (int) resolveStack->size() - 2;
+					while(cutStartIndex >= 0)
+					{
+						shared_ptr<HtnTerm> startGoal = (*resolveStack)[cutStartIndex]->currentGoal();
+						if(startGoal != nullptr && startGoal->isAtom(HtnAtom::CutStart) && startGoal->arguments()[0]->m_namePtr == cutID)
+						{
+							break;
+						}
+
+						cutStartIndex--;
+					}
+
+					FailFastAssert(cutStartIndex >= 0);
+
+					// A clause with more than one cut needs the start to still be there for the next one
+					const vector<shared_ptr<HtnTerm>> &resolvent = *currentNode->resolvent();
+					bool hasAnotherCut = false;
+					for(auto resolventIter = resolvent.begin() + 1; !hasAnotherCut && resolventIter != resolvent.end(); ++resolventIter)
+					{
+						hasAnotherCut = (*resolventIter)->isAtom(HtnAtom::CutEnd) && (*resolventIter)->arguments()[0]->m_namePtr == cutID;
+					}
+
+					int firstErased = hasAnotherCut ? cutStartIndex + 1 : cutStartIndex;
+					currentNode->droppedFrames += (int) resolveStack->size() - 1 - firstErased;
+					resolveStack->erase(resolveStack->begin() + firstErased, resolveStack->end() - 1);
+
+					// Now, we need to stop the last node before the cut from processing any alternatives
+					// If there isn't one we encountered a degenerate case where the entire thing we were
+					// asked to resolve started with "!", which is meaningless so we can ignore
+					if(cutStartIndex > 0)
+					{
+						(*resolveStack)[cutStartIndex - 1]->SetCut();
+						state->RemeasureStackFrom(cutStartIndex - 1);
+					}
 
 					// Cut resolves to true so no new terms, no unifiers got added since it it is not unified
 					// Nothing to process on children so no special return handling
 					resolveStack->push_back(currentNode->CreateChildNode(termFactory, *state->initialGoals, {}, {}, &uniquifier));
+					currentNode->continuePoint = ResolveContinuePoint::Return;
 
 					Trace2("CUTEND     ", "goal:{0}, resolvent:{1}", indentLevel, state->fullTrace, goal->ToString(), HtnTerm::ToString(*currentNode->resolvent()));
 				}
@@ -942,7 +1195,8 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
                     }
                     else
                     {
-                        CustomRulesType::iterator foundCustomRule = m_customRules.find(goal->name());
+                        // Goal isn't a variable so its name can be used directly without the copy name() makes
+                        CustomRulesType::iterator foundCustomRule = m_customRules.find(*goal->m_namePtr);
                         if(foundCustomRule != m_customRules.end())
                         {
                             // This is a custom rule that will potentially add to currentNode->rulesThatUnify and be handled just like the default case
@@ -953,22 +1207,42 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
                         {
                             // Not custom, just handle normally
                             int64_t FindAllRulesThatUnifyHighestMemory = 0;
-                            currentNode->rulesThatUnify = FindAllRulesThatUnify(termFactory, prog, goal, &uniquifier, indentLevel, (int)(memoryBudget - totalMemoryUsed), state->fullTrace, &FindAllRulesThatUnifyHighestMemory);
+                            if(prog->IsTabled(goal.get()))
+                            {
+                                currentNode->rulesThatUnify = FindAllTabledAnswers(state, goal, indentLevel, (int)(memoryBudget - totalMemoryUsed), &FindAllRulesThatUnifyHighestMemory);
+                            }
+
+                            if(currentNode->rulesThatUnify == nullptr)
+                            {
+                                if(goal->isTrue() || goal->isArithmetic())
+                                {
+                                    currentNode->rulesThatUnify = FindAllRulesThatUnify(termFactory, prog, goal, indentLevel, (int)(memoryBudget - totalMemoryUsed), state->fullTrace, &FindAllRulesThatUnifyHighestMemory);
+                                }
+                                else
+                                {
+                                    // Clauses in the database are only unified when NextRuleThatUnifies gets to them since
+                                    // first(), cuts, etc. often don't need more than one
+                                    currentNode->ruleCursor = make_shared<HtnRuleSet::RuleCursor>(*prog, goal.get());
+                                }
+                            }
                             state->highestMemoryUsed = std::max(state->highestMemoryUsed, totalMemoryUsed + FindAllRulesThatUnifyHighestMemory);
                             if(termFactory->outOfMemory())
                             {
                                 // Finding rules can require lots of memory so we check for OOM here
-                                Trace5("MEMORY     ", "***** OUT OF MEMORY ***** used:{0}, budget:{1}, totalTermMemory:{2}, totalRulesetMemory:{3}, highestMemoryStack:{4}", indentLevel, true, totalMemoryUsed, state->memoryBudget, termFactory->dynamicSize(), prog->dynamicSize(), state->highestMemoryUsedStack);
+                                Trace5("MEMORY     ", "***** OUT OF MEMORY ***** used:{0}, budget:{1}, totalTermMemory:{2}, totalRulesetMemory:{3}, highestMemoryStack:{4}", indentLevel, true, totalMemoryUsed, state->memoryBudget, termFactory->dynamicSize(), prog->dynamicSize(), state->GetStackString());
                                 currentNode->continuePoint = ResolveContinuePoint::ProgramError;
                             }
                             else
                             {
                                 currentNode->continuePoint = ResolveContinuePoint::NextRuleThatUnifies;
-                                if(currentNode->rulesThatUnify->size() == 0)
+                                if(currentNode->rulesThatUnify != nullptr)
                                 {
-                                    state->RecordFailure(goal, currentNode);
+                                    if(currentNode->rulesThatUnify->size() == 0)
+                                    {
+                                        state->RecordFailure(goal, currentNode);
+                                    }
+                                    Trace1("           ", "found:{0} rules that unify", indentLevel, state->fullTrace, currentNode->rulesThatUnify->size());
                                 }
-                                Trace1("           ", "found:{0} rules that unify", indentLevel, state->fullTrace, currentNode->rulesThatUnify->size());
                             }
                         }
                     }
@@ -986,7 +1260,9 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
             case ResolveContinuePoint::NextRuleThatUnifies:
             {
                 // Go through each rule that unified and explore the part of the tree with that alternative
-                if(currentNode->SetNextRule())
+                bool usesCursor = currentNode->ruleCursor != nullptr;
+                bool hasNoRules = usesCursor && currentNode->currentRuleIndex == -1 && currentNode->ruleCursor->Peek() == nullptr;
+                if(currentNode->SetNextRule(termFactory))
                 {
                     RuleBindingType ruleBinding = currentNode->currentRule();
                     Trace1("           ", "rule:{0}", indentLevel, state->fullTrace, ruleBinding.first->ToString());
@@ -995,6 +1271,18 @@ shared_ptr<UnifierType> HtnGoalResolver::ResolveNext(ResolveState *state)
                 }
                 else
                 {
+                    if(usesCursor && currentNode->currentRuleIndex == 0)
+                    {
+                        shared_ptr<HtnTerm> goal = currentNode->currentGoal();
+                        if(hasNoRules)
+                        {
+                            // Very common issue is to pass the wrong name or arguments so give a message here
+                            Trace3("FAIL       ", "no {1} rule with {2} arguments - goal:{0}", 0, true, goal->ToString(), goal->name(), goal->arity());
+                        }
+                        
+                        state->RecordFailure(goal, currentNode);
+                    }
+
                     // No more rules, thus there are no more solutions to find in this part of the tree
                     resolveStack->pop_back();
                 }
@@ -1498,7 +1786,7 @@ void HtnGoalResolver::RuleCount(ResolveState *state)
 
             // We treat this as a rule where the variable got unified with the result. So, there are no new goals to add, but there are new unifiers
             // Nothing to do on return
-            UnifierType exprUnifier( { UnifierItemType(variable, termFactory->CreateConstant(lexical_cast<string>(count)) ) } );
+            UnifierType exprUnifier( { UnifierItemType(variable, termFactory->CreateConstant(count) ) } );
             resolveStack->push_back(currentNode->CreateChildNode(termFactory, *state->initialGoals, {}, exprUnifier, &(state->uniquifier)));
             currentNode->continuePoint = ResolveContinuePoint::Return;
             
@@ -2218,50 +2506,51 @@ void HtnGoalResolver::RuleRetract(ResolveState* state)
 			}
             else
             {
+                // Removes the first fact that unifies with term and binds its variables. Only the facts with the same name and arity that
+                // could match are visited, using the argument indexes if there are any. Facts with variables can't be removed from the state so they are skipped
                 shared_ptr<HtnTerm> term = goal->arguments()[0];
-                vector<shared_ptr<HtnTerm>> retractList;
-                if (term->isGround())
+                shared_ptr<HtnTerm> fact;
+                shared_ptr<UnifierType> factUnifier;
+                if(term->isGround())
                 {
                     if(prog->HasFact(term))
                     {
-                        retractList.push_back(term);
-                    }
-                    else
-                    {
-                        Trace1("FAIL       ", "retract() rule failed, fact doesn't exist: {0}", state->initialIndent + resolveStack->size(), state->fullTrace, term->ToString());
-                        state->RecordFailure(goal, currentNode);
-                        resolveStack->pop_back();
-                        return;
+                        fact = term;
+                        factUnifier = shared_ptr<UnifierType>(new UnifierType());
                     }
                 }
                 else
                 {
-                    // TODO: What to do?
-                    StaticFailFastAssert(false);
-                    //prog->AllRules([&](const HtnRule & item)
-                    //	{
-                    //		if (item.IsFact() && item.head()->isEquivalentCompoundTerm(term))
-                    //		{
-                    //			shared_ptr<UnifierType> sub = Unify(termFactory, item.head(), term);
-                    //			if (sub != nullptr)
-                    //			{
-                    //				shared_ptr<HtnTerm> newTerm = SubstituteUnifiers(termFactory, *sub, term);
-                    //				// Should be ground since we are unifying with a fact
-                    //				StaticFailFastAssert(newTerm->isGround());
-                    //				retractList.push_back(newTerm);
-                    //			}
-                    //		}
-
-                    //		return true;
-                    //	});
+                    prog->AllRulesThatCouldUnify(term.get(), [&](const HtnRule &item)
+                    {
+                        if(item.IsFact() && item.head()->isGround())
+                        {
+                            factUnifier = HtnGoalResolver::UnifyCompiled(termFactory, *item.headProgram(), term);
+                            if(factUnifier != nullptr)
+                            {
+                                fact = item.head();
+                                return false;
+                            }
+                        }
+                        
+                        return true;
+                    });
+                }
+                
+                if(fact == nullptr)
+                {
+                    Trace1("FAIL       ", "retract() rule failed, fact doesn't exist: {0}", state->initialIndent + resolveStack->size(), state->fullTrace, term->ToString());
+                    state->RecordFailure(goal, currentNode);
+                    resolveStack->pop_back();
+                    return;
                 }
 
-                // Remove this fact into the database.
-                prog->Update(termFactory, retractList, {});
+                // Remove this fact from the database.
+                prog->Update(termFactory, { fact }, {});
 
-                // Rule resolves to true so no new terms, no unifiers got added since it it is not unified
+                // Rule resolves to true so no new terms, the unifiers are the variables in term that the fact bound
                 // Nothing to process on children so no special return handling
-                resolveStack->push_back(currentNode->CreateChildNode(termFactory, *state->initialGoals, {}, {}, &(state->uniquifier)));
+                resolveStack->push_back(currentNode->CreateChildNode(termFactory, *state->initialGoals, {}, *factUnifier, &(state->uniquifier)));
                 currentNode->continuePoint = ResolveContinuePoint::Return;
             }
         }
@@ -2298,14 +2587,14 @@ void HtnGoalResolver::RuleRetractAll(ResolveState* state)
             {
                 shared_ptr<HtnTerm> term = goal->arguments()[0];
                 vector<shared_ptr<HtnTerm>> factsToRemove;
-                prog->AllRules([&](const HtnRule &item)
+                // Only rules with the same name and arity that could match are visited, using the argument indexes if there are any.
+                // They are all removed with one update after the walk since it can't change the rules while walking them
+                prog->AllRulesThatCouldUnify(term.get(), [&](const HtnRule &item)
                    {
-                       // We only remove facts, so skip rules
-                       // Don't bother if they are not "equivalent" (i.e. the name and term count doesn't match)
-                       // because it can't unify
-                       if(item.IsFact() && (item.head()->isEquivalentCompoundTerm(term.get())))
+                       // We only remove facts, so skip rules. Facts with variables can't be removed from the state either
+                       if(item.IsFact() && item.head()->isGround())
                        {
-                           shared_ptr<UnifierType> sub = HtnGoalResolver::Unify(termFactory, item.head(), term);
+                           shared_ptr<UnifierType> sub = HtnGoalResolver::UnifyCompiled(termFactory, *item.headProgram(), term);
                            
                            if(sub != nullptr)
                            {
@@ -2444,14 +2733,12 @@ void HtnGoalResolver::RuleSortBy(ResolveState *state)
                     StaticFailFastAssert(found);
                 }
                 
-                // Sort them
-                std::sort(items.begin(), items.end(), [&](pair<int, shared_ptr<HtnTerm>> &first, pair<int, shared_ptr<HtnTerm>> &second)
+                // Sort them. TermCompare() always returns -1, 0 or 1
+                StaticFailFastAssert(comparison == "<" || comparison == ">");
+                int sortResult = comparison == "<" ? -1 : 1;
+                std::sort(items.begin(), items.end(), [&](const pair<int, shared_ptr<HtnTerm>> &first, const pair<int, shared_ptr<HtnTerm>> &second)
                           {
-                              int result = first.second->TermCompare(*second.second);
-
-                              if(comparison == "<") { return result == -1; }
-                              else if(comparison == ">") { return result == 1; }
-                              else { StaticFailFastAssert(false); return false; }
+                              return first.second->TermCompare(*second.second) == sortResult;
                           });
                 
                 // Create a fake "rule" so we can continue the search.
@@ -2674,60 +2961,132 @@ void HtnGoalResolver::RuleWrite(ResolveState *state)
     }
 }
 
-void HtnGoalResolver::SubstituteAllVariables(HtnTermFactory *factory, shared_ptr<HtnTerm> newTerm, shared_ptr<HtnTerm> existingVariable, vector<pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>> &stack, UnifierType &solution)
+// Calls and answers that only differ by the names of their variables are the same term once they go through this
+shared_ptr<HtnTerm> HtnGoalResolver::TableVariant(HtnTermFactory *factory, shared_ptr<HtnTerm> term)
 {
-    for(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> &value : solution)
+    if(term->isGround())
     {
-        pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> newSolution;
-        newSolution.first = value.first->SubstituteTermForVariable(factory, newTerm, existingVariable);
-        newSolution.second = value.second->SubstituteTermForVariable(factory, newTerm, existingVariable);
-        value = newSolution;
+        return term;
     }
-    
-    for(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> &value : stack)
+
+    vector<string> names;
+    term->GetAllVariables(&names);
+    map<string, shared_ptr<HtnTerm>> variableMap;
+    for(const string &name : names)
     {
-        pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> newStackItem;
-        newStackItem.first = value.first->SubstituteTermForVariable(factory, newTerm, existingVariable);
-        newStackItem.second = value.second->SubstituteTermForVariable(factory, newTerm, existingVariable);
-        value = newStackItem;
+        if(variableMap.find(name) == variableMap.end())
+        {
+            variableMap[name] = factory->CreateVariable("table" + lexical_cast<string>(variableMap.size()));
+        }
     }
+
+    return term->RenameVariables(factory, variableMap);
 }
 
-// TODO: This is really inefficient because it creates lot of memory garbage
-// Replace all instances of X in destination with whatever X is equal to in source
-shared_ptr<UnifierType> HtnGoalResolver::SubstituteUnifiers(HtnTermFactory *factory, const UnifierType &source, const UnifierType &destination)
+// Returns the binding for variable, starting at index start, or nullptr if it isn't bound. Variables are interned so they can be compared
+// by pointer. Unifiers are short so a linear search is faster than building anything to search
+static const UnifierItemType *FindBinding(const UnifierType &bindings, const HtnTerm *variable, size_t start, size_t *index)
 {
-    shared_ptr<UnifierType> finalUnifier = shared_ptr<UnifierType>(new UnifierType());
-    for(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> destItem : destination)
+    for(size_t position = start; position < bindings.size(); ++position)
     {
-        shared_ptr<HtnTerm> newDestItem = destItem.second;
-        for(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> sourceItem : source)
+        if(bindings[position].first.get() == variable)
         {
-            if(newDestItem->OccursCheck(sourceItem.first))
-            {
-                // This destItem has this source variable, replace it
-                newDestItem = newDestItem->SubstituteTermForVariable(factory, sourceItem.second, sourceItem.first);
-            }
+            *index = position;
+            return &bindings[position];
         }
-        
-        finalUnifier->push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(destItem.first, newDestItem));
     }
-    
-    return finalUnifier;
+
+    return nullptr;
 }
 
-shared_ptr<HtnTerm> HtnGoalResolver::SubstituteUnifiers(HtnTermFactory *factory, const UnifierType &source, shared_ptr<HtnTerm>target)
+// Replaces every variable in target that has a binding with its value, creating each new term only once. Values are walked too so:
+// - if sequential, each binding is applied to the result of the ones before it, like substituting them one at a time in order
+// - otherwise the bindings are a trail where a value can use variables bound anywhere else, like the ones Unify() builds
+// Walks with an explicit stack so long lists don't recurse
+shared_ptr<HtnTerm> HtnGoalResolver::ApplyBindings(HtnTermFactory *factory, const UnifierType &bindings, bool sequential, const shared_ptr<HtnTerm> &target)
 {
-    for(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> sourceItem : source)
+    if(bindings.size() == 0 || target->isGround())
+    {
+        return target;
+    }
+
+    class Frame
     {
-        if(target->OccursCheck(sourceItem.first))
+    public:
+        Frame(const shared_ptr<HtnTerm> &termArg, size_t startArg) : term(termArg), start(startArg), changed(false) {}
+        shared_ptr<HtnTerm> term;
+        // First binding that can be used for the variables in term
+        size_t start;
+        bool changed;
+        vector<shared_ptr<HtnTerm>> arguments;
+    };
+
+    vector<Frame> stack;
+    stack.push_back(Frame(target, 0));
+    shared_ptr<HtnTerm> result;
+    while(stack.size() > 0)
+    {
+        Frame &frame = stack.back();
+        if(result != nullptr)
+        {
+            frame.changed = frame.changed || result != frame.term->arguments()[frame.arguments.size()];
+            frame.arguments.push_back(std::move(result));
+            result = nullptr;
+        }
+
+        size_t index;
+        const UnifierItemType *binding;
+        if(frame.term->isGround())
+        {
+            result = frame.term;
+            stack.pop_back();
+        }
+        else if(frame.term->isVariable())
+        {
+            binding = FindBinding(bindings, frame.term.get(), frame.start, &index);
+            if(binding == nullptr)
+            {
+                result = frame.term;
+                stack.pop_back();
+            }
+            else
+            {
+                // Keep going with the value in place of the variable
+                frame.term = binding->second;
+                frame.start = sequential ? index + 1 : 0;
+            }
+        }
+        else if(frame.arguments.size() < frame.term->arguments().size())
         {
-            // This target has this source variable, replace it
-            target = target->SubstituteTermForVariable(factory, sourceItem.second, sourceItem.first);
+            size_t start = frame.start;
+            stack.push_back(Frame(frame.term->arguments()[frame.arguments.size()], start));
         }
+        else
+        {
+            result = frame.changed ? factory->CreateFunctor(*frame.term->m_namePtr, std::move(frame.arguments)) : frame.term;
+            stack.pop_back();
+        }
+    }
+
+    return result;
+}
+
+// Replace all instances of X in destination with whatever X is equal to in source
+shared_ptr<UnifierType> HtnGoalResolver::SubstituteUnifiers(HtnTermFactory *factory, const UnifierType &source, const UnifierType &destination)
+{
+    shared_ptr<UnifierType> finalUnifier = shared_ptr<UnifierType>(new UnifierType());
+    finalUnifier->reserve(destination.size() + source.size());
+    for(const UnifierItemType &destItem : destination)
+    {
+        finalUnifier->push_back(UnifierItemType(destItem.first, ApplyBindings(factory, source, true, destItem.second)));
     }
     
-    return target;
+    return finalUnifier;
+}
+
+shared_ptr<HtnTerm> HtnGoalResolver::SubstituteUnifiers(HtnTermFactory *factory, const UnifierType &source, shared_ptr<HtnTerm>target)
+{
+    return ApplyBindings(factory, source, true, target);
 }
 
 shared_ptr<vector<shared_ptr<HtnTerm>>> HtnGoalResolver::SubstituteUnifiers(HtnTermFactory *factory, const UnifierType &source, const vector<shared_ptr<HtnTerm>> &terms)
@@ -2741,50 +3100,231 @@ shared_ptr<vector<shared_ptr<HtnTerm>>> HtnGoalResolver::SubstituteUnifiers(HtnT
     return substituted;
 }
 
-string HtnGoalResolver::ToString(const vector<UnifierType> *unifierList, bool json)
+void HtnGoalResolver::AppendString(string &output, const vector<UnifierType> *unifierList, bool json)
 {
     if(unifierList == nullptr)
     {
-        return json ? "" : "null";
+        output.append(json ? "" : "null");
+        return;
     }
     
-    stringstream stream;
-    
-    stream << (json ? "[" : "(");
+    output.push_back(json ? '[' : '(');
     bool hasItem = false;
-    for(auto item : *unifierList)
+    for(const UnifierType &item : *unifierList)
     {
-        stream << (hasItem ? ", " : "") << ToString(item, json);
+        if(hasItem) { output.append(", "); }
+        AppendString(output, item, json);
         hasItem = true;
     }
     
-    stream << (json ? "]" : ")");
-    return stream.str();
+    output.push_back(json ? ']' : ')');
 }
 
-string HtnGoalResolver::ToString(const UnifierType &unifier, bool json)
+void HtnGoalResolver::AppendString(string &output, const UnifierType &unifier, bool json)
 {
-    stringstream stream;
-    
-    stream << (json ? "{" : "(");
+    output.push_back(json ? '{' : '(');
     bool hasItem = false;
-    for(auto item : unifier)
+    for(const auto &item : unifier)
     {
+        if(hasItem) { output.append(", "); }
         if (json)
         {
-            stream << (hasItem ? ", " : "") << "\"" << item.first->ToString() << "\" : " << item.second->ToString(false, true);
+            output.push_back('"');
+            item.first->AppendString(output);
+            output.append("\" : ");
+            item.second->AppendString(output, false, true);
         }
         else
         {
-            stream << (hasItem ? ", " : "") << item.first->ToString() << " = " << item.second->ToString();
+            item.first->AppendString(output);
+            output.append(" = ");
+            item.second->AppendString(output);
         }
         hasItem = true;
     }
     
-    stream << (json ? "}" : ")");
-    return stream.str();
+    output.push_back(json ? '}' : ')');
 }
 
+string HtnGoalResolver::ToString(const vector<UnifierType> *unifierList, bool json)
+{
+    string result;
+    AppendString(result, unifierList, json);
+    return result;
+}
+
+string HtnGoalResolver::ToString(const UnifierType &unifier, bool json)
+{
+    string result;
+    AppendString(result, unifier, json);
+    return result;
+}
+
+// The state of one unification: bindings go on a trail instead of being substituted into everything that is left to unify
+// as they are made. Variables are looked up on the trail as they are reached. Used by Unify() to walk both terms and by UnifyCompiled()
+// for each instruction, so both make the same bindings in the same order
+class TrailUnifier
+{
+public:
+    enum class Result
+    {
+        // Bound a variable or the terms were already the same
+        Done,
+        // Same functor and arity, the arguments need to be unified
+        Descend,
+        Fail
+    };
+
+    TrailUnifier(HtnTermFactory *factory) : m_factory(factory) {}
+
+    shared_ptr<HtnTerm> Dereference(shared_ptr<HtnTerm> term)
+    {
+        size_t index;
+        const UnifierItemType *binding;
+        while(term->isVariable() && (binding = FindBinding(trail, term.get(), 0, &index)) != nullptr)
+        {
+            term = binding->second;
+        }
+        
+        return term;
+    }
+    
+    // True if variable is in term once the bindings are applied
+    bool Occurs(const HtnTerm *variable, const HtnTerm *term)
+    {
+        if(term->isGround())
+        {
+            return false;
+        }
+
+        m_occursStack.clear();
+        m_occursStack.push_back(term);
+        while(m_occursStack.size() > 0)
+        {
+            const HtnTerm *current = m_occursStack.back();
+            m_occursStack.pop_back();
+            size_t index;
+            const UnifierItemType *binding;
+            if(current == variable)
+            {
+                return true;
+            }
+            else if(current->isVariable())
+            {
+                if((binding = FindBinding(trail, current, 0, &index)) != nullptr)
+                {
+                    m_occursStack.push_back(binding->second.get());
+                }
+            }
+            else if(!current->isGround())
+            {
+                for(const shared_ptr<HtnTerm> &argument : current->arguments())
+                {
+                    m_occursStack.push_back(argument.get());
+                }
+            }
+        }
+        
+        return false;
+    }
+    
+    // If term is a "don't care" variable that hasn't been renamed yet, give it a unique value now
+    // We can do this because, by definition, every instance of "_" is a new variable
+    // So we don't have to fix them up in the resolvent to match
+    shared_ptr<HtnTerm> Prepare(const shared_ptr<HtnTerm> &term, bool *isDontCare)
+    {
+        *isDontCare = term->isVariable() && term->m_namePtr->size() == 2 && (*term->m_namePtr)[1] == '_' && term->variableFrame() == 0;
+        return *isDontCare ? m_factory->CreateVariable("_" + to_string(m_factory->nextUniquifier())) : Dereference(term);
+    }
+    
+    void Push(const shared_ptr<HtnTerm> &x, const shared_ptr<HtnTerm> &y)
+    {
+        m_remainingStack.push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(x, y));
+    }
+    
+    // push Xi = Yi , i=1...n, on the stack
+    void PushArguments(const shared_ptr<HtnTerm> &x, const shared_ptr<HtnTerm> &y)
+    {
+        vector<shared_ptr<HtnTerm>>::const_iterator xIter = x->arguments().begin();
+        vector<shared_ptr<HtnTerm>>::const_iterator yIter = y->arguments().begin();
+        while(xIter != x->arguments().end())
+        {
+            Push(*xIter, *yIter);
+            xIter++;
+            yIter++;
+        }
+    }
+    
+    // Unifies everything on the stack
+    bool Run()
+    {
+        while(!m_remainingStack.empty())
+        {
+            pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> current = m_remainingStack.back();
+            m_remainingStack.pop_back();
+            bool xIsDontCare;
+            shared_ptr<HtnTerm> x = Prepare(current.first, &xIsDontCare);
+            bool yIsDontCare;
+            shared_ptr<HtnTerm> y = Prepare(current.second, &yIsDontCare);
+            Result result = Step(x, xIsDontCare, y, yIsDontCare);
+            if(result == Result::Fail)
+            {
+                m_remainingStack.clear();
+                return false;
+            }
+            else if(result == Result::Descend)
+            {
+                PushArguments(x, y);
+            }
+        }
+        
+        return true;
+    }
+    
+    // x and y have already been through Prepare()
+    Result Step(const shared_ptr<HtnTerm> &x, bool xIsDontCare, const shared_ptr<HtnTerm> &y, bool yIsDontCare)
+    {
+        // If X is a variable that does not occur in Y..
+        if(x->isVariable() && (xIsDontCare || !Occurs(x.get(), y.get())))
+        {
+            // add X = Y to solution
+            trail.push_back(UnifierItemType(x, y));
+            return Result::Done;
+        }
+        else if(y->isVariable() && (yIsDontCare || !Occurs(y.get(), x.get())))
+        {
+            // add Y = X to solution
+            trail.push_back(UnifierItemType(y, x));
+            return Result::Done;
+        }
+        else if(!(xIsDontCare || yIsDontCare) &&
+                (((x->isVariable() && y->isVariable()) && x == y) ||
+                ((x->isConstant() && y->isConstant()) && x->nameEqualTo(*y))))
+        {
+            // X && Y are identical constants or Variables
+            return Result::Done;
+        }
+        else if(x->isEquivalentCompoundTerm(y.get()))
+        {
+            // X is f(X1...,Xn) and Y is f(Y1...,Yn) for some functor f and n > 0
+            return Result::Descend;
+        }
+        else
+        {
+            return Result::Fail;
+        }
+    }
+    
+    // trail.first = the variable, trail.second = what it is bound to, which can use variables bound later
+    UnifierType trail;
+    
+private:
+    HtnTermFactory *m_factory;
+    vector<const HtnTerm *> m_occursStack;
+    // stack.first = left term, stack.second = right
+    vector<pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>> m_remainingStack;
+};
+
 // From http://homepage.cs.uiowa.edu/~fleck/unification.pdf
 // We are unifying two terms which can have variables
 // Required Expression Operations:
@@ -2802,138 +3342,145 @@ string HtnGoalResolver::ToString(const UnifierType &unifier, bool json)
 // while stack is not empty
 //      Pop left and right from stack
 //      if X is a variable that does not occur in Y: Sub Y for X in thestack and in Answer
+// The solution is only built, with all the bindings applied, once unification succeeds
 shared_ptr<UnifierType> HtnGoalResolver::Unify(HtnTermFactory *factory, shared_ptr<HtnTerm> term1, shared_ptr<HtnTerm> term2)
 {
     if(term1 == nullptr || term2 == nullptr) return nullptr;
     
-    uint64_t &uniquifier = factory->uniquifier();
-//    TraceString2("HtnGoalResolver::Unify {0}={1}",
-//                 SystemTraceType::Unifier, TraceDetail::Diagnostic,
-//                 term1->ToString(), term2->ToString());
-    
-    // solution.first = left side of equality, solution.second = right
-    shared_ptr<UnifierType> solution = shared_ptr<UnifierType>(new UnifierType);
-    
-    // stack.first = left term, stack.second = right
-    vector<pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>> remainingStack;
-    
-    // Initially the stack contains the original terms
-    remainingStack.push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(term1, term2));
-    
-    while(!remainingStack.empty())
+    TrailUnifier unifier(factory);
+    unifier.Push(term1, term2);
+    if(!unifier.Run())
     {
-//        TraceString("Solution:", SystemTraceType::Unifier, TraceDetail::Diagnostic);
-//        for(pair<shared_ptr<HtnTerm>,shared_ptr<HtnTerm>> item : *solution)
-//        {
-//            TraceString2("...solution: {0}={1}",
-//                         SystemTraceType::Unifier, TraceDetail::Diagnostic,
-//                         item.first->ToString(), item.second->ToString());
-//        }
-//
-//        TraceString("Stack:", SystemTraceType::Unifier, TraceDetail::Diagnostic);
-//        for(pair<shared_ptr<HtnTerm>,shared_ptr<HtnTerm>> item : remainingStack)
-//        {
-//            TraceString2("...stack: {0}={1}",
-//                         SystemTraceType::Unifier, TraceDetail::Diagnostic,
-//                         item.first->ToString(), item.second->ToString());
-//        }
-        
-        pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>> current = remainingStack.back();
-        remainingStack.pop_back();
-        // If X or Y is a "don't care" variable that hasn't been renamed yet, give it a unique value now
-        // We can do this because, by definition, every instance of "_" is a new variable
-        // So we don't have to fix them up in the resolvent to match
-        shared_ptr<HtnTerm> x;
-        bool xIsDontCare = false;
-        shared_ptr<HtnTerm> y;
-        bool yIsDontCare = false;
-        if(current.first->isVariable())
-        {
-            std::string name = current.first->name();
-            if(name.size() == 1 && name[0] == '_')
-            {
-                xIsDontCare = true;
-                x = factory->CreateVariable("_" + lexical_cast<string>(uniquifier++));
+        return nullptr;
+    }
+    
+    return TrailSolution(factory, unifier.trail);
+}
+
+// Runs the program the way Unify(head, goal) would walk the head, or Unify(goal, head) if goalIsFirst, and gets the same answer.
+// Parts of the goal are kept on a stack that each instruction pops the next one from. They are kept alive by the goal or the trail.
+// The generic walk is only used when a variable in the head was already bound to a term and the goal has a term there too
+shared_ptr<UnifierType> HtnGoalResolver::UnifyCompiled(HtnTermFactory *factory, const HtnHeadProgram &program, const shared_ptr<HtnTerm> &goal, bool goalIsFirst)
+{
+    if(goal == nullptr) return nullptr;
+
+    TrailUnifier unifier(factory);
+    // Every part of the goal on the stack is matched by a different instruction, so there can't be more than there are instructions
+    const vector<HtnHeadProgram::Instruction> &instructions = program.instructions();
+    vector<const shared_ptr<HtnTerm> *> goals;
+    goals.reserve(instructions.size());
+    goals.push_back(&goal);
+    for(size_t position = 0; position < instructions.size(); ++position)
+    {
+        const HtnHeadProgram::Instruction &instruction = instructions[position];
+        const shared_ptr<HtnTerm> &nextGoal = *goals.back();
+        goals.pop_back();
+        bool isTerm = instruction.opcode == HtnHeadProgram::Opcode::GetGround || instruction.opcode == HtnHeadProgram::Opcode::GetStructure;
+        if(isTerm && !nextGoal->isVariable())
+        {
+            // Nothing to look up or bind at this level
+            if(instruction.opcode == HtnHeadProgram::Opcode::GetGround && nextGoal->isGround())
+            {
+                if(nextGoal != instruction.term)
+                {
+                    return nullptr;
+                }
+
+                position += instruction.skip;
+                continue;
             }
-            else
+            else if(instruction.term->isEquivalentCompoundTerm(nextGoal.get()))
             {
-                x = current.first;
-            }
-        }
-        else
-        {
-            x = current.first;
-        }
+                for(const shared_ptr<HtnTerm> &argument : nextGoal->arguments())
+                {
+                    goals.push_back(&argument);
+                }
 
-        if(current.second->isVariable())
-        {
-            std::string name = current.second->name();
-            if(name.size() == 1 && name[0] == '_')
-            {
-                yIsDontCare = true;
-                y = factory->CreateVariable("_" + lexical_cast<string>(uniquifier++));
+                continue;
             }
             else
             {
-                y = current.second;
+                return nullptr;
             }
         }
-        else
+
+        // Prepared in the same order Unify() would so don't care variables get the same names
+        bool headIsDontCare = instruction.opcode == HtnHeadProgram::Opcode::GetDontCare;
+        bool goalIsDontCare;
+        shared_ptr<HtnTerm> goalTerm;
+        shared_ptr<HtnTerm> headTerm;
+        if(goalIsFirst)
         {
-            y = current.second;
+            goalTerm = unifier.Prepare(nextGoal, &goalIsDontCare);
         }
-        
-        // If X is a variable that does not occur in Y..
-        if(x->isVariable() && (xIsDontCare || !y->OccursCheck(x)))
+
+        switch(instruction.opcode)
         {
-            // Substitute Y for X in the stack and in the solution
-            SubstituteAllVariables(factory, y, x, remainingStack, *solution);
-            
-            // add X = Y to solution
-            solution->push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(x, y));
+            case HtnHeadProgram::Opcode::GetDontCare:
+                headTerm = factory->CreateVariable("_" + to_string(factory->nextUniquifier()));
+                break;
+            case HtnHeadProgram::Opcode::GetVariable:
+                headTerm = unifier.Dereference(instruction.term);
+                break;
+            default:
+                headTerm = instruction.term;
+                break;
         }
-        else if(y->isVariable() && (yIsDontCare || !x->OccursCheck(y)))
+
+        if(!goalIsFirst)
         {
-            // Substitute X for Y in the stack and in the solution
-            SubstituteAllVariables(factory, x, y, remainingStack, *solution);
-            
-            // add Y = X to solution
-            solution->push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(y, x));
+            goalTerm = unifier.Prepare(nextGoal, &goalIsDontCare);
         }
-        else if(!(xIsDontCare || yIsDontCare) &&
-                (((x->isVariable() && y->isVariable()) && x == y) ||
-                ((x->isConstant() && y->isConstant()) && x->nameEqualTo(*y))))
+
+        TrailUnifier::Result result = goalIsFirst ? unifier.Step(goalTerm, goalIsDontCare, headTerm, headIsDontCare) : unifier.Step(headTerm, headIsDontCare, goalTerm, goalIsDontCare);
+        if(result == TrailUnifier::Result::Fail)
         {
-            // X && Y are identical constants or Variables
-            continue;
+            return nullptr;
         }
-        else if(x->isEquivalentCompoundTerm(y.get()))
+        else if(result == TrailUnifier::Result::Descend && isTerm)
         {
-            // X is f(X1...,Xn) and Y is f(Y1...,Yn) for some functor f and n > 0
-            // push Xi = Yi , i=1...n, on the stack
-            vector<shared_ptr<HtnTerm>>::const_iterator xIter = x->arguments().begin();
-            vector<shared_ptr<HtnTerm>>::const_iterator yIter = y->arguments().begin();
-            while(xIter != x->arguments().end())
+            // The goal was a variable already bound to a term like this one. The trail keeps the term alive
+            for(const shared_ptr<HtnTerm> &argument : goalTerm->arguments())
             {
-                remainingStack.push_back(pair<shared_ptr<HtnTerm>, shared_ptr<HtnTerm>>(*xIter, *yIter));
-                xIter++;
-                yIter++;
+                goals.push_back(&argument);
             }
         }
-        else
+        else if(result == TrailUnifier::Result::Descend)
         {
-            // Fail
-//            TraceString("Final Solution: FAIL", SystemTraceType::Unifier, TraceDetail::Diagnostic);
-            return nullptr;
+            // A variable in the head that is already bound to a term, there are no instructions for the arguments
+            if(goalIsFirst)
+            {
+                unifier.PushArguments(goalTerm, headTerm);
+            }
+            else
+            {
+                unifier.PushArguments(headTerm, goalTerm);
+            }
+
+            if(!unifier.Run())
+            {
+                return nullptr;
+            }
+        }
+        else if(isTerm)
+        {
+            // The goal was a variable and got bound to the whole term
+            position += instruction.skip;
         }
     }
+
+    return TrailSolution(factory, unifier.trail);
+}
+
+// solution.first = left side of equality, solution.second = right
+shared_ptr<UnifierType> HtnGoalResolver::TrailSolution(HtnTermFactory *factory, const UnifierType &trail)
+{
+    shared_ptr<UnifierType> solution = shared_ptr<UnifierType>(new UnifierType());
+    solution->reserve(trail.size());
+    for(const UnifierItemType &item : trail)
+    {
+        solution->push_back(UnifierItemType(item.first, ApplyBindings(factory, trail, false, item.second)));
+    }
     
-//    TraceString("Final Solution:", SystemTraceType::Unifier, TraceDetail::Diagnostic);
-//    for(pair<shared_ptr<HtnTerm>,shared_ptr<HtnTerm>> item : *solution)
-//    {
-//        TraceString2("...solution {0}={1}",
-//                     SystemTraceType::Unifier, TraceDetail::Diagnostic,
-//                     item.first->ToString(), item.second->ToString());
-//    }
     return solution;
 }
@@ -11,12 +11,14 @@
 #include <map>
 #include <functional>
 #include "FXPlatform/FailFast.h"
+#include "HtnAnswerTable.h"
+#include "HtnHeadProgram.h"
 #include "HtnRule.h"
+#include "HtnRuleSet.h"
 #include "HtnTerm.h"
 enum class ResolveContinuePoint;
 class ResolveNode;
 class ResolveState;
-class HtnRuleSet;
 class HtnTerm;
 
 // UnifierItemType means assignment where pair.first = pair.second
@@ -57,10 +59,13 @@ public:
 
     HtnGoalResolver();
     void AddCustomRule(const std::string &name, CustomRuleType);
+    // Same text as ToString() but appended to output so a caller can reuse one buffer for a whole result
+    static void AppendString(std::string &output, const std::vector<UnifierType> *unifierList, bool json = false);
+    static void AppendString(std::string &output, const UnifierType &unifier, bool json = false);
     static std::shared_ptr<HtnTerm> ApplyUnifierToTerm(HtnTermFactory *termFactory, UnifierType unifier, std::shared_ptr<HtnTerm>term);
     // Converts an argument into one of the base CustomRuleArgTypes
     static CustomRuleArgType GetCustomRuleArgBaseType(std::vector<CustomRuleArgType> metadata, int argIndex);
-    static std::shared_ptr<std::vector<RuleBindingType>> FindAllRulesThatUnify(HtnTermFactory *termFactory, HtnRuleSet *prog, std::shared_ptr<HtnTerm> goal, int *uniquifier, int indentLevel, int memoryBudget, bool fullTrace, int64_t *highestMemoryUsedReturn);
+    static std::shared_ptr<std::vector<RuleBindingType>> FindAllRulesThatUnify(HtnTermFactory *termFactory, HtnRuleSet *prog, std::shared_ptr<HtnTerm> goal, int indentLevel, int memoryBudget, bool fullTrace, int64_t *highestMemoryUsedReturn);
     static std::shared_ptr<HtnTerm> FindTermEquivalence(const UnifierType &unifier, const HtnTerm &termToFind);
     static bool IsGround(UnifierType *unifier);
     bool GetCustomRule(const std::string &name, int arity, HtnGoalResolver::CustomRuleType &metadata);
@@ -74,8 +79,15 @@ public:
     static std::string ToString(const std::vector<UnifierType> *unifierList, bool json = false);
     static std::string ToString(const UnifierType &unifier, bool json = false);
     static std::shared_ptr<UnifierType> Unify(HtnTermFactory *factory, std::shared_ptr<HtnTerm> term1, std::shared_ptr<HtnTerm> term2);
+    // Same answer as Unify(head, goal), or Unify(goal, head) if goalIsFirst, using the head compiled into program
+    static std::shared_ptr<UnifierType> UnifyCompiled(HtnTermFactory *factory, const HtnHeadProgram &program, const std::shared_ptr<HtnTerm> &goal, bool goalIsFirst = false);
+    // If the head of rule unifies with goal, sets binding to a copy of the rule with unique variables and the substitutions that unify it
+    static bool UnifyRule(HtnTermFactory *termFactory, const HtnRule &rule, const std::shared_ptr<HtnTerm> &goal, RuleBindingType &binding);
 
 private:
+    static std::shared_ptr<HtnTerm> ApplyBindings(HtnTermFactory *factory, const UnifierType &bindings, bool sequential, const std::shared_ptr<HtnTerm> &target);
+    void EvaluateTable(ResolveState *state, HtnAnswerTable *table, HtnAnswerTable::Entry *entry, int indentLevel, int memoryBudget, int64_t *highestMemoryUsedReturn);
+    std::shared_ptr<std::vector<RuleBindingType>> FindAllTabledAnswers(ResolveState *state, std::shared_ptr<HtnTerm> goal, int indentLevel, int memoryBudget, int64_t *highestMemoryUsedReturn);
     static void RuleAggregate(ResolveState *state);
 	static void RuleAssert(ResolveState* state);
     static void RuleAtomChars(ResolveState* state);
@@ -99,7 +111,8 @@ private:
     static void RuleTrace(ResolveState *state);
     static void RuleUnify(ResolveState *state);
     static void RuleWrite(ResolveState *state);
-    static void SubstituteAllVariables(HtnTermFactory *factory, std::shared_ptr<HtnTerm> newTerm, std::shared_ptr<HtnTerm> existingVariable, std::vector<std::pair<std::shared_ptr<HtnTerm>, std::shared_ptr<HtnTerm>>> &stack, UnifierType &solution);
+    static std::shared_ptr<HtnTerm> TableVariant(HtnTermFactory *factory, std::shared_ptr<HtnTerm> term);
+    static std::shared_ptr<UnifierType> TrailSolution(HtnTermFactory *factory, const UnifierType &trail);
 
     typedef std::map<std::string, CustomRuleType> CustomRulesType;
     CustomRulesType m_customRules;
@@ -112,7 +125,6 @@ enum class ResolveContinuePoint
     CustomContinue2,
     CustomContinue3,
     CustomContinue4,
-	Cut,
     NextGoal,
     NextRuleThatUnifies,
     ProgramError,
@@ -135,6 +147,11 @@ public:
     
     RuleBindingType currentRule()
     {
+        if(ruleCursor != nullptr)
+        {
+            return cursorRule;
+        }
+
         FailFastAssert(rulesThatUnify != nullptr && currentRuleIndex < rulesThatUnify->size());
         return (*rulesThatUnify)[currentRuleIndex];
     }
@@ -161,6 +178,12 @@ public:
             }
         }
 
+        int64_t ruleCursorSize = 0;
+        if(ruleCursor != nullptr)
+        {
+            ruleCursorSize = sizeof(HtnRuleSet::RuleCursor) + cursorRule.second.size() * sizeof(UnifierItemType);
+        }
+
         int64_t previousSolutionsSize = 0;
         if(previousSolutions != nullptr)
         {
@@ -184,6 +207,7 @@ public:
         cachedDynamicSize = sizeof(ResolveNode) +
             (m_resolvent == nullptr ? 0 : sizeof(m_resolvent) + m_resolvent->size() * sizeof(std::shared_ptr<HtnTerm>)) +
             rulesThatUnifySize +
+            ruleCursorSize +
             (unifier == nullptr ? 0 : sizeof(unifier) + unifier->size() * sizeof(UnifierItemType)) +
             (previousSolutions == nullptr ? 0 : sizeof(previousSolutions) + unifier->size() * sizeof(UnifierItemType)) +
             currentFailureContext.size() * sizeof(std::shared_ptr<HtnTerm>) +
@@ -191,6 +215,8 @@ public:
             variablesToKeepSize;
     }
     
+    // True if all this node will do once its child is done is pop itself, so the child can replace it on the stack
+    bool IsDeterminate();
 	bool IsLastGoalInResolvent()
 	{
 		return currentGoal() == nullptr || m_resolvent->size() == 1;
@@ -213,21 +239,27 @@ public:
 		{
 			currentRuleIndex = (int)rulesThatUnify->size();
 		}
+
+        ruleCursor = nullptr;
 	}
 
-    bool SetNextRule()
-    {
-        currentRuleIndex++;
-        return rulesThatUnify != nullptr && currentRuleIndex < rulesThatUnify->size();
-    }
+    bool SetNextRule(HtnTermFactory *termFactory);
     
     // NOTE: If you change members, remember to change dynamicSize() function too
+    // True once HtnGoalResolver::ResolveNext() has decided if the node under this one could be dropped
+    bool checkedFrameBelow;
     ResolveContinuePoint continuePoint;
     std::vector<std::shared_ptr<HtnTerm>> currentFailureContext;
     int currentRuleIndex;
+    // How many determinate nodes under this one were dropped from the stack so the depth of failures is the same as without dropping them
+    int droppedFrames;
     // Remembers the count of original goals which will be at the end of m_resolvent, so we can debug better
     int originalGoalCount;
     const std::shared_ptr<std::vector<std::shared_ptr<HtnTerm>>> &resolvent() const { return m_resolvent; };
+    // Clauses for the goal that haven't been tried yet. Used instead of rulesThatUnify so each one is only unified and renamed once
+    // it is needed, and cursorRule is the last one that unified
+    std::shared_ptr<HtnRuleSet::RuleCursor> ruleCursor;
+    RuleBindingType cursorRule;
     std::shared_ptr<std::vector<RuleBindingType>> rulesThatUnify;
     std::shared_ptr<UnifierType> unifier;
     
@@ -269,26 +301,20 @@ public:
 
     int64_t dynamicSize()
     {
-        int64_t stackSize = sizeof(std::vector<std::shared_ptr<ResolveNode>>);
-        for(int stackIndex = 0; stackIndex < ((int) resolveStack->size()) - 1; ++stackIndex)
-        {
-            stackSize += (*resolveStack)[stackIndex]->dynamicSize();
-        }
-        
-        // The last one needs to be recalculated since it is being worked on and will change
-        if(resolveStack->size() > 0)
-        {
-            resolveStack->back()->CalcDynamicSize();
-            stackSize += resolveStack->back()->dynamicSize();
-        }
-        
+        UpdateStackMemory();
         return sizeof(ResolveState) +
             deepestFailureStack.size() + highestMemoryUsedStack.size() +
             farthestFailureContext.size() * sizeof(std::shared_ptr<HtnTerm>) +
             initialGoals->size() * sizeof(std::shared_ptr<HtnTerm>) +
-            stackSize +
+            sizeof(std::vector<std::shared_ptr<ResolveNode>>) + measuredNodesSize +
+            measuredNodes.size() * sizeof(MeasuredNodeType) +
             (solutions == nullptr ? 0 : (sizeof(std::vector<UnifierType>) + solutions->size() * sizeof(UnifierItemType)));
     }
+    // Call when a node other than the top one changes so it and the ones above it are measured again by UpdateStackMemory()
+    void RemeasureStackFrom(size_t index);
+    // Measures the nodes pushed onto resolveStack since the last call and removes the ones that were popped, so measuredNodesSize
+    // is the size of the whole stack without walking all of it
+    void UpdateStackMemory();
 
     // NOTE: If you change members, remember to change dynamicSize() function too
     bool collectAllSolutions;
@@ -301,10 +327,15 @@ public:
     std::string deepestFailureStack;
     bool fullTrace;
     int64_t highestMemoryUsed;
+    // Only captured when solver tracing is on, since the stack is only reported in traces
     std::string highestMemoryUsedStack;
     std::shared_ptr<std::vector<std::shared_ptr<HtnTerm>>> initialGoals;
     int initialIndent;
     int memoryBudget;
+    // The nodes that were on resolveStack the last time it was measured, and their sizes then
+    typedef std::pair<std::shared_ptr<ResolveNode>, int64_t> MeasuredNodeType;
+    std::vector<MeasuredNodeType> measuredNodes;
+    int64_t measuredNodesSize;
     HtnRuleSet *prog;
     std::shared_ptr<std::vector<std::shared_ptr<ResolveNode>>> resolveStack;
     int64_t ruleMemoryUsed;
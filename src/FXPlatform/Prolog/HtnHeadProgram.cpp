@@ -0,0 +1,51 @@
+//
+//  HtnHeadProgram.cpp
+//  GameLib
+//
+#include "HtnHeadProgram.h"
+#include "HtnTerm.h"
+using namespace std;
+
+shared_ptr<HtnHeadProgram> HtnHeadProgram::Compile(const shared_ptr<HtnTerm> &head)
+{
+    shared_ptr<HtnHeadProgram> program = shared_ptr<HtnHeadProgram>(new HtnHeadProgram());
+    vector<Instruction> &instructions = program->m_instructions;
+
+    // Popping the arguments off of a stack visits the last one first, like Unify() does. Uses a stack instead of recursing
+    // since heads can have long lists in them
+    vector<const shared_ptr<HtnTerm> *> stack;
+    stack.push_back(&head);
+    while(stack.size() > 0)
+    {
+        const shared_ptr<HtnTerm> &term = *stack.back();
+        stack.pop_back();
+        if(term->isVariable())
+        {
+            bool isDontCare = term->m_namePtr->size() == 2 && (*term->m_namePtr)[1] == '_' && term->variableFrame() == 0;
+            instructions.push_back(Instruction(isDontCare ? Opcode::GetDontCare : Opcode::GetVariable, term));
+        }
+        else
+        {
+            instructions.push_back(Instruction(term->isGround() ? Opcode::GetGround : Opcode::GetStructure, term));
+            for(const shared_ptr<HtnTerm> &argument : term->arguments())
+            {
+                stack.push_back(&argument);
+            }
+        }
+    }
+
+    // Going backwards, the arguments of a term are the sizes on top of the stack when it is reached
+    vector<uint32_t> sizes;
+    for(vector<Instruction>::reverse_iterator instruction = instructions.rbegin(); instruction != instructions.rend(); ++instruction)
+    {
+        for(int index = 0; index < instruction->term->arity(); ++index)
+        {
+            instruction->skip += sizes.back();
+            sizes.pop_back();
+        }
+
+        sizes.push_back(instruction->skip + 1);
+    }
+
+    return program;
+}
@@ -0,0 +1,51 @@
+//
+//  HtnHeadProgram.h
+//  GameLib
+//
+
+#ifndef HtnHeadProgram_hpp
+#define HtnHeadProgram_hpp
+#include <cstdint>
+#include <memory>
+#include <vector>
+class HtnTerm;
+
+// The head of a rule, method or operator compiled into instructions that HtnGoalResolver::UnifyCompiled() runs against a goal
+// instead of walking the head with HtnGoalResolver::Unify().
+// There is one instruction for each part of the head, in the order Unify() visits them: a term and then its arguments,
+// last argument first. Each instruction matches the next part of the goal, and the instructions for the arguments of a
+// term are skipped when the goal already matches all of it.
+class HtnHeadProgram
+{
+public:
+    enum class Opcode
+    {
+        // "_", which is a new variable every time it is matched
+        GetDontCare,
+        // A constant or a term without variables: the goal matches all of it if it is the same term, since terms are interned
+        GetGround,
+        // A term with variables in it
+        GetStructure,
+        // Any other variable
+        GetVariable
+    };
+
+    class Instruction
+    {
+    public:
+        Instruction(Opcode opcode, std::shared_ptr<HtnTerm> term) : opcode(opcode), skip(0), term(term) {}
+        Opcode opcode;
+        // How many instructions after this one match the arguments of term, so they can be skipped when the goal matches all of it
+        uint32_t skip;
+        std::shared_ptr<HtnTerm> term;
+    };
+
+    static std::shared_ptr<HtnHeadProgram> Compile(const std::shared_ptr<HtnTerm> &head);
+    int64_t dynamicSize() const { return sizeof(HtnHeadProgram) + m_instructions.capacity() * sizeof(Instruction); }
+    const std::vector<Instruction> &instructions() const { return m_instructions; }
+
+private:
+    std::vector<Instruction> m_instructions;
+};
+
+#endif /* HtnHeadProgram_hpp */
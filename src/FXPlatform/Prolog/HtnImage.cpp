@@ -0,0 +1,274 @@
+//
+//  HtnImage.cpp
+//  GameLib
+//
+#include <fstream>
+#include "HtnImage.h"
+#include "HtnTerm.h"
+#include "HtnTermFactory.h"
+using namespace std;
+
+// 'HTNI' when read as bytes on a little endian machine. Images from a machine with the other byte order won't match
+static const uint32_t ImageMagic = 0x494E5448;
+static const uint32_t ImageVersion = 2;
+static const size_t HeaderWords = 7;
+
+uint32_t HtnImageWriter::AddString(const HtnTerm *term)
+{
+    // A renamed variable shares its name with the original, so it is stored with its frame as a variable of its own
+    if(term->variableFrame() != 0)
+    {
+        uint32_t index = (uint32_t) m_stringOffsets.size();
+        m_stringOffsets.push_back((uint32_t) m_strings.size());
+        m_strings.append(term->name());
+        return index;
+    }
+    
+    unordered_map<const string *, uint32_t>::iterator found = m_stringIndexes.find(term->m_namePtr);
+    if(found != m_stringIndexes.end())
+    {
+        return found->second;
+    }
+
+    // Variables are stored without the "?" so they can be created with CreateVariable()
+    uint32_t index = (uint32_t) m_stringOffsets.size();
+    m_stringOffsets.push_back((uint32_t) m_strings.size());
+    if(term->isVariable())
+    {
+        m_strings.append(*term->m_namePtr, 1, string::npos);
+    }
+    else
+    {
+        m_strings.append(*term->m_namePtr);
+    }
+
+    m_stringIndexes[term->m_namePtr] = index;
+    return index;
+}
+
+// Walks the term with an explicit stack so long lists don't recurse. A term is only added once all of its arguments have been
+uint32_t HtnImageWriter::AddTerm(const shared_ptr<HtnTerm> &term)
+{
+    unordered_map<const HtnTerm *, uint32_t>::iterator found = m_termIndexes.find(term.get());
+    if(found != m_termIndexes.end())
+    {
+        return found->second;
+    }
+
+    // The term and the next argument of it to visit
+    vector<pair<const HtnTerm *, int>> stack;
+    stack.push_back(pair<const HtnTerm *, int>(term.get(), 0));
+    while(stack.size() > 0)
+    {
+        const HtnTerm *current = stack.back().first;
+        if(stack.back().second < current->arity())
+        {
+            const HtnTerm *argument = current->arguments()[stack.back().second++].get();
+            if(m_termIndexes.find(argument) == m_termIndexes.end())
+            {
+                stack.push_back(pair<const HtnTerm *, int>(argument, 0));
+            }
+        }
+        else
+        {
+            m_terms.push_back(AddString(current));
+            m_terms.push_back(((uint32_t) current->arity() << 1) | (current->isVariable() ? 1 : 0));
+            for(const shared_ptr<HtnTerm> &argument : current->arguments())
+            {
+                m_terms.push_back(m_termIndexes[argument.get()]);
+            }
+
+            m_termIndexes[current] = m_termCount++;
+            stack.pop_back();
+        }
+    }
+
+    return m_termIndexes[term.get()];
+}
+
+void HtnImageWriter::Save(vector<uint8_t> &output) const
+{
+    vector<uint32_t> header = { ImageMagic, ImageVersion, (uint32_t) m_stringOffsets.size(), (uint32_t) m_strings.size(), m_termCount, (uint32_t) m_terms.size(), (uint32_t) m_body.size() };
+    size_t stringBytes = (m_strings.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+    output.clear();
+    output.reserve((header.size() + m_stringOffsets.size() + 1 + m_terms.size() + m_body.size()) * sizeof(uint32_t) + stringBytes);
+    auto append = [&](const void *data, size_t byteCount)
+    {
+        output.insert(output.end(), (const uint8_t *) data, (const uint8_t *) data + byteCount);
+    };
+
+    append(header.data(), header.size() * sizeof(uint32_t));
+    append(m_stringOffsets.data(), m_stringOffsets.size() * sizeof(uint32_t));
+    uint32_t stringsEnd = (uint32_t) m_strings.size();
+    append(&stringsEnd, sizeof(uint32_t));
+    append(m_strings.data(), m_strings.size());
+    output.resize(output.size() + stringBytes - m_strings.size(), 0);
+    append(m_terms.data(), m_terms.size() * sizeof(uint32_t));
+    append(m_body.data(), m_body.size() * sizeof(uint32_t));
+}
+
+bool HtnImageWriter::SaveToFile(const string &pathAndFile) const
+{
+    vector<uint8_t> image;
+    Save(image);
+    ofstream stream(pathAndFile, ios::binary | ios::trunc);
+    stream.write((const char *) image.data(), image.size());
+    return stream.good();
+}
+
+void HtnImageWriter::WriteTerms(const vector<shared_ptr<HtnTerm>> &terms)
+{
+    Write((uint32_t) terms.size());
+    for(const shared_ptr<HtnTerm> &term : terms)
+    {
+        WriteTerm(term);
+    }
+}
+
+bool HtnImageReader::Open(HtnTermFactory *factory, const uint8_t *data, size_t size)
+{
+    m_terms.clear();
+    m_error.clear();
+    m_failed = false;
+    m_body = nullptr;
+    m_bodyEnd = nullptr;
+
+    const uint32_t *words = (const uint32_t *) data;
+    size_t wordCount = size / sizeof(uint32_t);
+    if(size % sizeof(uint32_t) != 0 || ((uintptr_t) data % sizeof(uint32_t)) != 0 || wordCount < HeaderWords || words[0] != ImageMagic || words[1] != ImageVersion)
+    {
+        SetError("not an image or it was written by a different version or on a machine with a different byte order");
+        return false;
+    }
+
+    uint32_t stringCount = words[2];
+    uint32_t stringBytes = words[3];
+    uint32_t termCount = words[4];
+    uint32_t termWords = words[5];
+    uint32_t bodyWords = words[6];
+    uint64_t expectedWords = HeaderWords + (uint64_t) stringCount + 1 + ((uint64_t) stringBytes + sizeof(uint32_t) - 1) / sizeof(uint32_t) + termWords + bodyWords;
+    if(expectedWords != wordCount)
+    {
+        SetError("image is the wrong size");
+        return false;
+    }
+
+    const uint32_t *stringOffsets = words + HeaderWords;
+    const char *strings = (const char *) (stringOffsets + stringCount + 1);
+    vector<string> names;
+    names.reserve(stringCount);
+    for(uint32_t index = 0; index < stringCount; ++index)
+    {
+        if(stringOffsets[index] > stringOffsets[index + 1] || stringOffsets[index + 1] > stringBytes)
+        {
+            SetError("image has a bad string table");
+            return false;
+        }
+
+        names.push_back(string(strings + stringOffsets[index], stringOffsets[index + 1] - stringOffsets[index]));
+    }
+
+    // Arguments always come before the terms that use them so each term can be created from terms that already exist
+    const uint32_t *term = (const uint32_t *) (strings + (stringBytes + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t));
+    const uint32_t *termsEnd = term + termWords;
+    m_terms.reserve(termCount);
+    vector<shared_ptr<HtnTerm>> arguments;
+    while(term < termsEnd)
+    {
+        if(termsEnd - term < 2 || term[0] >= stringCount || (uint64_t) (termsEnd - term - 2) < (term[1] >> 1) || ((term[1] & 1) != 0 && (term[1] >> 1) != 0))
+        {
+            SetError("image has a bad term table");
+            return false;
+        }
+
+        const string &name = names[term[0]];
+        uint32_t arity = term[1] >> 1;
+        bool isVariable = (term[1] & 1) != 0;
+        term += 2;
+        if(isVariable)
+        {
+            m_terms.push_back(factory->CreateVariable(name));
+        }
+        else if(arity == 0)
+        {
+            m_terms.push_back(factory->CreateConstant(name));
+        }
+        else
+        {
+            arguments.clear();
+            for(uint32_t index = 0; index < arity; ++index)
+            {
+                if(term[index] >= m_terms.size())
+                {
+                    SetError("image has a bad term table");
+                    return false;
+                }
+
+                arguments.push_back(m_terms[term[index]]);
+            }
+
+            m_terms.push_back(factory->CreateFunctor(name, arguments));
+            term += arity;
+        }
+    }
+
+    if(m_terms.size() != termCount)
+    {
+        SetError("image has a bad term table");
+        return false;
+    }
+
+    m_body = termsEnd;
+    m_bodyEnd = termsEnd + bodyWords;
+    return true;
+}
+
+shared_ptr<HtnTerm> HtnImageReader::ReadTerm()
+{
+    uint32_t index = ReadWord();
+    if(m_failed)
+    {
+        return nullptr;
+    }
+    else if(index >= m_terms.size())
+    {
+        SetError("image refers to a term that doesn't exist");
+        return nullptr;
+    }
+    else
+    {
+        return m_terms[index];
+    }
+}
+
+void HtnImageReader::ReadTerms(vector<shared_ptr<HtnTerm>> &terms)
+{
+    terms.clear();
+    uint32_t count = ReadWord();
+    for(uint32_t index = 0; index < count && !m_failed; ++index)
+    {
+        terms.push_back(ReadTerm());
+    }
+}
+
+uint32_t HtnImageReader::ReadWord()
+{
+    if(m_failed || m_body == m_bodyEnd)
+    {
+        SetError("image ended early");
+        return 0;
+    }
+
+    return *m_body++;
+}
+
+void HtnImageReader::SetError(const string &error)
+{
+    if(!m_failed)
+    {
+        m_error = error;
+        m_failed = true;
+    }
+
+    m_body = m_bodyEnd;
+}
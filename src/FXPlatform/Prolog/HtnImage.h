@@ -0,0 +1,70 @@
+//
+//  HtnImage.h
+//  GameLib
+//
+
+#ifndef HtnImage_hpp
+#define HtnImage_hpp
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+class HtnTerm;
+class HtnTermFactory;
+
+// A binary image holds compiled rules (and whatever else the writer puts in it) so they can be loaded without parsing.
+// It is all 32 bit words in the byte order of the machine that wrote it:
+//   Header:  'HTNI', version, string count, string bytes, term count, term words, body words
+//   Strings: string count + 1 offsets into the string bytes, then the string bytes padded to a word
+//   Terms:   name string, (arity << 1) | isVariable, then the index of each argument. Arguments always come before the terms that use them
+//   Body:    written with Write() and read back with ReadWord() in the same order. Terms are written as their index
+class HtnImageWriter
+{
+public:
+    HtnImageWriter() : m_termCount(0) {}
+    // Adds the term and everything in it to the term table if it isn't there yet and returns its index
+    uint32_t AddTerm(const std::shared_ptr<HtnTerm> &term);
+    void Save(std::vector<uint8_t> &output) const;
+    bool SaveToFile(const std::string &pathAndFile) const;
+    void Write(uint32_t value) { m_body.push_back(value); }
+    void WriteTerm(const std::shared_ptr<HtnTerm> &term) { Write(AddTerm(term)); }
+    // Writes the count and then each term
+    void WriteTerms(const std::vector<std::shared_ptr<HtnTerm>> &terms);
+
+private:
+    uint32_t AddString(const HtnTerm *term);
+
+    std::vector<uint32_t> m_body;
+    // Names are interned so they are found by the address of the name
+    std::unordered_map<const std::string *, uint32_t> m_stringIndexes;
+    std::vector<uint32_t> m_stringOffsets;
+    std::string m_strings;
+    std::unordered_map<const HtnTerm *, uint32_t> m_termIndexes;
+    uint32_t m_termCount;
+    std::vector<uint32_t> m_terms;
+};
+
+class HtnImageReader
+{
+public:
+    HtnImageReader() : m_body(nullptr), m_bodyEnd(nullptr), m_failed(false) {}
+    bool AtEnd() const { return m_body == m_bodyEnd; }
+    const std::string &error() const { return m_error; }
+    // Once anything fails to read, everything after it fails too
+    bool failed() const { return m_failed; }
+    // Creates all of the terms in the image, the body is read directly from data so it needs to stay valid until it has been read
+    bool Open(HtnTermFactory *factory, const uint8_t *data, size_t size);
+    std::shared_ptr<HtnTerm> ReadTerm();
+    void ReadTerms(std::vector<std::shared_ptr<HtnTerm>> &terms);
+    uint32_t ReadWord();
+    void SetError(const std::string &error);
+
+private:
+    const uint32_t *m_body;
+    const uint32_t *m_bodyEnd;
+    std::string m_error;
+    bool m_failed;
+    std::vector<std::shared_ptr<HtnTerm>> m_terms;
+};
+
+#endif /* HtnImage_hpp */
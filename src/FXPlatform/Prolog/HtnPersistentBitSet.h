@@ -0,0 +1,75 @@
+//
+//  HtnPersistentBitSet.h
+//  GameLib
+//
+
+#ifndef HtnPersistentBitSet_hpp
+#define HtnPersistentBitSet_hpp
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Set of bits whose copies share everything: copying is O(1) and Set() only copies the table of blocks and the block that
+// has the bit. Blocks are never changed once they are created, so copies can be used from different threads
+class HtnPersistentBitSet
+{
+public:
+    HtnPersistentBitSet() : m_count(0) {}
+    void clear() { m_blocks = nullptr; m_count = 0; }
+    // Number of bits that are set
+    size_t count() const { return m_count; }
+
+    void Set(uint32_t position)
+    {
+        if(Test(position))
+        {
+            return;
+        }
+
+        uint32_t blockIndex = position / BlockBits;
+        std::shared_ptr<BlocksType> blocks = m_blocks == nullptr ? std::make_shared<BlocksType>() : std::make_shared<BlocksType>(*m_blocks);
+        if(blocks->size() <= blockIndex)
+        {
+            blocks->resize(blockIndex + 1);
+        }
+
+        std::shared_ptr<Block> block = (*blocks)[blockIndex] == nullptr ? std::make_shared<Block>() : std::make_shared<Block>(*(*blocks)[blockIndex]);
+        block->words[(position % BlockBits) / 64] |= (uint64_t) 1 << (position % 64);
+        (*blocks)[blockIndex] = block;
+        m_blocks = blocks;
+        m_count++;
+    }
+
+    bool Test(uint32_t position) const
+    {
+        if(m_blocks == nullptr)
+        {
+            return false;
+        }
+
+        uint32_t blockIndex = position / BlockBits;
+        if(blockIndex >= m_blocks->size())
+        {
+            return false;
+        }
+
+        const Block *block = (*m_blocks)[blockIndex].get();
+        return block != nullptr && ((block->words[(position % BlockBits) / 64] >> (position % 64)) & 1) != 0;
+    }
+
+private:
+    static const uint32_t BlockBits = 4096;
+    class Block
+    {
+    public:
+        Block() { std::fill(words, words + BlockBits / 64, 0); }
+        uint64_t words[BlockBits / 64];
+    };
+    typedef std::vector<std::shared_ptr<const Block>> BlocksType;
+
+    std::shared_ptr<const BlocksType> m_blocks;
+    size_t m_count;
+};
+
+#endif /* HtnPersistentBitSet_hpp */
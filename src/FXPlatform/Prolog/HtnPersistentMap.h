@@ -0,0 +1,231 @@
+//
+//  HtnPersistentMap.h
+//  GameLib
+//
+
+#ifndef HtnPersistentMap_hpp
+#define HtnPersistentMap_hpp
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Ordered map whose copies share everything: copying is O(1) and Insert()/Erase() are O(log n) because they only copy the
+// nodes on the path to the key (an AVL tree with path copying). Nodes are never changed once they are created, so copies
+// can be used from different threads
+template<class Key, class Value, class Compare = std::less<Key>>
+class HtnPersistentMap
+{
+public:
+    HtnPersistentMap() : m_size(0) {}
+    void clear() { m_root = nullptr; m_size = 0; }
+    // Returns true if the key was there
+    bool Erase(const Key &key)
+    {
+        bool erased = false;
+        m_root = Erase(m_root, key, &erased);
+        if(erased) { m_size--; }
+        return erased;
+    }
+
+    // Returns nullptr if key isn't there. The pointer is valid as long as this map or a copy of it has the key
+    const Value *Find(const Key &key) const
+    {
+        const Node *node = m_root.get();
+        while(node != nullptr)
+        {
+            if(m_compare(key, node->key)) { node = node->left.get(); }
+            else if(m_compare(node->key, key)) { node = node->right.get(); }
+            else { return &node->value; }
+        }
+
+        return nullptr;
+    }
+
+    // Calls func(key, value) in key order until it returns false
+    template<class Function>
+    void ForEach(Function func) const
+    {
+        Walk(nullptr, func);
+    }
+
+    // Calls func(key, value) in key order starting at the first key that is not less than key, until it returns false
+    template<class Function>
+    void ForEachFrom(const Key &key, Function func) const
+    {
+        Walk(&key, func);
+    }
+
+    // Replaces the value if key is already there
+    void Insert(const Key &key, const Value &value)
+    {
+        bool added = false;
+        m_root = Insert(m_root, key, value, &added);
+        if(added) { m_size++; }
+    }
+
+    size_t size() const { return m_size; }
+
+private:
+    class Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+    class Node
+    {
+    public:
+        Node(const Key &keyArg, const Value &valueArg, const NodePtr &leftArg, const NodePtr &rightArg) :
+            key(keyArg),
+            value(valueArg),
+            left(leftArg),
+            right(rightArg),
+            height(1 + std::max(Height(leftArg), Height(rightArg)))
+        {
+        }
+
+        Key key;
+        Value value;
+        NodePtr left;
+        NodePtr right;
+        int height;
+    };
+
+    static int Height(const NodePtr &node) { return node == nullptr ? 0 : node->height; }
+    static NodePtr MakeNode(const Key &key, const Value &value, const NodePtr &left, const NodePtr &right) { return std::make_shared<const Node>(key, value, left, right); }
+
+    // Builds a node from its parts, rotating if the two sides differ in height by more than 1
+    static NodePtr Balance(const Key &key, const Value &value, const NodePtr &left, const NodePtr &right)
+    {
+        int leftHeight = Height(left);
+        int rightHeight = Height(right);
+        if(leftHeight > rightHeight + 1)
+        {
+            if(Height(left->left) >= Height(left->right))
+            {
+                return MakeNode(left->key, left->value, left->left, MakeNode(key, value, left->right, right));
+            }
+            else
+            {
+                const NodePtr &middle = left->right;
+                return MakeNode(middle->key, middle->value, MakeNode(left->key, left->value, left->left, middle->left), MakeNode(key, value, middle->right, right));
+            }
+        }
+        else if(rightHeight > leftHeight + 1)
+        {
+            if(Height(right->right) >= Height(right->left))
+            {
+                return MakeNode(right->key, right->value, MakeNode(key, value, left, right->left), right->right);
+            }
+            else
+            {
+                const NodePtr &middle = right->left;
+                return MakeNode(middle->key, middle->value, MakeNode(key, value, left, middle->left), MakeNode(right->key, right->value, middle->right, right->right));
+            }
+        }
+        else
+        {
+            return MakeNode(key, value, left, right);
+        }
+    }
+
+    NodePtr Erase(const NodePtr &node, const Key &key, bool *erased) const
+    {
+        if(node == nullptr)
+        {
+            return node;
+        }
+        else if(m_compare(key, node->key))
+        {
+            NodePtr left = Erase(node->left, key, erased);
+            return *erased ? Balance(node->key, node->value, left, node->right) : node;
+        }
+        else if(m_compare(node->key, key))
+        {
+            NodePtr right = Erase(node->right, key, erased);
+            return *erased ? Balance(node->key, node->value, node->left, right) : node;
+        }
+        else
+        {
+            *erased = true;
+            if(node->left == nullptr) { return node->right; }
+            else if(node->right == nullptr) { return node->left; }
+            else
+            {
+                // Replace this node with the smallest node on the right
+                const Node *smallest = node->right.get();
+                while(smallest->left != nullptr) { smallest = smallest->left.get(); }
+                NodePtr right = EraseSmallest(node->right);
+                return Balance(smallest->key, smallest->value, node->left, right);
+            }
+        }
+    }
+
+    static NodePtr EraseSmallest(const NodePtr &node)
+    {
+        if(node->left == nullptr)
+        {
+            return node->right;
+        }
+        else
+        {
+            return Balance(node->key, node->value, EraseSmallest(node->left), node->right);
+        }
+    }
+
+    // Walks in order starting at key (or the beginning if it is nullptr) with an explicit stack of the nodes whose left side
+    // has been visited but not the node itself
+    template<class Function>
+    void Walk(const Key *key, Function func) const
+    {
+        std::vector<const Node *> stack;
+        const Node *node = m_root.get();
+        while(node != nullptr)
+        {
+            if(key != nullptr && m_compare(node->key, *key))
+            {
+                node = node->right.get();
+            }
+            else
+            {
+                stack.push_back(node);
+                node = node->left.get();
+            }
+        }
+
+        while(stack.size() > 0)
+        {
+            node = stack.back();
+            stack.pop_back();
+            if(!func(node->key, node->value)) { return; }
+            for(node = node->right.get(); node != nullptr; node = node->left.get())
+            {
+                stack.push_back(node);
+            }
+        }
+    }
+
+    NodePtr Insert(const NodePtr &node, const Key &key, const Value &value, bool *added) const
+    {
+        if(node == nullptr)
+        {
+            *added = true;
+            return MakeNode(key, value, nullptr, nullptr);
+        }
+        else if(m_compare(key, node->key))
+        {
+            return Balance(node->key, node->value, Insert(node->left, key, value, added), node->right);
+        }
+        else if(m_compare(node->key, key))
+        {
+            return Balance(node->key, node->value, node->left, Insert(node->right, key, value, added));
+        }
+        else
+        {
+            return MakeNode(key, value, node->left, node->right);
+        }
+    }
+
+    Compare m_compare;
+    NodePtr m_root;
+    size_t m_size;
+};
+
+#endif /* HtnPersistentMap_hpp */
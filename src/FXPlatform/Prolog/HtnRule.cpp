@@ -6,9 +6,12 @@
 //  Copyright © 2019 Eric Zinda. All rights reserved.
 //
 
+#include <algorithm>
+#include "HtnHeadProgram.h"
 #include "HtnRule.h"
 #include "HtnRuleSet.h"
 #include "HtnTerm.h"
+#include "HtnTermFactory.h"
 using namespace std;
 
 shared_ptr<HtnRule> HtnRule::MakeVariablesUnique(HtnTermFactory *factory, const string &uniquifier, std::map<std::string, std::shared_ptr<HtnTerm>> &variableMap, bool onlyDontCareVariables) const
@@ -26,6 +29,115 @@ shared_ptr<HtnRule> HtnRule::MakeVariablesUnique(HtnTermFactory *factory, const
     return newRule;
 }
 
+// Walks the rule in the same order as HtnTerm::RenameVariables() does so the don't care slots line up
+static void AddVariableSlots(HtnTerm *term, vector<HtnTerm *> &variables, vector<HtnTerm *> &dontCareOccurrences)
+{
+    if(term->isGround())
+    {
+        return;
+    }
+    else if(term->isVariable())
+    {
+        if((*term->m_namePtr)[1] == '_')
+        {
+            dontCareOccurrences.push_back(term);
+        }
+        else if(find(variables.begin(), variables.end(), term) == variables.end())
+        {
+            variables.push_back(term);
+        }
+    }
+    else
+    {
+        for(const shared_ptr<HtnTerm> &argument : term->arguments())
+        {
+            AddVariableSlots(argument.get(), variables, dontCareOccurrences);
+        }
+    }
+}
+
+// Rules can be shared by planners running on different threads, so the slots are published atomically.
+// If two threads calculate them at the same time they get the same answer and one of them wins
+shared_ptr<HtnRule::VariableSlots> HtnRule::GetVariableSlots() const
+{
+    shared_ptr<VariableSlots> slots = atomic_load(&m_variableSlots);
+    if(slots == nullptr)
+    {
+        slots = shared_ptr<VariableSlots>(new VariableSlots());
+        AddVariableSlots(m_head.get(), slots->variables, slots->dontCareOccurrences);
+        for(const shared_ptr<HtnTerm> &term : m_tail)
+        {
+            AddVariableSlots(term.get(), slots->variables, slots->dontCareOccurrences);
+        }
+        
+        atomic_store(&m_variableSlots, slots);
+    }
+    
+    return slots;
+}
+
+// Published atomically like the variable slots
+shared_ptr<HtnHeadProgram> HtnRule::headProgram() const
+{
+    shared_ptr<HtnHeadProgram> program = atomic_load(&m_headProgram);
+    if(program == nullptr)
+    {
+        program = HtnHeadProgram::Compile(m_head);
+        atomic_store(&m_headProgram, program);
+    }
+
+    return program;
+}
+
+shared_ptr<HtnRule> HtnRule::RenameVariables(HtnTermFactory *factory, vector<HtnTerm *> &variables, vector<shared_ptr<HtnTerm>> &newVariables) const
+{
+    shared_ptr<VariableSlots> slotsPtr = GetVariableSlots();
+    const VariableSlots &slots = *slotsPtr;
+    variables = slots.variables;
+    newVariables.clear();
+    newVariables.reserve(variables.size());
+    int64_t frame = factory->ReserveVariableFrames((int) (slots.variables.size() + slots.dontCareOccurrences.size()));
+    for(HtnTerm *variable : slots.variables)
+    {
+        newVariables.push_back(factory->CreateVariable(*variable, frame++));
+    }
+
+    // Don't care variables can't match so each occurrence gets its own variable
+    vector<shared_ptr<HtnTerm>> dontCareVariables;
+    dontCareVariables.reserve(slots.dontCareOccurrences.size());
+    for(HtnTerm *variable : slots.dontCareOccurrences)
+    {
+        dontCareVariables.push_back(factory->CreateVariable(*variable, frame++));
+    }
+    
+    int dontCareIndex = 0;
+    shared_ptr<HtnTerm> newHead = m_head->RenameVariables(factory, slots.variables, newVariables, &dontCareVariables, &dontCareIndex);
+    vector<shared_ptr<HtnTerm>> newTail;
+    newTail.reserve(m_tail.size());
+    for(const shared_ptr<HtnTerm> &term : m_tail)
+    {
+        newTail.push_back(term->RenameVariables(factory, slots.variables, newVariables, &dontCareVariables, &dontCareIndex));
+    }
+    
+    // Like MakeVariablesUnique(), a don't care variable maps to its last occurrence when the mapping is used for anything else
+    size_t firstDontCare = variables.size();
+    for(int index = 0; index < (int) slots.dontCareOccurrences.size(); ++index)
+    {
+        vector<HtnTerm *>::iterator found = find(variables.begin() + firstDontCare, variables.end(), slots.dontCareOccurrences[index]);
+        if(found == variables.end())
+        {
+            variables.push_back(slots.dontCareOccurrences[index]);
+            newVariables.push_back(dontCareVariables[index]);
+        }
+        else
+        {
+            newVariables[found - variables.begin()] = dontCareVariables[index];
+        }
+    }
+    
+    return shared_ptr<HtnRule>(new HtnRule(newHead, newTail));
+}
+
 string HtnRule::ToString() const
 {
     stringstream stream;
@@ -12,6 +12,7 @@
 #include <memory>
 #include <string>
 #include <vector>
+class HtnHeadProgram;
 class HtnRuleSet;
 class HtnTerm;
 class HtnTermFactory;
@@ -33,15 +34,35 @@ public:
         return m_tail.size() == 0;
     }
     std::shared_ptr<HtnRule> MakeVariablesUnique(HtnTermFactory *factory, const std::string &uniquifier, std::map<std::string, std::shared_ptr<HtnTerm>> &variableMap, bool justDontCareVariables = false) const;
+    // Gives every variable a new frame instead of a new name, which doesn't create or look up any strings. The variable slots are numbered
+    // the first time the rule is renamed and each rename reserves one frame per slot, so slot N goes into the first frame + N.
+    // Returns the mapping in variables -> newVariables so it can be used with HtnTerm::RenameVariables()
+    std::shared_ptr<HtnRule> RenameVariables(HtnTermFactory *factory, std::vector<HtnTerm *> &variables, std::vector<std::shared_ptr<HtnTerm>> &newVariables) const;
     std::string ToString() const;
     std::string ToStringProlog() const;
 
     const std::shared_ptr<HtnTerm> head() const { return m_head; }
+    // The head compiled for HtnGoalResolver::UnifyCompiled(), the first time it is needed
+    std::shared_ptr<HtnHeadProgram> headProgram() const;
     const std::vector<std::shared_ptr<HtnTerm>> &tail() const { return m_tail; }
     
 private:
+    struct VariableSlots
+    {
+        // Each distinct variable gets a slot
+        std::vector<HtnTerm *> variables;
+        // Except don't care variables ("_" ones) which get a slot for every occurrence, in the order they appear
+        std::vector<HtnTerm *> dontCareOccurrences;
+    };
+    
+    std::shared_ptr<VariableSlots> GetVariableSlots() const;
+
     std::shared_ptr<HtnTerm> m_head;
+    // Calculated the first time it is needed and shared by copies of the rule
+    mutable std::shared_ptr<HtnHeadProgram> m_headProgram;
     std::vector<std::shared_ptr<HtnTerm>> m_tail;
+    // Calculated the first time it is needed and shared by copies of the rule
+    mutable std::shared_ptr<VariableSlots> m_variableSlots;
 };
 
 #endif /* HtnRule_hpp */
@@ -8,72 +8,183 @@
 #include "FXPlatform/FailFast.h"
 #include "FXPlatform/NanoTrace.h"
 #include "FXPlatform/SystemTraceType.h"
+#include "HtnHeadProgram.h"
+#include "HtnImage.h"
 #include "HtnRuleSet.h"
 #include "HtnTerm.h"
 using namespace std;
 
+// 'RULE' so a reader can tell it is at the rules
+static const uint32_t RulesImageTag = 0x454C5552;
+
 void HtnRuleSet::HtnSharedRules::AddRule(shared_ptr<HtnTerm> head, vector<shared_ptr<HtnTerm>> tail)
 {
     FailFastAssertDesc(!m_isLocked, "Internal Error");
     FailFastAssertDesc(head->name().size() > 0, "term name must have at least one character");
     HtnTerm::HtnTermID headID = head->GetUniqueID();
     
-    // Ground facts must be unique
-    if(tail.size() == 0 && head->isGround())
+    // Ground facts must be unique. Heads are interned so if a rule has this head, it is the same term
+    if(tail.size() == 0 && head->isGround() && m_ruleHeads.find(headID) != m_ruleHeads.end())
     {
-        auto found = m_ruleHeads.find(headID);
-        if(found != m_ruleHeads.end())
-        {
-            // Make sure we actually have the rule and it isn't some artifact of
-            // how we are tracking the rules
-            for(auto item : m_rules)
-            {
-                if(item.head()->ToString() == head->ToString())
-                {
-                    TraceString1("HtnRuleSet::HtnSharedRules::AddRule duplicate rule '{0}'",
-                                 SystemTraceType::Solver, TraceDetail::Normal,
-                                 item.head()->ToString());
-                    FailFastAssertDesc(false, ("Duplicate Rule added: " + item.head()->ToString()).c_str());
-                }
-            }            
-        }
+        TraceString1("HtnRuleSet::HtnSharedRules::AddRule duplicate rule '{0}'",
+                     SystemTraceType::Solver, TraceDetail::Normal,
+                     head->ToString());
+        FailFastAssertDesc(false, ("Duplicate Rule added: " + head->ToString()).c_str());
     }
 
-    HtnRule newRule(head, tail);
-    
+    AppendRule(HtnRule(std::move(head), std::move(tail)));
+}
+
+// Adds the rule without checking if it is a duplicate
+void HtnRuleSet::HtnSharedRules::AppendRule(HtnRule rule)
+{
+    const HtnTerm *head = rule.head().get();
+    HtnTerm::HtnTermID headID = head->GetUniqueID();
+
     // Update indexes to make lookups faster later. Not a huge memory concern since this is a singleton shared by
     // all rules
-    string ruleString = newRule.GetUniqueID();
     m_ruleHeads.insert(headID);
-    m_ruleIndex.insert(ruleString);
-    m_dynamicSize += sizeof(headID) + sizeof(string) + ruleString.size();
+    m_dynamicSize += sizeof(headID);
+    if(rule.IsFact())
+    {
+        m_factHeads.insert(FactHeadsType::value_type(headID, (uint32_t) m_rules.size()));
+        m_dynamicSize += sizeof(headID);
+    }
 
-    m_rules.push_back(newRule);
+    RuleBucket &bucket = m_ruleBuckets[PredicateKey(head)];
+    bucket.ordinals.push_back((uint32_t) m_rules.size());
+    m_rules.push_back(std::move(rule));
+    bucket.rules.push_back(&m_rules.back());
+    bucket.ClearIndexes();
     // Need to subtract off HtnRule because dynamicSize() already includes it
-    m_dynamicSize += sizeof(pair<string, HtnRule>) - sizeof(HtnRule) + newRule.dynamicSize();
+    m_dynamicSize += sizeof(pair<string, HtnRule>) - sizeof(HtnRule) + m_rules.back().dynamicSize() + sizeof(const HtnRule *) + sizeof(uint32_t);
+    
+    // Compile the head now so its size is counted, and so rules never change once they are shared
+    m_dynamicSize += m_rules.back().headProgram()->dynamicSize();
+}
+
+// The buckets point into m_rules so they are rebuilt to point at the copies
+HtnRuleSet::HtnSharedRules::HtnSharedRules(const HtnSharedRules &other) :
+    m_dynamicSize(other.m_dynamicSize),
+    m_isLocked(other.m_isLocked),
+    m_factHeads(other.m_factHeads),
+    m_ruleHeads(other.m_ruleHeads),
+    m_rules(other.m_rules),
+    m_tabledPredicates(other.m_tabledPredicates)
+{
+    uint32_t ordinal = 0;
+    for(const HtnRule &rule : m_rules)
+    {
+        RuleBucket &bucket = m_ruleBuckets[PredicateKey(rule.head().get())];
+        bucket.rules.push_back(&rule);
+        bucket.ordinals.push_back(ordinal++);
+    }
+}
+
+shared_ptr<HtnRuleSet::HtnSharedRules::ArgumentIndex> HtnRuleSet::HtnSharedRules::RuleBucket::FindBestIndex(const HtnTerm *goal, const vector<uint32_t> **constantMatches, const vector<uint32_t> **variableMatches) const
+{
+    static const vector<uint32_t> noMatches;
+    shared_ptr<ArgumentIndex> bestIndex;
+    if(rules.size() < IndexThreshold)
+    {
+        return bestIndex;
+    }
+    
+    size_t bestCount = rules.size();
+    for(int position = 0; position < goal->arity(); ++position)
+    {
+        const HtnTerm *argument = goal->arguments()[position].get();
+        if(argument->isConstant())
+        {
+            shared_ptr<ArgumentIndex> index = GetArgumentIndex(position);
+            unordered_map<int, vector<uint32_t>>::const_iterator found = index->constants.find(argument->atomID());
+            const vector<uint32_t> *matches = found == index->constants.end() ? &noMatches : &found->second;
+            size_t count = matches->size() + index->variables.size();
+            if(count < bestCount)
+            {
+                bestCount = count;
+                bestIndex = index;
+                *constantMatches = matches;
+                *variableMatches = &index->variables;
+            }
+        }
+    }
+    
+    return bestIndex;
+}
+
+// If two threads build the same index at the same time, the last one stored wins and the other is built again later
+shared_ptr<HtnRuleSet::HtnSharedRules::ArgumentIndex> HtnRuleSet::HtnSharedRules::RuleBucket::GetArgumentIndex(int position) const
+{
+    shared_ptr<IndexesType> indexes = atomic_load(&m_indexes);
+    if(indexes != nullptr && (*indexes)[position] != nullptr)
+    {
+        return (*indexes)[position];
+    }
+    
+    shared_ptr<ArgumentIndex> index = shared_ptr<ArgumentIndex>(new ArgumentIndex());
+    for(uint32_t ruleIndex = 0; ruleIndex < rules.size(); ++ruleIndex)
+    {
+        // Compound arguments can never unify with a constant so they are left out
+        const HtnTerm *argument = rules[ruleIndex]->head()->arguments()[position].get();
+        if(argument->isVariable())
+        {
+            index->variables.push_back(ruleIndex);
+        }
+        else if(argument->isConstant())
+        {
+            index->constants[argument->atomID()].push_back(ruleIndex);
+        }
+    }
+    
+    shared_ptr<IndexesType> newIndexes = indexes == nullptr ? shared_ptr<IndexesType>(new IndexesType(rules[0]->head()->arity())) : shared_ptr<IndexesType>(new IndexesType(*indexes));
+    (*newIndexes)[position] = index;
+    atomic_store(&m_indexes, newIndexes);
+    return index;
 }
 
 void HtnRuleSet::HtnSharedRules::ClearAll()
 {
     FailFastAssertDesc(!m_isLocked, "Internal Error");
     m_rules.clear();
+    m_ruleBuckets.clear();
+    m_factHeads.clear();
     m_ruleHeads.clear();
-    m_ruleIndex.clear();
+    m_tabledPredicates.clear();
     m_dynamicSize = sizeof(HtnSharedRules);
 }
 
-// A fact is a rule that is true (i.e. has no tail)
-bool HtnRuleSet::HtnSharedRules::HasFact(shared_ptr<HtnTerm> term) const
+// Only the head sets grow per rule, the buckets grow per predicate
+void HtnRuleSet::HtnSharedRules::Reserve(size_t ruleCount)
 {
-    HtnRule rule(term, {});
-    return m_ruleIndex.find(rule.GetUniqueID()) != m_ruleIndex.end();
+    FailFastAssertDesc(!m_isLocked, "Internal Error");
+    m_ruleHeads.reserve(m_ruleHeads.size() + ruleCount);
+    m_factHeads.reserve(m_factHeads.size() + ruleCount);
 }
 
 void HtnRuleSet::AddRule(shared_ptr<HtnTerm> head, vector<shared_ptr<HtnTerm>> tail)
 {
     // Should not be updating facts at this point
     FailFastAssertDesc(m_factsDiff.size() == 0, "Internal Error");
-    m_sharedRules->AddRule(head, tail);
+    m_sharedRules->AddRule(std::move(head), std::move(tail));
+    ResetAnswerTable();
+}
+
+void HtnRuleSet::AddTabledPredicate(shared_ptr<HtnTerm> name, int arity)
+{
+    FailFastAssertDesc(!m_sharedRules->m_isLocked, "Internal Error");
+    FailFastAssertDesc(name->isConstant() && arity >= 0, ("Tabled predicates must be name/arity: " + name->ToString()).c_str());
+    m_sharedRules->m_tabledPredicates[PredicateKey(name->atomID(), arity)] = name;
+    ResetAnswerTable();
+}
+
+// Only a hint, so it does nothing if rules can't be added to the shared rules
+void HtnRuleSet::ReserveRules(size_t ruleCount)
+{
+    if(ruleCount > 0 && m_factsDiff.size() == 0 && !m_sharedRules->m_isLocked)
+    {
+        m_sharedRules->Reserve(ruleCount);
+    }
 }
 
 // This is a quick test to get rid of obvious failures without having to do more work
@@ -84,7 +195,7 @@ void HtnRuleSet::AddRule(shared_ptr<HtnTerm> head, vector<shared_ptr<HtnTerm>> t
 // Constant / Constant -> If they are equal
 // Constant / Variable
 // Compound / Compound -> If they are equivalent
-bool HtnRuleSet::CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHead) const
+bool HtnRuleSet::CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHead)
 {
     if(term->isEquivalentCompoundTerm(ruleHead) || (term->isConstant() && ruleHead->isConstant()))
     {
@@ -153,7 +264,7 @@ bool HtnRuleSet::CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHea
             else
             {
                 // Should always be a variable, compound or constant
-                FailFastAssert(false);
+                StaticFailFastAssert(false);
             }
         }
         
@@ -166,20 +277,191 @@ bool HtnRuleSet::CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHea
 }
 
 
+HtnRuleSet::RuleCursor::RuleCursor(const HtnRuleSet &ruleSet, const HtnTerm *targetTerm) :
+    m_targetTerm(targetTerm),
+    m_key(PredicateKey(targetTerm)),
+    m_bucket(nullptr),
+    m_bucketSize(0),
+    m_constantMatches(nullptr),
+    m_variableMatches(nullptr),
+    m_constantPosition(0),
+    m_variablePosition(0),
+    m_position(0),
+    m_deletedSharedFacts(ruleSet.m_deletedSharedFacts),
+    m_factAdditions(ruleSet.m_factAdditions),
+    m_nextAdditionOrder(0),
+    m_hasPeeked(false),
+    m_peeked(nullptr)
+{
+    HtnSharedRules::RuleBucketsType::const_iterator bucket = ruleSet.m_sharedRules->m_ruleBuckets.find(m_key);
+    if(bucket != ruleSet.m_sharedRules->m_ruleBuckets.end())
+    {
+        m_sharedRules = ruleSet.m_sharedRules;
+        m_bucket = &bucket->second;
+        m_bucketSize = m_bucket->rules.size();
+        m_index = m_bucket->FindBestIndex(targetTerm, &m_constantMatches, &m_variableMatches);
+    }
+}
+
+const HtnRule *HtnRuleSet::RuleCursor::Next()
+{
+    if(m_hasPeeked)
+    {
+        m_hasPeeked = false;
+        return m_peeked;
+    }
+
+    return Advance();
+}
+
+// The rule stays valid while it is peeked since the shared rules are only released, and the additions only cleared, after
+// the last one has been returned
+const HtnRule *HtnRuleSet::RuleCursor::Peek()
+{
+    if(!m_hasPeeked)
+    {
+        m_peeked = Advance();
+        m_hasPeeked = true;
+    }
+
+    return m_peeked;
+}
+
+const HtnRule *HtnRuleSet::RuleCursor::Advance()
+{
+    // Go through all rules in the shared ruleset that have this name and arity
+    while(m_bucket != nullptr)
+    {
+        uint32_t position;
+        if(m_index == nullptr)
+        {
+            if(m_position == m_bucketSize)
+            {
+                break;
+            }
+
+            position = (uint32_t) m_position++;
+        }
+        else
+        {
+            // Merge the rules that have the constant with the ones that have a variable in that position
+            // so they stay in declaration order
+            bool hasConstant = m_constantPosition < m_constantMatches->size();
+            bool hasVariable = m_variablePosition < m_variableMatches->size();
+            if(!hasConstant && !hasVariable)
+            {
+                break;
+            }
+            else if(!hasVariable || (hasConstant && (*m_constantMatches)[m_constantPosition] < (*m_variableMatches)[m_variablePosition]))
+            {
+                position = (*m_constantMatches)[m_constantPosition++];
+            }
+            else
+            {
+                position = (*m_variableMatches)[m_variablePosition++];
+            }
+        }
+
+        // if this rule is a fact it might have been deleted. Either the fact was deleted or it was deleted and added, in which case it
+        // should properly show up later in the additions since it is no longer from the original document
+        const HtnRule *rule = m_bucket->rules[position];
+        if((!rule->IsFact() || !m_deletedSharedFacts.Test(m_bucket->ordinals[position])) && CanPotentiallyUnify(m_targetTerm, rule->head().get()))
+        {
+            return rule;
+        }
+    }
+
+    if(m_bucket != nullptr)
+    {
+        m_bucket = nullptr;
+        m_index = nullptr;
+        m_sharedRules = nullptr;
+    }
+
+    // Go through all the currently active additions with this name and arity in the order they were added
+    const HtnRule *found = nullptr;
+    m_factAdditions.ForEachFrom(FactAdditionKeyType(m_key, m_nextAdditionOrder), [&](const FactAdditionKeyType &itemKey, const shared_ptr<HtnRule> &rule)
+    {
+        if(itemKey.first != m_key)
+        {
+            return false;
+        }
+
+        m_nextAdditionOrder = itemKey.second + 1;
+        if(CanPotentiallyUnify(m_targetTerm, rule->head().get()))
+        {
+            found = rule.get();
+            return false;
+        }
+
+        return true;
+    });
+
+    if(found == nullptr)
+    {
+        m_factAdditions.clear();
+    }
+
+    return found;
+}
+
 void HtnRuleSet::ClearAll()
 {
     m_sharedRules->ClearAll();
     m_factsDiff.clear();
     m_factAdditions.clear();
+    m_deletedSharedFacts.clear();
+    m_answerTable = nullptr;
+    m_dynamicSize = sizeof(HtnRuleSet);
+}
+
+// Replaces the shared rules with new locked ones that have the facts diff applied and clears the diff. Nothing changes from the outside
+// and copies of this RuleSet keep using the old shared rules
+void HtnRuleSet::Compact()
+{
+    if(m_factsDiff.size() == 0)
+    {
+        return;
+    }
+
+    // Rules with the same head as a fact that was added later are allowed, so these are not checked for duplicates
+    shared_ptr<HtnSharedRules> newSharedRules = shared_ptr<HtnSharedRules>(new HtnSharedRules());
+    newSharedRules->Reserve(m_sharedRules->allRules().size() + m_factAdditions.size());
+    AllRules([&](const HtnRule &rule)
+    {
+        newSharedRules->AppendRule(rule);
+        return true;
+    });
+
+    newSharedRules->m_tabledPredicates = m_sharedRules->m_tabledPredicates;
+    newSharedRules->Lock();
+    m_sharedRules = newSharedRules;
+    m_factsDiff.clear();
+    m_factAdditions.clear();
+    m_deletedSharedFacts.clear();
+    m_factsOrder = 0;
     m_dynamicSize = sizeof(HtnRuleSet);
 }
 
+// Additions aren't indexed and every lookup has to get past the diff, so once it is a good fraction of the shared rules it is worth a copy
+bool HtnRuleSet::CompactIfNeeded()
+{
+    if(m_factsDiff.size() >= CompactMinimumDiff && m_factsDiff.size() * 4 >= m_sharedRules->allRules().size())
+    {
+        Compact();
+        return true;
+    }
+
+    return false;
+}
+
 // Creates a new RuleSet with a copy of the rules that is editable.  Changes to the original will not be reflected
 shared_ptr<HtnRuleSet> HtnRuleSet::CreateSharedRulesCopy()
 {
     shared_ptr<HtnRuleSet> newState = shared_ptr<HtnRuleSet>(new HtnRuleSet());
     newState->m_sharedRules = shared_ptr<HtnSharedRules>(new HtnSharedRules(*m_sharedRules));
     newState->m_sharedRules->m_isLocked = false;
+    newState->ResetAnswerTable();
     
     return newState;
 }
@@ -229,38 +511,54 @@ bool HtnRuleSet::DebugHasRule(const string &head, const string &tail) const
     return found;
 }
 
+// Equivalent rules are exactly the ones in the buckets for the name and arity of term
 bool HtnRuleSet::HasEquivalentRule(std::shared_ptr<HtnTerm> term) const
 {
-    bool found = false;
-    AllRules([&](const HtnRule &rule)
-      {
-          if(rule.head()->isEquivalentCompoundTerm(term.get()))
-          {
-              found = true;
-              return false;
-          }
-          
-          return true;
-      });
-
-    return found;
+    PredicateKeyType key = PredicateKey(term.get());
+    bool hasAddition = false;
+    m_factAdditions.ForEachFrom(FactAdditionKeyType(key, 0), [&](const FactAdditionKeyType &itemKey, const shared_ptr<HtnRule> &)
+    {
+        hasAddition = itemKey.first == key;
+        return false;
+    });
+    
+    if(hasAddition)
+    {
+        return true;
+    }
+    
+    HtnSharedRules::RuleBucketsType::const_iterator bucket = m_sharedRules->m_ruleBuckets.find(key);
+    if(bucket != m_sharedRules->m_ruleBuckets.end())
+    {
+        const HtnSharedRules::RuleBucket &rules = bucket->second;
+        for(size_t position = 0; position < rules.rules.size(); ++position)
+        {
+            // Facts that are in the diff were deleted or are in the additions
+            if(!rules.rules[position]->IsFact() || !m_deletedSharedFacts.Test(rules.ordinals[position]))
+            {
+                return true;
+            }
+        }
+    }
+    
+    return false;
 }
 
 // A fact is a rule that is true
 bool HtnRuleSet::HasFact(shared_ptr<HtnTerm> term) const
 {
     // Since this rule is a fact it might have been updated or deleted
-    FactsDiffType::const_iterator found = m_factsDiff.find(term->GetUniqueID());
-    if(found != m_factsDiff.end())
+    const FactDiffItem *found = m_factsDiff.Find(term->GetUniqueID());
+    if(found != nullptr)
     {
         // New fact overrides the shared fact if it exists
-        if(found->second.isAdd) { return true; }
+        if(found->isAdd) { return true; }
         // fact was deleted
         else { return false; }
     }
 
     // It is a fact that wasn't updated, so it can only be in the shared rules
-    return m_sharedRules->HasFact(term);
+    return m_sharedRules->HasFact(term.get());
 }
 
 string HtnRuleSet::ToStringFacts() const
@@ -300,7 +598,7 @@ string HtnRuleSet::ToStringFactsProlog() const
 void HtnRuleSet::Update(HtnTermFactory *factory, const vector<shared_ptr<HtnTerm>> &factsToRemove, const vector<shared_ptr<HtnTerm>> &factsToAdd)
 {
     // Add all changes into the diffs list
-    for(auto item : factsToRemove)
+    for(const shared_ptr<HtnTerm> &item : factsToRemove)
     {
         // All removals must be ground
         FailFastAssertDesc(item->isGround(), ("Items to be removed must be ground: " + item->ToString()).c_str());
@@ -315,35 +613,40 @@ void HtnRuleSet::Update(HtnTermFactory *factory, const vector<shared_ptr<HtnTerm
         // a factsDiff entry that is a remove of something not in the base DB.  This is inert.
         shared_ptr<HtnRule> rule = shared_ptr<HtnRule>(new HtnRule(item, {}));
         HtnTerm::HtnTermID key = item->GetUniqueID();
-        FactsDiffType::iterator found = m_factsDiff.find(key);
+        const FactDiffItem *found = m_factsDiff.Find(key);
         int diffOrderToRemove = -1;
-        if(found == m_factsDiff.end())
+        if(found == nullptr)
         {
-            m_factsDiff.insert(FactsDiffType::value_type(key, FactsDiffType::mapped_type(false, m_factsOrder, rule)));
-            m_factsOrder++;
-            
             // Need to subtract off HtnRule because dynamicSize() already includes it
-            m_dynamicSize += sizeof(FactsDiffType::value_type) - sizeof(HtnRule) + rule->dynamicSize();
+            m_dynamicSize += sizeof(pair<HtnTerm::HtnTermID, FactDiffItem>) - sizeof(HtnRule) + rule->dynamicSize();
         }
         else
         {
-            diffOrderToRemove = found->second.diffOrder;
-            
-            // Can't use .insert because that won't replace an existing item
-            found->second = FactsDiffType::mapped_type(false, m_factsOrder, rule);
-            m_factsOrder++;
+            diffOrderToRemove = found->diffOrder;
         }
         
+        // If it is from the shared rules, it is hidden from now on even if it gets added again since the addition will be used.
+        // Every copy of the fact is hidden, just like removing it from the diffs hides all of them
+        auto sharedOrdinals = m_sharedRules->FindFacts(item.get());
+        for(auto ordinal = sharedOrdinals.first; ordinal != sharedOrdinals.second; ++ordinal)
+        {
+            m_deletedSharedFacts.Set(ordinal->second);
+        }
+
+        // Replaces an existing item
+        m_factsDiff.Insert(key, FactDiffItem(false, m_factsOrder, rule));
+        m_factsOrder++;
+        
         // Also need to erase it from the order member if it was an add before
         if(diffOrderToRemove != -1)
         {
-            size_t erasedCount = m_factAdditions.erase(diffOrderToRemove);
-            FailFastAssertDesc(erasedCount == 1, "Internal Error");
+            bool erased = m_factAdditions.Erase(FactAdditionKeyType(PredicateKey(item.get()), diffOrderToRemove));
+            FailFastAssertDesc(erased, "Internal Error");
         }
     }
 
     // Add additions
-    for(auto item : factsToAdd)
+    for(const shared_ptr<HtnTerm> &item : factsToAdd)
     {
         // All additions must be ground
         FailFastAssertDesc(item->isGround(), ("All additions must be ground: " + item->ToString()).c_str());
@@ -358,21 +661,87 @@ void HtnRuleSet::Update(HtnTermFactory *factory, const vector<shared_ptr<HtnTerm
         int diffOrderToAdd = m_factsOrder;
         m_factsOrder++;
         HtnTerm::HtnTermID key = item->GetUniqueID();
-        FactsDiffType::iterator found = m_factsDiff.find(key);
-        if(found == m_factsDiff.end())
+        if(m_factsDiff.Find(key) == nullptr)
         {
-            m_factsDiff.insert(FactsDiffType::value_type(key, FactsDiffType::mapped_type(true, diffOrderToAdd, rule)));
-
             // Need to subtract off HtnRule because dynamicSize() already includes it
-            m_dynamicSize += sizeof(FactsDiffType::value_type) - sizeof(HtnRule) + rule->dynamicSize();
-        }
-        else
-        {
-            // Can't use .insert because that won't replace an existing item
-            found->second = FactsDiffType::mapped_type(true, diffOrderToAdd, rule);
+            m_dynamicSize += sizeof(pair<HtnTerm::HtnTermID, FactDiffItem>) - sizeof(HtnRule) + rule->dynamicSize();
         }
+
+        // Replaces an existing item
+        m_factsDiff.Insert(key, FactDiffItem(true, diffOrderToAdd, rule));
         
         // Now add it to the additions list
-        m_factAdditions.insert(FactsAdditionsType::value_type(diffOrderToAdd, rule));
+        m_factAdditions.Insert(FactAdditionKeyType(PredicateKey(item.get()), diffOrderToAdd), rule);
+    }
+
+    // Answers found before might not be true anymore
+    if(m_answerTable != nullptr && (factsToRemove.size() > 0 || factsToAdd.size() > 0))
+    {
+        ResetAnswerTable();
+    }
+}
+
+bool HtnRuleSet::LoadImage(HtnImageReader &reader)
+{
+    if(reader.ReadWord() != RulesImageTag)
+    {
+        reader.SetError("image doesn't have rules where expected");
+        return false;
+    }
+
+    uint32_t count = reader.ReadWord();
+    ReserveRules(reader.failed() ? 0 : count);
+    vector<shared_ptr<HtnTerm>> tail;
+    for(uint32_t index = 0; index < count; ++index)
+    {
+        shared_ptr<HtnTerm> head = reader.ReadTerm();
+        reader.ReadTerms(tail);
+        if(reader.failed())
+        {
+            return false;
+        }
+
+        AddRule(head, tail);
+    }
+
+    count = reader.ReadWord();
+    for(uint32_t index = 0; index < count; ++index)
+    {
+        shared_ptr<HtnTerm> name = reader.ReadTerm();
+        uint32_t arity = reader.ReadWord();
+        if(reader.failed())
+        {
+            return false;
+        }
+
+        AddTabledPredicate(name, (int) arity);
+    }
+
+    return !reader.failed();
+}
+
+void HtnRuleSet::WriteImage(HtnImageWriter &writer) const
+{
+    writer.Write(RulesImageTag);
+    uint32_t count = 0;
+    AllRules([&](const HtnRule &)
+    {
+        count++;
+        return true;
+    });
+
+    writer.Write(count);
+    AllRules([&](const HtnRule &rule)
+    {
+        writer.WriteTerm(rule.head());
+        writer.WriteTerms(rule.tail());
+        return true;
+    });
+
+    writer.Write((uint32_t) m_sharedRules->m_tabledPredicates.size());
+    for(const HtnSharedRules::TabledPredicatesType::value_type &item : m_sharedRules->m_tabledPredicates)
+    {
+        writer.WriteTerm(item.second);
+        writer.Write((uint32_t) (item.first & 0xFFFFFFFF));
     }
 }
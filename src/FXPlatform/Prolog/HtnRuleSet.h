@@ -8,13 +8,22 @@
 
 #ifndef HtnRuleSet_hpp
 #define HtnRuleSet_hpp
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include "HtnAnswerTable.h"
+#include "HtnPersistentBitSet.h"
+#include "HtnPersistentMap.h"
 #include "HtnRule.h"
 #include "HtnTerm.h"
+class HtnImageReader;
+class HtnImageWriter;
 
 // A Prolog program is simply a set of rules
 // Facts are simply clauses with empty bodies.  I.e.  cat(tom) means cat(tom) :- true, sunny means sunny := true
@@ -23,106 +32,93 @@ class HtnRuleSet : public std::enable_shared_from_this<HtnRuleSet>
 public:
     HtnRuleSet() : m_dynamicSize(sizeof(HtnRuleSet)), m_factsOrder(0), m_sharedRules(std::shared_ptr<HtnSharedRules>(new HtnSharedRules())) {}
     void AddRule(std::shared_ptr<HtnTerm> head, std::vector<std::shared_ptr<HtnTerm>> m_tail);
+    // Calls to name/arity will have their answers remembered by HtnGoalResolver, only use for predicates that don't have side effects
+    void AddTabledPredicate(std::shared_ptr<HtnTerm> name, int arity);
+    // Call before adding a large number of rules (e.g. loading a document) so storage is only allocated once
+    void ReserveRules(size_t ruleCount);
 
     // Needs to return all the rules in the order they were added (i.e. order they were declared)
-    // Also this needs to be very quick since it is called often
+    // Also this needs to be very quick since it is called often, so only the bucket for the name and arity of targetTerm is walked
     template<class Function>
     void AllRulesThatCouldUnify(HtnTerm *targetTerm, Function func) const
     {
-        // Go through all rules in the shared ruleset
-        for(HtnSharedRules::RulesType::const_iterator ruleIter = m_sharedRules->allRules().begin(); ruleIter != m_sharedRules->allRules().end(); ++ruleIter)
+        RuleCursor cursor(*this, targetTerm);
+        for(const HtnRule *rule = cursor.Next(); rule != nullptr; rule = cursor.Next())
         {
-            // if this rule is a fact it might have been deleted
-            if(ruleIter->IsFact())
-            {
-                FactsDiffType::const_iterator found = m_factsDiff.find(ruleIter->head()->GetUniqueID());
-                if(found != m_factsDiff.end())
-                {
-                    if(!found->second.isAdd)
-                    {
-                        // fact was deleted
-                        continue;
-                    }
-                    else
-                    {
-                        // Rule was deleted and added, thus it should properly show up later in the m_factsDiff loop
-                        // since it is no longer from the original document
-                        continue;
-                    }
-                }
-            }
-            
-            if(CanPotentiallyUnify(targetTerm, ruleIter->head().get()))
-            {
-                if(!func(*ruleIter)) { break; }
-            }
-        }
-        
-        // Go through all the currently active additions in the order they were added
-        for(const FactsAdditionsType::value_type &item : m_factAdditions)
-        {
-            if(CanPotentiallyUnify(targetTerm, item.second->head().get()))
-            {
-                if(!func(*item.second)) { break; }
-            }
+            if(!func(*rule)) { return; }
         }
     }
     
     // Needs to return all the rules in the order they were added (i.e. order they were declared)
-    // Also this needs to be very quick since it is called often
     template<class Function>
     void AllRules(Function func) const
     {
-        // Go through all rules in the shared ruleset
-        for(HtnSharedRules::RulesType::const_iterator ruleIter = m_sharedRules->allRules().begin(); ruleIter != m_sharedRules->allRules().end(); ++ruleIter)
+        // Go through all rules in the shared ruleset, the ordinal of a rule is its position in this list
+        uint32_t ordinal = 0;
+        for(HtnSharedRules::RulesType::const_iterator ruleIter = m_sharedRules->allRules().begin(); ruleIter != m_sharedRules->allRules().end(); ++ruleIter, ++ordinal)
         {
             // if this rule is a fact it might have been deleted
-            if(ruleIter->IsFact())
+            if(ruleIter->IsFact() && m_deletedSharedFacts.Test(ordinal))
             {
-                FactsDiffType::const_iterator found = m_factsDiff.find(ruleIter->head()->GetUniqueID());
-                if(found != m_factsDiff.end())
-                {
-                    if(!found->second.isAdd)
-                    {
-                        // fact was deleted
-                        continue;
-                    }
-                    else
-                    {
-                        // Rule was deleted and added, thus it should properly show up later in the m_factsDiff loop
-                        // since it is no longer from the original document
-                        continue;
-                    }
-                }
+                // Either the fact was deleted or it was deleted and added, in which case it
+                // should properly show up later in the additions loop since it is no longer from the original document
+                continue;
             }
             
-            if(!func(*ruleIter)) { break; }
+            if(!func(*ruleIter)) { return; }
         }
         
-        // Go through all the currently active additions in the order they were added
-        for(const FactsAdditionsType::value_type &item : m_factAdditions)
+        // Additions are sorted by predicate, so put them back into the order they were added
+        std::vector<std::pair<int, const HtnRule *>> additions;
+        additions.reserve(m_factAdditions.size());
+        m_factAdditions.ForEach([&](const FactAdditionKeyType &itemKey, const std::shared_ptr<HtnRule> &rule)
         {
-            if(!func(*item.second)) { break; }
+            additions.push_back(std::pair<int, const HtnRule *>(itemKey.second, rule.get()));
+            return true;
+        });
+        
+        std::sort(additions.begin(), additions.end());
+        for(const std::pair<int, const HtnRule *> &item : additions)
+        {
+            if(!func(*item.second)) { return; }
         }
     }
-    bool CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHead) const;
+    static bool CanPotentiallyUnify(const HtnTerm *term, const HtnTerm *ruleHead);
     void ClearAll();
     std::shared_ptr<HtnRuleSet> CreateNextState(HtnTermFactory *factory, const std::vector<std::shared_ptr<HtnTerm>> &factsToRemove, const std::vector<std::shared_ptr<HtnTerm>> &factsToAdd);
     std::shared_ptr<HtnRuleSet> CreateSharedRulesCopy();
     std::shared_ptr<HtnRuleSet> CreateCopy();
-    int64_t dynamicSize() { return m_dynamicSize; };
+    // Moves all the facts that were added and removed since the rules were locked into new shared rules so lookups are as fast as
+    // they are on rules that were just loaded
+    void Compact();
+    // Calls Compact() if there have been enough changes since the shared rules were created, returns true if it did
+    bool CompactIfNeeded();
+    int64_t dynamicSize() { return m_dynamicSize + (m_answerTable == nullptr ? 0 : m_answerTable->dynamicSize()); };
     int64_t dynamicSharedSize() { return m_sharedRules->dynamicSize(); };
     // Equivalent means same name and number of arguments
     bool HasEquivalentRule(std::shared_ptr<HtnTerm> term) const;
     bool HasFact(std::shared_ptr<HtnTerm> term) const;
+    // Answers to the tabled predicates for this state, nullptr if there aren't any tabled predicates
+    std::shared_ptr<HtnAnswerTable> answerTable() const { return m_answerTable; }
+    bool IsTabled(const HtnTerm *term) const { return m_sharedRules->m_tabledPredicates.size() > 0 && m_sharedRules->m_tabledPredicates.find(PredicateKey(term)) != m_sharedRules->m_tabledPredicates.end(); }
+    // Adds the rules that were written by WriteImage(), returns false and sets the reader error if they can't be read
+    bool LoadImage(HtnImageReader &reader);
     // Very inefficient, but useful for tests
     bool DebugHasRule(const std::string &head, const std::string &tail) const;
     void LockRules() { m_sharedRules->Lock(); }
     std::string ToStringFacts() const;
     std::string ToStringFactsProlog() const;
     void Update(HtnTermFactory *factory, const std::vector<std::shared_ptr<HtnTerm>> &factsToRemove, const std::vector<std::shared_ptr<HtnTerm>> &factsToAdd);
+    // Writes all the rules, in order, so they can be loaded later without compiling them
+    void WriteImage(HtnImageWriter &writer) const;
 
 private:
+    // Rules can only unify with a goal that has the same name and arity, so they are bucketed by both. The atom ID
+    // of a name is stable as long as a term that uses it is alive
+    typedef uint64_t PredicateKeyType;
+    static PredicateKeyType PredicateKey(int atomID, int arity) { return ((uint64_t) (uint32_t) atomID << 32) | (uint32_t) arity; }
+    static PredicateKeyType PredicateKey(const HtnTerm *term) { return PredicateKey(term->atomID(), term->arity()); }
+
     // RuleSets conserve memory by sharing the base ruleset and only making copies of the changes if a copy is made
     class HtnSharedRules
     {
@@ -131,28 +127,79 @@ private:
         // - we want to guarantee that the pointers to these don't move around as items are added
         // - we need to guarantee allRules() returns them in the order added
         typedef std::list<HtnRule> RulesType;
-        typedef std::set<HtnTerm::HtnTermID> RuleHeadsType;
-        typedef std::set<std::string> RulesIndexType;
+        typedef std::unordered_set<HtnTerm::HtnTermID> RuleHeadsType;
+        // Fact heads and the ordinal of the fact. Facts that aren't ground can be added more than once so a head can have many ordinals
+        typedef std::unordered_multimap<HtnTerm::HtnTermID, uint32_t> FactHeadsType;
+        // The name of the predicate keeps its atom ID stable
+        typedef std::unordered_map<PredicateKeyType, std::shared_ptr<HtnTerm>> TabledPredicatesType;
+        // Index of one argument position in a RuleBucket. Values are positions in RuleBucket::rules, in order
+        class ArgumentIndex
+        {
+        public:
+            // Rules that have a constant in this position, by the atom ID of the constant
+            std::unordered_map<int, std::vector<uint32_t>> constants;
+            // Rules that have a variable in this position can unify with any constant
+            std::vector<uint32_t> variables;
+        };
+        
+        // The rules for one name and arity. Goals like at(bus3, ?Where) would still have to visit every at/2 rule, so once there are
+        // enough rules an ArgumentIndex is built for a position the first time a goal has a constant in it (like SWI Prolog JIT indexing).
+        // Indexes are immutable once built and published atomically so locked rules can be used from many threads
+        class RuleBucket
+        {
+        public:
+            static const int IndexThreshold = 16;
+            // Rules are only added before the rules are locked and shared with other threads, so the check doesn't need to be atomic.
+            // Indexes are not built while a document is loading, so this is nearly free and they get built once at the end
+            void ClearIndexes() { if(m_indexes != nullptr) { std::atomic_store(&m_indexes, std::shared_ptr<IndexesType>()); } }
+            // Returns nullptr if the goal has no constant arguments or the bucket is too small to index, otherwise returns the index
+            // that matches the fewest rules and the rules it matches
+            std::shared_ptr<ArgumentIndex> FindBestIndex(const HtnTerm *goal, const std::vector<uint32_t> **constantMatches, const std::vector<uint32_t> **variableMatches) const;
+            // Points into m_rules, in the order the rules were added
+            std::vector<const HtnRule *> rules;
+            // Position of each rule in m_rules
+            std::vector<uint32_t> ordinals;
+
+        private:
+            typedef std::vector<std::shared_ptr<ArgumentIndex>> IndexesType;
+            std::shared_ptr<ArgumentIndex> GetArgumentIndex(int position) const;
+            mutable std::shared_ptr<IndexesType> m_indexes;
+        };
+        typedef std::unordered_map<PredicateKeyType, RuleBucket> RuleBucketsType;
 
         HtnSharedRules() : m_dynamicSize(sizeof(HtnSharedRules)), m_isLocked(false) {}
+        HtnSharedRules(const HtnSharedRules &other);
         const RulesType &allRules() { return m_rules; }
         void AddRule(std::shared_ptr<HtnTerm> head, std::vector<std::shared_ptr<HtnTerm>> m_tail);
+        void AppendRule(HtnRule rule);
         void ClearAll();
         int64_t dynamicSize() { return m_dynamicSize; }
-        bool HasFact(std::shared_ptr<HtnTerm> term) const;
-        void Lock() { m_isLocked = true; }
+        void Reserve(size_t ruleCount);
+        // Returns the ordinals of every fact that has term as its head
+        std::pair<FactHeadsType::const_iterator, FactHeadsType::const_iterator> FindFacts(const HtnTerm *term) const { return m_factHeads.equal_range(term->GetUniqueID()); }
+        // A fact is a rule that is true (i.e. has no tail). Terms are interned so the ID of the term identifies it
+        bool HasFact(const HtnTerm *term) const { return m_factHeads.find(term->GetUniqueID()) != m_factHeads.end(); }
+        // Only written the first time so copies can be made from many threads once it is locked
+        void Lock() { if(!m_isLocked) { m_isLocked = true; } }
 
     private:
         friend class HtnRuleSet;
         int64_t m_dynamicSize;
         bool m_isLocked;
+        // For checking if facts exist quickly
+        FactHeadsType m_factHeads;
         // Needed for fast checking if ground rules are unique
         RuleHeadsType m_ruleHeads;
-        // For checking if rules exist quickly
-        RulesIndexType m_ruleIndex;
+        RuleBucketsType m_ruleBuckets;
         RulesType m_rules;
+        TabledPredicatesType m_tabledPredicates;
     };
 
+    static const size_t CompactMinimumDiff = 1024;
+
+    // Starts over with no answers if there are tabled predicates
+    void ResetAnswerTable() { m_answerTable = m_sharedRules->m_tabledPredicates.size() > 0 ? std::make_shared<HtnAnswerTable>() : nullptr; }
+
     // Must use Copy() so we can do lock the the state
     HtnRuleSet(const HtnRuleSet &other) = default;
     
@@ -165,8 +212,9 @@ private:
     // 3. It was a fact that existed that is now deleted
     // We track this with the first bool in the pair<>: true means added, false means deleted
     // Because there can only ever be one fact with the same exact values, we don't need multimap here
-    // This is a map because:
-    // - we want to guarantee that the pointers to these don't move around as items are added since the HtnRule pointer is handed out
+    // This is a persistent map because:
+    // - CreateCopy() is called for every branch the planner takes, copies share all of their nodes so they are O(1)
+    // - the HtnRule pointers that are handed out don't move around as items are added since the HtnRule is held by shared_ptr
     class FactDiffItem
     {
     public:
@@ -178,13 +226,57 @@ private:
         int diffOrder;
         std::shared_ptr<HtnRule> rule;
     };
-    typedef std::map<HtnTerm::HtnTermID, FactDiffItem> FactsDiffType;
+    typedef HtnPersistentMap<HtnTerm::HtnTermID, FactDiffItem> FactsDiffType;
     FactsDiffType m_factsDiff;
     // This is solely here to maintain the order of the facts that get added. The latest adds should get returned last
     int m_factsOrder;
-    typedef std::map<int, std::shared_ptr<HtnRule>> FactsAdditionsType;
+    // Additions are sorted by name and arity first so the ones for a predicate are together, just like the shared rules,
+    // and then by the order they were added
+    typedef std::pair<PredicateKeyType, int> FactAdditionKeyType;
+    typedef HtnPersistentMap<FactAdditionKeyType, std::shared_ptr<HtnRule>> FactsAdditionsType;
     FactsAdditionsType m_factAdditions;
+    // Ordinals of the facts in the shared rules that are in m_factsDiff so they can be skipped with a bit test instead of a lookup
+    HtnPersistentBitSet m_deletedSharedFacts;
     std::shared_ptr<HtnSharedRules> m_sharedRules;
+    // Copies share it until one of them changes
+    std::shared_ptr<HtnAnswerTable> m_answerTable;
+
+public:
+    // Returns the rules AllRulesThatCouldUnify() would, one at a time, so a caller that stops early doesn't pay for the rest.
+    // It keeps the rules it will return as they were when it was created so changes to the RuleSet don't affect it, just like a
+    // rule that Prolog is in the middle of resolving. targetTerm must stay alive while it is being used
+    class RuleCursor
+    {
+    public:
+        RuleCursor(const HtnRuleSet &ruleSet, const HtnTerm *targetTerm);
+        // Returns nullptr when there aren't any more. The rule is valid until the next call
+        const HtnRule *Next();
+        // Returns what the next call to Next() will
+        const HtnRule *Peek();
+
+    private:
+        const HtnRule *Advance();
+
+        const HtnTerm *m_targetTerm;
+        PredicateKeyType m_key;
+        // The bucket in the shared rules, nullptr once they have all been returned
+        std::shared_ptr<HtnSharedRules> m_sharedRules;
+        const HtnSharedRules::RuleBucket *m_bucket;
+        size_t m_bucketSize;
+        // Without an index m_position is the next position in the bucket, otherwise the two lists of the index are merged
+        std::shared_ptr<HtnSharedRules::ArgumentIndex> m_index;
+        const std::vector<uint32_t> *m_constantMatches;
+        const std::vector<uint32_t> *m_variableMatches;
+        size_t m_constantPosition;
+        size_t m_variablePosition;
+        size_t m_position;
+        HtnPersistentBitSet m_deletedSharedFacts;
+        // Cleared once they have all been returned
+        FactsAdditionsType m_factAdditions;
+        int m_nextAdditionOrder;
+        bool m_hasPeeked;
+        const HtnRule *m_peeked;
+    };
 };
 
 #endif /* HtnRuleSet_hpp */
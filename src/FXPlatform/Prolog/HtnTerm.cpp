@@ -10,17 +10,41 @@
 #include "HtnTerm.h"
 #include "HtnArithmeticOperators.h"
 #include "HtnTermFactory.h"
+#include <cstdlib>
 #include <stack>
 using namespace std;
 
 HtnTerm::HtnTerm(const HtnTerm &other, weak_ptr<HtnTermFactory> factory)
 {
     shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
-    m_namePtr = factoryStrong->GetInternedString(*other.m_namePtr);
+    m_namePtr = factoryStrong->GetInternedString(*other.m_namePtr, &m_atomID);
     m_isVariable = other.m_isVariable;
     m_arguments = other.m_arguments;
     m_factory = factory;
     m_isInterned = false;
+    m_arenaIndex = -1;
+    m_hash = other.m_hash;
+    m_isGround = other.m_isGround;
+    m_listLength = other.m_listLength;
+    m_termType = other.m_termType;
+    m_intValue = other.m_intValue;
+    factoryStrong->RecordAllocation(this);
+}
+
+// Create variable renamed into frame. It shares the name of variable so no strings are created or looked up
+HtnTerm::HtnTerm(const HtnTerm &variable, int64_t frame, weak_ptr<HtnTermFactory> factory) :
+    m_namePtr(variable.m_namePtr),
+    m_atomID(variable.m_atomID),
+    m_isInterned(false),
+    m_isVariable(true),
+    m_arenaIndex(-1),
+    m_factory(factory)
+{
+    shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
+    factoryStrong->AddAtomReference(m_atomID);
+    SetTermType();
+    m_variableFrame = frame;
+    SetStructureInfo();
     factoryStrong->RecordAllocation(this);
 }
 
@@ -28,10 +52,13 @@ HtnTerm::HtnTerm(const HtnTerm &other, weak_ptr<HtnTermFactory> factory)
 HtnTerm::HtnTerm(const string &constantName, weak_ptr<HtnTermFactory> factory) :
     m_isInterned(false),
     m_isVariable(false),
+    m_arenaIndex(-1),
     m_factory(factory)
 {
     shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
-    m_namePtr = factoryStrong->GetInternedString(constantName);
+    m_namePtr = factoryStrong->GetInternedString(constantName, &m_atomID);
+    SetTermType();
+    SetStructureInfo();
     factoryStrong->RecordAllocation(this);
 }
 
@@ -39,11 +66,14 @@ HtnTerm::HtnTerm(const string &constantName, weak_ptr<HtnTermFactory> factory) :
 HtnTerm::HtnTerm(const string &constantName, bool isVariable, weak_ptr<HtnTermFactory> factory) :
     m_isInterned(false),
     m_isVariable(isVariable),
+    m_arenaIndex(-1),
     m_factory(factory)
 {
     shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
     string adjustedName = isVariable ? "?" + constantName : constantName;
-    m_namePtr = factoryStrong->GetInternedString(adjustedName);
+    m_namePtr = factoryStrong->GetInternedString(adjustedName, &m_atomID);
+    SetTermType();
+    SetStructureInfo();
     factoryStrong->RecordAllocation(this);
 }
 
@@ -52,23 +82,74 @@ HtnTerm::HtnTerm(const string &functorName, vector<shared_ptr<HtnTerm>> argument
     m_arguments(arguments),
     m_isInterned(false),
     m_isVariable(false),
+    m_arenaIndex(-1),
     m_factory(factory)
 {
     shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
-    m_namePtr = factoryStrong->GetInternedString(functorName);
+    m_namePtr = factoryStrong->GetInternedString(functorName, &m_atomID);
+    SetTermType();
+    SetStructureInfo();
+    factoryStrong->RecordAllocation(this);
+}
+
+// Create an integer, constantName must be the textual form of value
+HtnTerm::HtnTerm(const string &constantName, int64_t value, weak_ptr<HtnTermFactory> factory) :
+    m_isInterned(false),
+    m_isVariable(false),
+    m_arenaIndex(-1),
+    m_factory(factory),
+    m_termType(HtnTermType::IntType),
+    m_intValue(value)
+{
+    shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
+    m_namePtr = factoryStrong->GetInternedString(constantName, &m_atomID);
+    SetStructureInfo();
+    factoryStrong->RecordAllocation(this);
+}
+
+// Create a float, constantName must be the textual form of value
+HtnTerm::HtnTerm(const string &constantName, double value, weak_ptr<HtnTermFactory> factory) :
+    m_isInterned(false),
+    m_isVariable(false),
+    m_arenaIndex(-1),
+    m_factory(factory),
+    m_termType(HtnTermType::FloatType),
+    m_doubleValue(value)
+{
+    shared_ptr<HtnTermFactory> factoryStrong = factory.lock();
+    m_namePtr = factoryStrong->GetInternedString(constantName, &m_atomID);
+    SetStructureInfo();
     factoryStrong->RecordAllocation(this);
 }
 
 HtnTerm::~HtnTerm()
 {
-    if(shared_ptr<HtnTermFactory> strongFactory = m_factory.lock())
+    shared_ptr<HtnTermFactory> strongFactory = m_factory.lock();
+    
+    // Releasing the tail of a long list would otherwise recurse once per item and can run out of stack, so
+    // unlink the part of the list only this term holds and release it one item at a time
+    if(strongFactory != nullptr && m_arguments.size() == 2 && isAtom(HtnAtom::ListFunctor))
+    {
+        shared_ptr<HtnTerm> tail = std::move(m_arguments[1]);
+        shared_ptr<HtnTerm> next;
+        while(tail != nullptr && tail->m_arguments.size() == 2 && tail->isAtom(HtnAtom::ListFunctor) && strongFactory->TakeListTail(tail, next))
+        {
+            tail = std::move(next);
+        }
+    }
+    
+    if(strongFactory != nullptr)
     {
-        if(m_isInterned)
+        if(m_arenaIndex != -1)
+        {
+            strongFactory->ReleaseArenaTerm(this);
+        }
+        else if(m_isInterned)
         {
             strongFactory->ReleaseInternedTerm(this);
         }
         
-        strongFactory->ReleaseInternedString(m_namePtr);
+        strongFactory->ReleaseAtom(m_atomID);
         strongFactory->RecordDeallocation(this);
     }
 }
@@ -109,84 +190,54 @@ shared_ptr<HtnTerm> HtnTerm::Eval(HtnTermFactory *factory)
     {
         if(m_arguments.size() == 2)
         {
-            if(*m_namePtr == "=")
-            {
-                return HtnArithmeticOperators::Equal(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == ">")
-            {
-                return HtnArithmeticOperators::GreaterThan(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "=>")
-            {
-                // Avoid common error that is really confusing.  Prolog uses >=
-                FailFastAssertDesc(false, "=> is incorrect in Prolog.  Use >=");
-                return nullptr;
-            }
-            else if(*m_namePtr == ">=")
+            switch((HtnAtom) m_atomID)
             {
-                return HtnArithmeticOperators::GreaterThanOrEqual(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "<")
-            {
-                return HtnArithmeticOperators::LessThan(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "<=")
-            {
-                // Avoid common error that is really confusing.  Prolog uses =<
-                FailFastAssertDesc(false, "<= is incorrect in Prolog. Use =<");
-                return nullptr;
-            }
-            else if(*m_namePtr == "=<")
-            {
-                return HtnArithmeticOperators::LessThanOrEqual(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "-")
-            {
-                return HtnArithmeticOperators::Minus(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "+")
-            {
-                return HtnArithmeticOperators::Plus(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "*")
-            {
-                return HtnArithmeticOperators::Multiply(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "/")
-            {
-                return HtnArithmeticOperators::Divide(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "min")
-            {
-                return HtnArithmeticOperators::Min(factory, m_arguments[0], m_arguments[1]);
-            }
-            else if(*m_namePtr == "max")
-            {
-                return HtnArithmeticOperators::Max(factory, m_arguments[0], m_arguments[1]);
-            }
-            else
-            {
-                return nullptr;
+                case HtnAtom::Equal:
+                    return HtnArithmeticOperators::Equal(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::GreaterThan:
+                    return HtnArithmeticOperators::GreaterThan(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::IncorrectGreaterThanOrEqual:
+                    // Avoid common error that is really confusing.  Prolog uses >=
+                    FailFastAssertDesc(false, "=> is incorrect in Prolog.  Use >=");
+                    return nullptr;
+                case HtnAtom::GreaterThanOrEqual:
+                    return HtnArithmeticOperators::GreaterThanOrEqual(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::LessThan:
+                    return HtnArithmeticOperators::LessThan(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::IncorrectLessThanOrEqual:
+                    // Avoid common error that is really confusing.  Prolog uses =<
+                    FailFastAssertDesc(false, "<= is incorrect in Prolog. Use =<");
+                    return nullptr;
+                case HtnAtom::LessThanOrEqual:
+                    return HtnArithmeticOperators::LessThanOrEqual(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Minus:
+                    return HtnArithmeticOperators::Minus(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Plus:
+                    return HtnArithmeticOperators::Plus(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Multiply:
+                    return HtnArithmeticOperators::Multiply(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Divide:
+                    return HtnArithmeticOperators::Divide(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Min:
+                    return HtnArithmeticOperators::Min(factory, m_arguments[0], m_arguments[1]);
+                case HtnAtom::Max:
+                    return HtnArithmeticOperators::Max(factory, m_arguments[0], m_arguments[1]);
+                default:
+                    return nullptr;
             }
         }
         else if(m_arguments.size() == 1)
         {
-            if(*m_namePtr == "abs")
-            {
-                return HtnArithmeticOperators::Abs(factory, m_arguments[0]);
-            }
-            else if(*m_namePtr == "float")
+            switch((HtnAtom) m_atomID)
             {
-                return HtnArithmeticOperators::Float(factory, m_arguments[0]);
-            }
-            else if(*m_namePtr == "integer")
-            {
-                return HtnArithmeticOperators::Integer(factory, m_arguments[0]);
-            }
-            else
-            {
-                return nullptr;
+                case HtnAtom::Abs:
+                    return HtnArithmeticOperators::Abs(factory, m_arguments[0]);
+                case HtnAtom::Float:
+                    return HtnArithmeticOperators::Float(factory, m_arguments[0]);
+                case HtnAtom::Integer:
+                    return HtnArithmeticOperators::Integer(factory, m_arguments[0]);
+                default:
+                    return nullptr;
             }
         }
         else
@@ -196,34 +247,13 @@ shared_ptr<HtnTerm> HtnTerm::Eval(HtnTermFactory *factory)
     }
 }
 
-// A term is ground if it has no variables
-bool HtnTerm::isGround() const
-{
-    if(m_isVariable)
-    {
-        return false;
-    }
-    else
-    {
-        for(shared_ptr<HtnTerm> arg : m_arguments)
-        {
-            if(!arg->isGround())
-            {
-                return false;
-            }
-        }
-        
-        return true;
-    }
-}
-
 bool HtnTerm::isArithmetic() const
 {
-    if(*m_namePtr == "=" || *m_namePtr == ">" || *m_namePtr == ">=" || *m_namePtr == "<" || *m_namePtr == "=<" || *m_namePtr == "-" || *m_namePtr == "+" || *m_namePtr == "*" || *m_namePtr == "/" | *m_namePtr == "abs" || *m_namePtr == "min" || *m_namePtr == "max" ||  *m_namePtr == "float" || *m_namePtr == "integer")
+    if(m_atomID >= (int) HtnAtom::Equal && m_atomID <= (int) HtnAtom::Integer)
     {
         return true;
     }
-    else if(*m_namePtr == "=>" || *m_namePtr == "<=")
+    else if(m_atomID == (int) HtnAtom::IncorrectGreaterThanOrEqual || m_atomID == (int) HtnAtom::IncorrectLessThanOrEqual)
     {
         // Avoid really common issues
         FailFastAssertDesc(false, "Incorrect symbol. Prolog uses >= and =<.");
@@ -268,173 +298,135 @@ void HtnTerm::GetAllVariables(set<shared_ptr<HtnTerm>, HtnTermComparer> *result)
 
 double_t HtnTerm::GetDouble() const
 {
-    return lexical_cast<double_t>(*m_namePtr);
+    if(m_termType == HtnTermType::FloatType)
+    {
+        return m_doubleValue;
+    }
+    else if(m_termType == HtnTermType::IntType)
+    {
+        return (double_t) m_intValue;
+    }
+    else
+    {
+        // Not a number, this will throw
+        return lexical_cast<double_t>(*m_namePtr);
+    }
 }
 
 int64_t HtnTerm::GetInt() const
 {
-    return (int64_t) GetDouble();
+    if(m_termType == HtnTermType::IntType)
+    {
+        return m_intValue;
+    }
+    else
+    {
+        return (int64_t) GetDouble();
+    }
 }
 
-HtnTermType HtnTerm::GetTermType() const
+// Uses the values already cached in the arguments so this is O(arity) and never walks the whole tree
+// A term is ground if it has no variables
+void HtnTerm::SetStructureInfo()
 {
+    m_isGround = !m_isVariable;
+    m_hash = std::hash<const string *>()(m_namePtr);
     if(m_isVariable)
     {
-        return HtnTermType::Variable;
+        m_hash ^= std::hash<int64_t>()(m_variableFrame) + 0x9e3779b9 + (m_hash<<6) + (m_hash>>2);
+    }
+    
+    for(const shared_ptr<HtnTerm> &argument : m_arguments)
+    {
+        m_isGround = m_isGround && argument->m_isGround;
+        
+        // Stolen from boost::hash_combine
+        m_hash ^= argument->m_hash + 0x9e3779b9 + (m_hash<<6) + (m_hash>>2);
+    }
+    
+    // The tail of a list is always created first so the length is just one more than it
+    if(m_isVariable)
+    {
+        m_listLength = -1;
+    }
+    else if(m_arguments.size() == 0)
+    {
+        m_listLength = isAtom(HtnAtom::EmptyList) ? 0 : -1;
+    }
+    else
+    {
+        m_listLength = (m_arguments.size() == 2 && isAtom(HtnAtom::ListFunctor) && m_arguments[1]->m_listLength != -1) ? m_arguments[1]->m_listLength + 1 : -1;
+    }
+}
+
+// Numbers are parsed exactly once, here, so that arithmetic and comparisons can use the value directly
+void HtnTerm::SetTermType()
+{
+    m_intValue = 0;
+    if(m_isVariable)
+    {
+        m_termType = HtnTermType::Variable;
     }
     else if(arity() > 0)
     {
-        return HtnTermType::Compound;
+        m_termType = HtnTermType::Compound;
     }
     else
     {
+        // Only names that start like a number can convert, don't pay for the stringstream on the rest
+        size_t start = m_namePtr->find_first_not_of(" \t\n\v\f\r");
+        char first = start == string::npos ? 0 : (*m_namePtr)[start];
+        if(!((first >= '0' && first <= '9') || first == '-' || first == '+' || first == '.'))
+        {
+            m_termType = HtnTermType::Atom;
+            return;
+        }
+        
         // Convert to float, if it works, and if there was a "." in the string, then it was a float.  Otherwise an Int. If it didn't convert, it was neither
         bool success;
-        lexical_cast_result<double>(*m_namePtr, success);
+        double value = lexical_cast_result<double>(*m_namePtr, success);
         if(success)
         {
             if(m_namePtr->find_first_of(".") == string::npos)
             {
                 // no period, couldn't have been a float
-                return HtnTermType::IntType;
+                // Read it as an integer too so large values don't lose precision going through double
+                m_termType = HtnTermType::IntType;
+                char *end;
+                long long intValue = strtoll(m_namePtr->c_str(), &end, 10);
+                m_intValue = (*end == 0) ? (int64_t) intValue : (int64_t) value;
             }
             else
             {
-                return HtnTermType::FloatType;
+                m_termType = HtnTermType::FloatType;
+                m_doubleValue = value;
             }
         }
         else
         {
             // Must be an Atom
-            return HtnTermType::Atom;
+            m_termType = HtnTermType::Atom;
         }
     }
 }
 
-// Start of a term is a 0, end of a term is a 1
-// Build them up into fake pointers so we can stick them in the array of string *s that
-// represents the ID
-class StructureBuilder
+bool HtnTerm::GetListElements(vector<shared_ptr<HtnTerm>> &elements) const
 {
-public:
-    StructureBuilder()
-    {
-        m_index = 0;
-        m_data.push_back(0);
-        m_currentData = &m_data.back();
-    }
-    
-    inline void StartTerm()
-    {
-        if(m_index + 1 == sizeof(intptr_t))
-        {
-            m_index = 0;
-            m_data.push_back(0);
-            m_currentData = &m_data.back();
-        }
-        
-        m_index++;
-    }
-    
-    inline void EndTerm()
+    if(m_listLength == -1)
     {
-        if(m_index + 1 == sizeof(intptr_t))
-        {
-            m_index = 0;
-            m_data.push_back(0);
-            m_currentData = &m_data.back();
-        }
-        
-        (*m_currentData) |= ((intptr_t) 0x1 <<  m_index);
-        m_index++;
-    }
-    
-    inline vector<intptr_t> &GetData()
-    {
-        return m_data;
+        return false;
     }
     
-    int m_index;
-    intptr_t *m_currentData;
-    vector<intptr_t> m_data;
-};
-
-// Allows us to compare terms for equality simply by comparing bytes
-// Because the strings of a Term are all interned, we can use their pointers as unique IDs for
-// each string.  Then, if we pack them all together with a representation of the tree that they
-// are a part of, it will be unique. How to represent the shape of the tree?
-//  From: https://www.quora.com/How-can-I-encode-a-tree-into-a-string-format-such-that-the-tree-can-be-constructed-back-from-the-string-encoding-Also-encoding-should-be-efficient-both-time-and-space-wise
-//      Run a depth-first search on our tree, starting at the root. Each time you enter a new vertex, write down a 0, each time you finalize a vertex, write down a 1.
-//      Clearly, the output of this algorithm allows us to reconstruct the original tree. It is instructional to use ( and ) instead of 0 and 1. Our sample tree then
-//      gets encoded as follows: ((()(()))()(())). This encoding also highlights an important property of unlabeled rooted trees -- their relationship to correctly parenthesized expressions.
-// Structure is:
-// string *count - number of string *s. This is a fake string * that is really a count
-// string *[] - one string * for every term that points to its name, followed by a set of fake string *s that are from the StructureBuilder that represent the shape of the term
-void HtnTerm::GetUniqueID(const string **buffer, const string **bufferEnd) const
-{
-    StructureBuilder shape;
-    vector<pair<const HtnTerm *, int>> stack;
-    
-    // first pointer value is actually the length
-    const string **origBuffer = buffer;
-    buffer++;
-    if(buffer == bufferEnd) StaticFailFastAssertDesc(false, ("Too many terms, max = " + lexical_cast<string>(HtnTermFactory::MaxIndexTerms)).c_str());
-    
-    // Do the root
-    *buffer = m_namePtr;
-    buffer++;
-    if(buffer == bufferEnd) StaticFailFastAssertDesc(false, ("Too many terms, max = " + lexical_cast<string>(HtnTermFactory::MaxIndexTerms)).c_str());
-    
-    if(m_arguments.size() > 0)
+    elements.clear();
+    elements.reserve(m_listLength);
+    const HtnTerm *current = this;
+    while(current->m_listLength > 0)
     {
-        // Push the first node to process its arguments
-        stack.push_back(pair<const HtnTerm *, int>(this, 0));
-        shape.StartTerm();
-        
-        while(stack.size() > 0)
-        {
-            const HtnTerm *current = stack.back().first;
-            int &index = stack.back().second;
-            
-            // Do next child
-            if(index < current->m_arguments.size())
-            {
-                HtnTerm *next = current->m_arguments[index].get();
-                index++;
-                
-                // Add this child's name
-                *buffer = next->m_namePtr;
-                buffer++;
-                if(buffer == bufferEnd) StaticFailFastAssertDesc(false, ("Too many terms, max = " + lexical_cast<string>(HtnTermFactory::MaxIndexTerms)).c_str());
-                
-                if(next->m_arguments.size() > 0)
-                {
-                    // Push to process its arguments
-                    stack.push_back(pair<HtnTerm *, int>(next, 0));
-                    shape.StartTerm();
-                }
-            }
-            else
-            {
-                // Arguments done
-                stack.pop_back();
-                shape.EndTerm();
-            }
-        }
-    }
-       
-    // Now write out the shape as a series of fake string *s
-    vector<intptr_t> &shapeData = shape.GetData();
-    for(auto data : shapeData)
-    {
-        *buffer = reinterpret_cast<string *>(data);
-        buffer++;
-        if(buffer == bufferEnd) StaticFailFastAssertDesc(false, ("Too many terms, max = " + lexical_cast<string>(HtnTermFactory::MaxIndexTerms)).c_str());
+        elements.push_back(current->m_arguments[0]);
+        current = current->m_arguments[1].get();
     }
     
-    // Put the size as the first "pointer"
-    *origBuffer = (string *) (buffer - origBuffer);
-    return;
+    return true;
 }
 
 // Because HtnTerms are interned, their pointer is a unique ID
@@ -471,7 +463,8 @@ shared_ptr<HtnTerm> HtnTerm::MakeVariablesUnique(HtnTermFactory *factory, bool o
         }
         else
         {
-            shared_ptr<HtnTerm> newVariable = factory->CreateVariable(uniquifier + variableName);
+            // Keep the frame so RemovePrefixFromVariables() gives back the same variable
+            shared_ptr<HtnTerm> newVariable = factory->CreateVariable(uniquifier + m_namePtr->substr(1), m_variableFrame);
             variableMap[variableName] = newVariable;
             return newVariable;
         }
@@ -494,6 +487,22 @@ shared_ptr<HtnTerm> HtnTerm::MakeVariablesUnique(HtnTermFactory *factory, bool o
     }
 }
 
+string HtnTerm::name() const
+{
+    if(!m_isVariable)
+    {
+        return *m_namePtr;
+    }
+    else if(m_variableFrame == 0)
+    {
+        return m_namePtr->substr(1, m_namePtr->size() - 1);
+    }
+    else
+    {
+        return m_namePtr->substr(1, m_namePtr->size() - 1) + "_" + to_string(m_variableFrame);
+    }
+}
+
 bool HtnTerm::OccursCheck(shared_ptr<HtnTerm> variable) const
 {
     // Make sure we are not intermixing terms from different factories
@@ -527,7 +536,7 @@ bool HtnTerm::operator==(const HtnTerm &other) const
     {
         if(m_isVariable)
         {
-            return true;
+            return m_variableFrame == other.m_variableFrame;
         }
         
         if(m_arguments.size() != other.m_arguments.size())
@@ -558,11 +567,9 @@ shared_ptr<HtnTerm> HtnTerm::RemovePrefixFromVariables(HtnTermFactory *factory,
     FXDebugAssert(factory != nullptr && this->m_factory.lock().get() == factory);
     if(this->isVariable())
     {
-        const string &variableName = this->name();
-        int pos = (int) variableName.find(prefix);
-        if(pos == 0)
+        if(m_namePtr->compare(1, prefix.size(), prefix) == 0)
         {
-             return factory->CreateVariable(variableName.substr(prefix.size()));
+             return factory->CreateVariable(m_namePtr->substr(1 + prefix.size()), m_variableFrame);
         }
         else
         {
@@ -587,7 +594,7 @@ shared_ptr<HtnTerm> HtnTerm::RemovePrefixFromVariables(HtnTermFactory *factory,
     }
 }
 
-shared_ptr<HtnTerm> HtnTerm::RenameVariables(HtnTermFactory *factory, std::map<std::string, std::shared_ptr<HtnTerm>> variableMap)
+shared_ptr<HtnTerm> HtnTerm::RenameVariables(HtnTermFactory *factory, const std::map<std::string, std::shared_ptr<HtnTerm>> &variableMap)
 {
     // Make sure we are not intermixing terms from different factories
     // Too expensive to have in retail
@@ -623,6 +630,49 @@ shared_ptr<HtnTerm> HtnTerm::RenameVariables(HtnTermFactory *factory, std::map<s
     }
 }
 
+// Replaces variables[i] with newVariables[i]. Variables are interned so they are found by pointer and ground terms are never walked.
+// If dontCareVariables is passed, each occurrence of a don't care variable ("_" ones) that isn't in variables is replaced by the next one,
+// since don't care variables never match each other
+shared_ptr<HtnTerm> HtnTerm::RenameVariables(HtnTermFactory *factory, const vector<HtnTerm *> &variables, const vector<shared_ptr<HtnTerm>> &newVariables,
+                                             const vector<shared_ptr<HtnTerm>> *dontCareVariables, int *dontCareIndex)
+{
+    // Make sure we are not intermixing terms from different factories
+    // Too expensive to have in retail
+    FXDebugAssert(factory != nullptr && this->m_factory.lock().get() == factory);
+    if(m_isGround)
+    {
+        return shared_from_this();
+    }
+    else if(m_isVariable)
+    {
+        for(size_t index = 0; index < variables.size(); ++index)
+        {
+            if(variables[index] == this)
+            {
+                return newVariables[index];
+            }
+        }
+        
+        if(dontCareVariables != nullptr && (*m_namePtr)[1] == '_')
+        {
+            return (*dontCareVariables)[(*dontCareIndex)++];
+        }
+        
+        return shared_from_this();
+    }
+    else
+    {
+        vector<shared_ptr<HtnTerm>> newArguments;
+        newArguments.reserve(m_arguments.size());
+        for(const shared_ptr<HtnTerm> &term : m_arguments)
+        {
+            newArguments.push_back(term->RenameVariables(factory, variables, newVariables, dontCareVariables, dontCareIndex));
+        }
+        
+        return factory->CreateFunctor(*m_namePtr, newArguments);
+    }
+}
+
 shared_ptr<HtnTerm> HtnTerm::ResolveArithmeticTerms(HtnTermFactory *factory)
 {
     // Make sure we are not intermixing terms from different factories
@@ -758,148 +808,158 @@ shared_ptr<HtnTerm> HtnTerm::SubstituteTermForVariable(HtnTermFactory *factory,
 // atoms, in alphabetical (i.e. character code) order.
 // compound terms, ordered first by arity, then by the name of the principal functor and by the arguments in left-to-right order.
 // returns 0 if ==, -1 if less than, 1 if >
-int HtnTerm::TermCompare(const HtnTerm &other)
+int HtnTerm::TermCompare(const HtnTerm &other) const
 {
     // Make sure we are not intermixing terms from different factories
     FXDebugAssert(this->m_factory.lock() == other.m_factory.lock());
 
-    HtnTermType thisType = GetTermType();
-    HtnTermType otherType = other.GetTermType();
+    // Interned terms that are identical are the same object
+    if(this == &other)
+    {
+        return 0;
+    }
     
-    if(thisType == otherType)
+    int compare = TermCompareNode(other);
+    if(compare != 0 || arity() == 0)
     {
-        if(arity() < other.arity())
-        {
-            return -1;
-        }
-        else if(arity() == other.arity())
+        return compare;
+    }
+    
+    // The nodes are equal, so compare the arguments depth first, left to right. Pairs are pushed in
+    // reverse so they are popped in order, and identical subterms are never pushed
+    vector<pair<const HtnTerm *, const HtnTerm *>> stack;
+    const HtnTerm *left = this;
+    const HtnTerm *right = &other;
+    while(true)
+    {
+        for(int index = left->arity() - 1; index >= 0; --index)
         {
-            if(arity() == 0)
+            const HtnTerm *leftArgument = left->m_arguments[index].get();
+            const HtnTerm *rightArgument = right->m_arguments[index].get();
+            if(leftArgument != rightArgument)
             {
-                if(thisType == HtnTermType::Variable)
-                {
-                    // Should be based on AGE, but...why? Plus thats a lot of work
-                    int compare = name().compare(other.name());
-                    return compare;
-                }
-                else if(thisType == HtnTermType::FloatType)
-                {
-                    double value = GetDouble();
-                    double otherValue = other.GetDouble();
-                    if(value < otherValue) { return -1; }
-                    else if(value == otherValue) { return 0; }
-                    else { return 1; }
-                }
-                else if(thisType == HtnTermType::IntType)
-                {
-                    int64_t value = GetInt();
-                    int64_t otherValue = other.GetInt();
-                    if(value < otherValue) { return -1; }
-                    else if(value == otherValue) { return 0; }
-                    else { return 1; }
-                }
-                else if(thisType == HtnTermType::Atom)
-                {
-                    return name().compare(other.name());
-                }
-                else
-                {
-                    // Unknown type
-                    FailFastAssert(false);
-                    return -1;
-                }
-            }
-            else
-            {
-                int compare = name().compare(other.name());
-                if(compare == 0)
-                {
-                    // Compare the arguments
-                    for(int index = 0; index < arguments().size(); ++index)
-                    {
-                        int compare = arguments()[index]->TermCompare(*other.arguments()[index]);
-                        if(compare != 0)
-                        {
-                            return compare;
-                        }
-                    }
-                    
-                    // Everything was == thus we are ==
-                    return 0;
-                }
-                else
-                {
-                    return compare;
-                }
+                stack.push_back(pair<const HtnTerm *, const HtnTerm *>(leftArgument, rightArgument));
             }
         }
-        else
+        
+        if(stack.size() == 0)
         {
-            return 1;
+            // Everything was == thus we are ==
+            return 0;
+        }
+        
+        left = stack.back().first;
+        right = stack.back().second;
+        stack.pop_back();
+        compare = left->TermCompareNode(*right);
+        if(compare != 0)
+        {
+            return compare;
         }
     }
-    else
+}
+
+int HtnTerm::TermCompareNode(const HtnTerm &other) const
+{
+    HtnTermType thisType = m_termType;
+    HtnTermType otherType = other.m_termType;
+    if(thisType != otherType)
     {
         return thisType < otherType ? -1 : 1;
     }
+    else if(arity() != other.arity())
+    {
+        return arity() < other.arity() ? -1 : 1;
+    }
+    else if(thisType == HtnTermType::FloatType && arity() == 0)
+    {
+        double value = m_doubleValue;
+        double otherValue = other.m_doubleValue;
+        if(value < otherValue) { return -1; }
+        else if(value == otherValue) { return 0; }
+        else { return 1; }
+    }
+    else if(thisType == HtnTermType::IntType && arity() == 0)
+    {
+        int64_t value = m_intValue;
+        int64_t otherValue = other.m_intValue;
+        if(value < otherValue) { return -1; }
+        else if(value == otherValue) { return 0; }
+        else { return 1; }
+    }
+    else
+    {
+        // Variables should be ordered by AGE, but...why? Plus thats a lot of work. Variables all start
+        // with "?" so comparing the whole name orders them the same as comparing name()
+        FailFastAssert(arity() > 0 || thisType == HtnTermType::Variable || thisType == HtnTermType::Atom);
+        if(m_namePtr == other.m_namePtr)
+        {
+            int64_t frame = variableFrame();
+            int64_t otherFrame = other.variableFrame();
+            return frame < otherFrame ? -1 : (frame > otherFrame ? 1 : 0);
+        }
+        else
+        {
+            int compare = m_namePtr->compare(*other.m_namePtr);
+            return compare < 0 ? -1 : (compare > 0 ? 1 : 0);
+        }
+    }
 }
 
-string HtnTerm::ToString(bool isSecondTermInList, bool json)
+// Everything is appended to output as it is walked so no temporary strings or streams are built per term
+void HtnTerm::AppendString(string &output, bool isSecondTermInList, bool json) const
 {
-    stringstream stream;
     if(isList() && arity() == 0)
     {
         // Empty list
-        return "[]";
+        output.append("[]");
     }
     else if(isConstant() || isVariable())
     {
         if (json)
         {
+            const string &test = *m_namePtr;
             if(isVariable())
             {
-                stream << "{\"" << m_namePtr->substr(1) << "\":[]}";
+                output.append("{\"").append(name()).append("\":[]}");
             }
-            else
+            // If it starts with a number and is a legitimate number, don't escape it
+            else if(test[0] >= '0' && test[0] <= '9')
             {
-                string test = *m_namePtr;
-                // If it starts with a number and is a legitimate number, don't escape it
-                if(test[0] >= '0' && test[0] <= '9')
+                HtnTermType type = GetTermType();
+                if(type == HtnTermType::IntType || type == HtnTermType::FloatType)
                 {
-                    HtnTermType type = GetTermType();
-                    if(type == HtnTermType::IntType || type == HtnTermType::FloatType)
-                    {
-                        stream << "{\"" << test << "\":[]}";
-                    }
-                    else
-                    {
-                        stream << "{\"'" << test << "'\":[]}";
-                    }
+                    output.append("{\"").append(test).append("\":[]}");
                 }
                 else
                 {
-                    // If it starts and ends with a " then it is considered a string and we preserve the quote
-                    if(test[0] == '\"' && test[(int) test.length() - 1] == '\"')
-                    {
-                        stream << "{\"\\\"" << test.substr(1, (int) test.length() - 2) << "\\\"\":[]}";
-                    }
-                    // If it starts with uppercase or _ it must be escaped or it gets confused with a variable
-                    // otherwise we escape anything but A-Z and a-z and _
-                    else if(!(test[0] >= 'a' && test[0] <= 'z') ||
-                       (test.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890_") != string::npos))
-                    {
-                        stream << "{\"'" << test << "'\":[]}";
-                    }
-                    else
-                    {
-                        stream << "{\"" << test << "\":[]}";
-                    }
+                    output.append("{\"'").append(test).append("'\":[]}");
                 }
             }
+            // If it starts and ends with a " then it is considered a string and we preserve the quote
+            else if(test[0] == '\"' && test[test.length() - 1] == '\"')
+            {
+                output.append("{\"\\\"").append(test, 1, test.length() - 2).append("\\\"\":[]}");
+            }
+            // If it starts with uppercase or _ it must be escaped or it gets confused with a variable
+            // otherwise we escape anything but A-Z and a-z and _
+            else if(!(test[0] >= 'a' && test[0] <= 'z') ||
+               (test.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890_") != string::npos))
+            {
+                output.append("{\"'").append(test).append("'\":[]}");
+            }
+            else
+            {
+                output.append("{\"").append(test).append("\":[]}");
+            }
         }
         else
         {
-            stream << *m_namePtr;
+            output.append(*m_namePtr);
+            if(isVariable() && m_variableFrame != 0)
+            {
+                output.append("_").append(to_string(m_variableFrame));
+            }
         }
     }
     else
@@ -908,68 +968,92 @@ string HtnTerm::ToString(bool isSecondTermInList, bool json)
         // .(a, .(b, [])) -> [a, b]
         //
         // If we are converting a list to json, we want every term in a json list
-        if(*m_namePtr == "." && m_arguments.size() == 2)
+        if(isAtom(HtnAtom::ListFunctor) && m_arguments.size() == 2)
         {
             if(!isSecondTermInList)
             {
                 // This is a top level list or the left side of a list
                 // Which means we are creating a list
-                stream << "[";
+                output.push_back('[');
             }
             
-            // Whatever is in the left side is the term for this position in
-            // the list (which could also be a list), just add it
-            stream << m_arguments[0]->ToString(false, json);
-            
-            // The right side either ends the list with [] or continues with
-            // another .()
-            if(m_arguments[1]->name() == "[]")
-            {
-                stream << "]";
-            }
-            else
+            // Walk down the list in a loop instead of recursing on the right side so long lists don't run out of stack
+            const HtnTerm *current = this;
+            while(true)
             {
-                // Continue adding terms
-                stream << "," << m_arguments[1]->ToString(true, json);
+                // Whatever is in the left side is the term for this position in
+                // the list (which could also be a list), just add it
+                current->m_arguments[0]->AppendString(output, false, json);
+                
+                // The right side either ends the list with [] or continues with
+                // another .()
+                const HtnTerm *tail = current->m_arguments[1].get();
+                if(tail->isAtom(HtnAtom::EmptyList))
+                {
+                    output.push_back(']');
+                    break;
+                }
+                else if(tail->isAtom(HtnAtom::ListFunctor) && tail->m_arguments.size() == 2)
+                {
+                    // Continue adding terms
+                    output.push_back(',');
+                    current = tail;
+                }
+                else
+                {
+                    output.push_back(',');
+                    tail->AppendString(output, true, json);
+                    break;
+                }
             }
         }
         else
         {
             if (json)
             {
-                stream << "{\"" << *m_namePtr << "\":[";
+                output.append("{\"").append(*m_namePtr).append("\":[");
             }
             else
             {
-                stream << *m_namePtr << "(";
+                output.append(*m_namePtr).push_back('(');
             }
-            
 
             bool hasArg = false;
-            for(auto arg : m_arguments)
+            for(const shared_ptr<HtnTerm> &arg : m_arguments)
             {
-                stream << (hasArg ? "," : "") << arg->ToString(false, json);
+                if(hasArg) { output.push_back(','); }
+                arg->AppendString(output, false, json);
                 hasArg = true;
             }
 
-            stream << (json ? "]}" : ")");
+            output.append(json ? "]}" : ")");
         }
     }
-
-    return stream.str();
 }
 
-string HtnTerm::ToString(const vector<shared_ptr<HtnTerm>> &goals, bool surroundWithParenthesis, bool json)
+void HtnTerm::AppendString(string &output, const vector<shared_ptr<HtnTerm>> &goals, bool surroundWithParenthesis, bool json)
 {
-    stringstream stream;
-    
-    if(surroundWithParenthesis) { stream << "("; }
+    if(surroundWithParenthesis) { output.push_back('('); }
     bool hasItem = false;
-    for(auto item : goals)
+    for(const shared_ptr<HtnTerm> &item : goals)
     {
-        stream << (hasItem ? ", " : "") << item->ToString(false, json);
+        if(hasItem) { output.append(", "); }
+        item->AppendString(output, false, json);
         hasItem = true;
     }
-    if(surroundWithParenthesis) { stream << ")"; }
-    return stream.str();
+    if(surroundWithParenthesis) { output.push_back(')'); }
+}
+
+string HtnTerm::ToString(bool isSecondTermInList, bool json)
+{
+    string result;
+    AppendString(result, isSecondTermInList, json);
+    return result;
+}
+
+string HtnTerm::ToString(const vector<shared_ptr<HtnTerm>> &goals, bool surroundWithParenthesis, bool json)
+{
+    string result;
+    AppendString(result, goals, surroundWithParenthesis, json);
+    return result;
 }
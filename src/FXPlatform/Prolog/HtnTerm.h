@@ -35,21 +35,67 @@ enum class HtnTermType
     Compound = 4
 };
 
+// Atoms that are checked in the inner loops of the resolver and planner. Every HtnTermFactory registers them
+// with these fixed IDs when it is created so they can be checked with an integer compare. See HtnTerm::atomID()
+enum class HtnAtom
+{
+    Cut = 0,
+    CutStart,
+    CutEnd,
+    True,
+    False,
+    EmptyList,
+    ListFunctor,
+    Try,
+    TryEnd,
+    CountAnyOf,
+    FailIfNoneOf,
+    // Arithmetic operators must stay together and in this order, see HtnTerm::isArithmetic()
+    Equal,
+    GreaterThan,
+    GreaterThanOrEqual,
+    LessThan,
+    LessThanOrEqual,
+    Minus,
+    Plus,
+    Multiply,
+    Divide,
+    Abs,
+    Min,
+    Max,
+    Float,
+    Integer,
+    // Common mistakes for >= and =<
+    IncorrectGreaterThanOrEqual,
+    IncorrectLessThanOrEqual,
+    // Number of system atoms, must be last
+    SystemAtomCount
+};
+
 // Terms are immutable, this is required because their signature (name, argument count, argument name, etc) are used
 // as the primary way to find them in the HtnRuleSet.  Making them immutable means we can keep them in a map.
 // A term is variable, or a compound term which has a name and 0 or more arguments (which are also terms)
 // A compound term with no arguments is called a constant
 // A term is ground if it contains no variables
-class HtnTerm : public std::enable_shared_from_this<HtnTerm>
+class HtnTerm
 {
 public:
     ~HtnTerm();
+    // Throws bad_weak_ptr if the last reference to the term is gone. HtnTermFactory sets m_self instead of using enable_shared_from_this
+    // so the intern table can safely check for that with weak_ptr::lock() in concurrent mode
+    std::shared_ptr<HtnTerm> shared_from_this() { return std::shared_ptr<HtnTerm>(m_self); }
+    // Same text as ToString() but appended to output so a caller can reuse one buffer for a whole result
+    void AppendString(std::string &output, bool isSecondTermInList = false, bool json = false) const;
+    static void AppendString(std::string &output, const std::vector<std::shared_ptr<HtnTerm>> &goals, bool surroundWithParenthesis = true, bool json = false);
     const std::vector<std::shared_ptr<HtnTerm>> &arguments() const { return m_arguments; }
     int arity() const { return (int) m_arguments.size(); }
+    // Dense ID of the name in the HtnTermFactory atom table. Equal names have equal IDs
+    int atomID() const { return m_atomID; }
     // Very efficient name comparison because names are interned
+    // Renamed variables share the name of the original so they also need to be in the same frame
     bool nameEqualTo(const HtnTerm &other) const
     {
-        return m_namePtr == other.m_namePtr;
+        return m_namePtr == other.m_namePtr && variableFrame() == other.variableFrame();
     }
     int64_t dynamicSize();
     std::shared_ptr<HtnTerm> Eval(HtnTermFactory *factory);
@@ -57,63 +103,101 @@ public:
     void GetAllVariables(std::set<std::shared_ptr<HtnTerm>, HtnTermComparer> *result);
     double_t GetDouble() const;
     int64_t GetInt() const;
-    HtnTermType GetTermType() const;
+    // Fills elements with the items of a list that ends in [], returns false if this isn't one
+    bool GetListElements(std::vector<std::shared_ptr<HtnTerm>> &elements) const;
+    // Classified once when the term is created so it is cheap to call
+    HtnTermType GetTermType() const { return m_termType; }
     // Terms should never change after they are created
     typedef uint64_t HtnTermID;
     HtnTermID GetUniqueID() const;
-    void GetUniqueID(const std::string **buffer, const std::string **bufferEnd) const;
+    // Structural hash calculated when the term is created from the name and the hashes of the arguments
+    size_t hash() const { return m_hash; }
     bool isArithmetic() const;
     bool isCompoundTerm() { return arity() > 0; }
     bool isConstant() const { return !m_isVariable && m_arguments.size() == 0; }
-	bool isCut() const { return  *m_namePtr == "!";  }
+    bool isAtom(HtnAtom atom) const { return m_atomID == (int) atom; }
+    bool isCut() const { return m_atomID == (int) HtnAtom::Cut; }
     // We can compare pointers for equivalence because names are interned
     bool isEquivalentCompoundTerm(const HtnTerm *other) const { return arity() == other->arity() && m_namePtr == other->m_namePtr; }
-    bool isList() const { return (arity() == 0 && name() == "[]") || (arity() == 2 && name() == ".");  }
-    bool isGround() const;
+    bool isList() const { return (arity() == 0 && isAtom(HtnAtom::EmptyList)) || (arity() == 2 && isAtom(HtnAtom::ListFunctor));  }
+    // Calculated when the term is created
+    bool isGround() const { return m_isGround; }
     void SetInterned() { m_isInterned = true; };
-    bool isTrue() const { return !m_isVariable && *m_namePtr == "true"; }
+    bool isTrue() const { return m_atomID == (int) HtnAtom::True; }
     bool isVariable() const { return m_isVariable; }
+    // Number of items if this is a list that ends in [], -1 otherwise. Calculated when the term is created
+    int listLength() const { return m_listLength; }
     std::shared_ptr<HtnTerm> MakeVariablesUnique(HtnTermFactory *factory, bool onlyDontCareVariables, const std::string &uniquifier, int* dontCareCount, std::map<std::string, std::shared_ptr<HtnTerm>> &variableMap);
-    std::string name() const { return m_isVariable ? m_namePtr->substr(1, m_namePtr->size() - 1) : *m_namePtr; }
+    // Variables don't include the "?", renamed ones end with "_" and their frame so they are unique
+    std::string name() const;
     bool OccursCheck(std::shared_ptr<HtnTerm> variable) const;
     bool operator==(const HtnTerm &other) const;
     std::shared_ptr<HtnTerm> RemovePrefixFromVariables(HtnTermFactory *factory, const std::string &prefix);
-    std::shared_ptr<HtnTerm> RenameVariables(HtnTermFactory *factory, std::map<std::string, std::shared_ptr<HtnTerm>> variableMap);
+    std::shared_ptr<HtnTerm> RenameVariables(HtnTermFactory *factory, const std::map<std::string, std::shared_ptr<HtnTerm>> &variableMap);
+    std::shared_ptr<HtnTerm> RenameVariables(HtnTermFactory *factory, const std::vector<HtnTerm *> &variables, const std::vector<std::shared_ptr<HtnTerm>> &newVariables,
+                                             const std::vector<std::shared_ptr<HtnTerm>> *dontCareVariables = nullptr, int *dontCareIndex = nullptr);
     std::shared_ptr<HtnTerm> ResolveArithmeticTerms(HtnTermFactory *factory);
     std::shared_ptr<HtnTerm> SubstituteTermForVariable(HtnTermFactory *factory, std::shared_ptr<HtnTerm> newTerm, std::shared_ptr<HtnTerm> existingVariable);
-    // Compares using prolog comparison rules
-    int TermCompare(const HtnTerm &other);
+    // Compares using prolog comparison rules. Walks the terms with an explicit stack so deep terms don't recurse
+    int TermCompare(const HtnTerm &other) const;
     std::string ToString(bool isSecondTermInList = false, bool json = false);
     static std::string ToString(const std::vector<std::shared_ptr<HtnTerm>> &goals, bool surroundWithParenthesis = true, bool json = false);
+    // 0 for variables as they were written, HtnTermFactory::CreateVariable() gives renamed ones a new frame instead of a new name
+    int64_t variableFrame() const { return m_isVariable ? m_variableFrame : 0; }
     
     const std::string *m_namePtr;
 
 private:
     // All constructors are private so that TermFactory is used so we can track memory easier
     friend class HtnTermFactory;
+    template<class T> friend class HtnArenaAllocator;
     HtnTerm(); // Leave undefined so we get link errors if anyone uses it
     HtnTerm(const HtnTerm &other); // Leave undefined so we get link errors if anyone uses it. Won't properly track string interning if we use copy constructor
     HtnTerm(const HtnTerm &other, std::weak_ptr<HtnTermFactory> factory);
+    // Create variable renamed into frame
+    HtnTerm(const HtnTerm &variable, int64_t frame, std::weak_ptr<HtnTermFactory> factory);
     // Create a constant
     HtnTerm(const std::string &constantName, std::weak_ptr<HtnTermFactory> factory);
     // Create a constant or variable
     HtnTerm(const std::string &constantName, bool isVariable, std::weak_ptr<HtnTermFactory> factory);
     // Create a functor
     HtnTerm(const std::string &functorName, std::vector<std::shared_ptr<HtnTerm>> arguments, std::weak_ptr<HtnTermFactory> factory);
+    // Create a number whose value is already known so it never needs to be parsed
+    HtnTerm(const std::string &constantName, int64_t value, std::weak_ptr<HtnTermFactory> factory);
+    HtnTerm(const std::string &constantName, double value, std::weak_ptr<HtnTermFactory> factory);
     void arguments(std::vector<std::shared_ptr<HtnTerm>> args) { m_arguments = args; }
     void isVariable(bool value) { m_isVariable = value; }
+    void SetStructureInfo();
+    // Compares only the type, arity, name and value of the terms, not their arguments
+    int TermCompareNode(const HtnTerm &other) const;
+    void SetTermType();
     
     // *** Remember to update dynamicSize() if you change any member variables!
     std::vector<std::shared_ptr<HtnTerm>> m_arguments;
+    int m_atomID;
+    bool m_isGround;
     bool m_isInterned;
     bool m_isVariable;
+    int m_listLength;
+    // Index in the factory's arena terms while the arena scope it was created in is active, -1 otherwise
+    int m_arenaIndex;
     std::weak_ptr<HtnTermFactory> m_factory;
+    size_t m_hash;
+    std::weak_ptr<HtnTerm> m_self;
+    HtnTermType m_termType;
+    // Only valid if m_termType is IntType or FloatType, or Variable for m_variableFrame
+    union
+    {
+        int64_t m_intValue;
+        double m_doubleValue;
+        int64_t m_variableFrame;
+    };
 };
 
 class HtnTermVectorComparer
 {
 public:
-    bool operator() (const std::vector<std::shared_ptr<HtnTerm>> left, const std::vector<std::shared_ptr<HtnTerm>> right) const
+    bool operator() (const std::vector<std::shared_ptr<HtnTerm>> &left, const std::vector<std::shared_ptr<HtnTerm>> &right) const
     {
         if(left.size() < right.size())
         {
@@ -144,7 +228,7 @@ public:
 class HtnTermComparer
 {
 public:
-    bool operator() (const std::shared_ptr<HtnTerm> left, const std::shared_ptr<HtnTerm> right) const
+    bool operator() (const std::shared_ptr<HtnTerm> &left, const std::shared_ptr<HtnTerm> &right) const
     {
         return left->TermCompare(*right.get()) < 0;
     }
@@ -0,0 +1,217 @@
+//
+//  HtnTermArena.cpp
+//  GameLib
+//
+#include <cstdlib>
+#include "FXPlatform/FailFast.h"
+#include "HtnTermArena.h"
+#include "HtnTermFactory.h"
+using namespace std;
+
+HtnTermArena::HtnTermArena(shared_ptr<HtnTermFactory> factory) :
+    m_chunkCount(0),
+    m_chunks(nullptr),
+    m_current(nullptr),
+    m_factory(factory),
+    m_freeChunks(nullptr),
+    m_isClosed(false)
+{
+}
+
+HtnTermArena::~HtnTermArena()
+{
+    Close();
+    FailFastAssertDesc(m_chunkCount == 0, "HtnTermArena destroyed with live allocations");
+}
+
+void *HtnTermArena::Allocate(size_t size)
+{
+    FailFastAssert(!m_isClosed);
+    size_t blockSize = BlockSize(size);
+    char *block;
+    if(blockSize > MaxBlockSize)
+    {
+        block = (char *) malloc(blockSize);
+        FailFastAssert(block != nullptr);
+        *(Chunk **) block = nullptr;
+    }
+    else
+    {
+        if(m_current == nullptr || (size_t) (m_current->end - m_current->next) < blockSize)
+        {
+            Chunk *chunk = m_freeChunks;
+            if(chunk != nullptr)
+            {
+                m_freeChunks = chunk->nextChunk;
+            }
+            else
+            {
+                char *memory = (char *) malloc(ChunkSize);
+                FailFastAssert(memory != nullptr);
+                chunk = (Chunk *) memory;
+                chunk->end = memory + ChunkSize;
+                m_chunkCount++;
+            }
+            
+            chunk->next = (char *) chunk + Align(sizeof(Chunk));
+            chunk->liveCount = 0;
+            chunk->liveSize = 0;
+            chunk->countedSize = 0;
+            chunk->previousChunk = nullptr;
+            chunk->nextChunk = m_chunks;
+            if(m_chunks != nullptr)
+            {
+                m_chunks->previousChunk = chunk;
+            }
+            
+            m_chunks = chunk;
+            if(m_current != nullptr && m_current->liveCount == 0)
+            {
+                UnlinkChunk(m_current);
+                m_current->nextChunk = m_freeChunks;
+                m_freeChunks = m_current;
+            }
+            
+            m_current = chunk;
+        }
+        
+        block = m_current->next;
+        m_current->next += blockSize;
+        m_current->liveCount++;
+        m_current->liveSize += blockSize;
+        *(Chunk **) block = m_current;
+    }
+    
+    return block + HeaderSize();
+}
+
+void HtnTermArena::Close()
+{
+    if(m_isClosed)
+    {
+        return;
+    }
+    
+    m_isClosed = true;
+    m_current = nullptr;
+    while(m_freeChunks != nullptr)
+    {
+        Chunk *chunk = m_freeChunks;
+        m_freeChunks = chunk->nextChunk;
+        FreeChunk(chunk);
+    }
+    
+    Chunk *chunk = m_chunks;
+    while(chunk != nullptr)
+    {
+        Chunk *next = chunk->nextChunk;
+        if(chunk->liveCount == 0)
+        {
+            UnlinkChunk(chunk);
+            FreeChunk(chunk);
+        }
+        else
+        {
+            // What escaped holds the whole chunk but only its own size is counted
+            chunk->countedSize = ChunkSize - chunk->liveSize;
+            RecordSize((int64_t) chunk->countedSize);
+        }
+        
+        chunk = next;
+    }
+}
+
+void HtnTermArena::Deallocate(void *pointer, size_t size)
+{
+    char *block = (char *) pointer - HeaderSize();
+    Chunk *chunk = *(Chunk **) block;
+    if(chunk == nullptr)
+    {
+        free(block);
+        return;
+    }
+    
+    FailFastAssert(chunk->liveCount > 0);
+    size_t blockSize = BlockSize(size);
+    chunk->liveCount--;
+    chunk->liveSize -= blockSize;
+    if(m_isClosed)
+    {
+        if(chunk->liveCount == 0)
+        {
+            RecordSize(-(int64_t) chunk->countedSize);
+            UnlinkChunk(chunk);
+            FreeChunk(chunk);
+        }
+        else
+        {
+            // The space can't be used again until the whole chunk is freed
+            chunk->countedSize += blockSize;
+            RecordSize((int64_t) blockSize);
+        }
+    }
+    else if(chunk == m_current)
+    {
+        // The factory throws away a new term right after creating it if it was already interned, so the
+        // last allocation is often the one being released: give its space back
+        if(block + blockSize == chunk->next)
+        {
+            chunk->next = block;
+        }
+    }
+    else if(chunk->liveCount == 0)
+    {
+        // Kept for reuse until the arena is closed
+        UnlinkChunk(chunk);
+        chunk->nextChunk = m_freeChunks;
+        m_freeChunks = chunk;
+    }
+}
+
+void HtnTermArena::FreeChunk(Chunk *chunk)
+{
+    m_chunkCount--;
+    free(chunk);
+}
+
+void HtnTermArena::RecordSize(int64_t size)
+{
+    shared_ptr<HtnTermFactory> factory = m_factory.lock();
+    if(factory != nullptr)
+    {
+        factory->RecordArenaSize(size);
+    }
+}
+
+void HtnTermArena::UnlinkChunk(Chunk *chunk)
+{
+    if(chunk->previousChunk != nullptr)
+    {
+        chunk->previousChunk->nextChunk = chunk->nextChunk;
+    }
+    else
+    {
+        m_chunks = chunk->nextChunk;
+    }
+    
+    if(chunk->nextChunk != nullptr)
+    {
+        chunk->nextChunk->previousChunk = chunk->previousChunk;
+    }
+}
+
+HtnTermArenaScope::HtnTermArenaScope(HtnTermFactory *factory) :
+    m_factory(factory)
+{
+    m_factory->BeginArenaScope();
+}
+
+HtnTermArenaScope::~HtnTermArenaScope()
+{
+    m_factory->EndArenaScope();
+}
+
+void HtnTermArenaScope::Release()
+{
+    m_factory->BeginArenaRelease();
+}
@@ -0,0 +1,100 @@
+//
+//  HtnTermArena.h
+//  GameLib
+//
+
+#ifndef HtnTermArena_hpp
+#define HtnTermArena_hpp
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+class HtnTermFactory;
+
+// Bump allocator for the HtnTerms (and their shared_ptr control blocks) created while an HtnTermArenaScope is active.
+// Allocations are carved out of large chunks. While the arena is open, chunks that empty out are kept for reuse and they all go back to
+// the heap at once when it is closed. Terms that outlive the scope (solutions, final states, etc.) keep their chunk, and only their chunk,
+// alive, and the factory counts the part of the chunk they don't use until it is freed
+class HtnTermArena
+{
+public:
+    HtnTermArena(std::shared_ptr<HtnTermFactory> factory = nullptr);
+    ~HtnTermArena();
+    void *Allocate(size_t size);
+    // How many chunks are still allocated
+    int chunkCount() const { return m_chunkCount; }
+    // Frees every empty chunk and stops allocating. The chunks left are freed as soon as everything in them is released
+    void Close();
+    void Deallocate(void *pointer, size_t size);
+
+private:
+    static const size_t Alignment = 8;
+    static const size_t ChunkSize = 64 * 1024;
+    // Bigger allocations get their own block from the heap
+    static const size_t MaxBlockSize = ChunkSize / 4;
+    struct Chunk
+    {
+        char *end;
+        char *next;
+        size_t liveCount;
+        size_t liveSize;
+        // Bytes of a chunk kept after Close() that are counted in the factory's memory
+        size_t countedSize;
+        // Chunks in use are in a list so Close() can find them, empty ones wait for reuse in another
+        Chunk *previousChunk;
+        Chunk *nextChunk;
+    };
+
+    static size_t Align(size_t size) { return (size + Alignment - 1) & ~(Alignment - 1); }
+    // Every block starts with a pointer to the chunk it came from
+    static size_t BlockSize(size_t size) { return HeaderSize() + Align(size); }
+    static size_t HeaderSize() { return Align(sizeof(Chunk *)); }
+    void FreeChunk(Chunk *chunk);
+    void RecordSize(int64_t size);
+    void UnlinkChunk(Chunk *chunk);
+    
+    int m_chunkCount;
+    Chunk *m_chunks;
+    Chunk *m_current;
+    std::weak_ptr<HtnTermFactory> m_factory;
+    Chunk *m_freeChunks;
+    bool m_isClosed;
+};
+
+// Allows std::allocate_shared() to put a term and its control block in an HtnTermArena. Each control block holds a reference
+// to the arena so the arena lives until the last term allocated from it is gone
+template<class T>
+class HtnArenaAllocator
+{
+public:
+    typedef T value_type;
+    
+    HtnArenaAllocator(std::shared_ptr<HtnTermArena> arena) : m_arena(arena) {}
+    template<class U> HtnArenaAllocator(const HtnArenaAllocator<U> &other) : m_arena(other.m_arena) {}
+    T *allocate(size_t count) { return static_cast<T *>(m_arena->Allocate(count * sizeof(T))); }
+    // HtnTerm constructors are private so they need to be called from a friend
+    template<class U, class... Args> void construct(U *pointer, Args&&... args) { ::new((void *) pointer) U(std::forward<Args>(args)...); }
+    void deallocate(T *pointer, size_t count) { m_arena->Deallocate(pointer, count * sizeof(T)); }
+    template<class U> void destroy(U *pointer) { pointer->~U(); }
+    template<class U> bool operator==(const HtnArenaAllocator<U> &other) const { return m_arena == other.m_arena; }
+    template<class U> bool operator!=(const HtnArenaAllocator<U> &other) const { return m_arena != other.m_arena; }
+
+    std::shared_ptr<HtnTermArena> m_arena;
+};
+
+// Terms created by the factory while one of these is alive come from an arena. Scopes can be nested, they all share
+// the arena created by the outermost one
+class HtnTermArenaScope
+{
+public:
+    HtnTermArenaScope(HtnTermFactory *factory);
+    ~HtnTermArenaScope();
+    // Call right before releasing what was created in the scope that won't escape it (i.e. the resolver or planner state). Those terms are then
+    // released without removing them one by one from the interned terms, and no new terms can be created until the scope ends.
+    // Only the outermost scope does this, nested ones ignore it
+    void Release();
+
+private:
+    HtnTermFactory *m_factory;
+};
+
+#endif /* HtnTermArena_hpp */
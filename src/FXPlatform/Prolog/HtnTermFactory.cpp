@@ -6,36 +6,160 @@
 //  Copyright © 2019 Eric Zinda. All rights reserved.
 //
 
+#include <cstdio>
+#include <cstdlib>
 #include "Logger.h"
 #include "HtnTerm.h"
 #include "HtnTermFactory.h"
 
 
+// Approximate size of an entry in the interned term shards
+static const int64_t internedTermEntrySize = sizeof(HtnTerm *) + sizeof(size_t) + sizeof(void *);
+
+static atomic<uint64_t> nextFactoryID(0);
+
+// Names of the HtnAtom system atoms in the same order as the enum
+static const char *systemAtomNames[] =
+{
+    "!", "!>", "!<", "true", "false", "[]", ".", "try", "tryEnd", "countAnyOf", "failIfNoneOf",
+    "=", ">", ">=", "<", "=<", "-", "+", "*", "/", "abs", "min", "max", "float", "integer",
+    "=>", "<="
+};
+static_assert(sizeof(systemAtomNames) / sizeof(systemAtomNames[0]) == (size_t) HtnAtom::SystemAtomCount, "systemAtomNames must match HtnAtom");
+
 HtnTermFactory::HtnTermFactory() :
-    m_otherAllocations(MaxIndexTerms * sizeof(string *)),
+    m_arenaScopeDepth(0),
+    m_isReleasingArena(false),
+    m_atomCount(0),
+    m_id(nextFactoryID++),
+    m_isConcurrent(false),
+    m_nextVariableFrame(1),
+    m_otherAllocations(0),
     m_outOfMemory(false),
     m_stringAllocations(0),
     m_termsCreated(0),
     m_uniquifier(0)
 {
-    m_uniqueIDBufferEnd = m_uniqueIDBuffer + MaxIndexTerms;
+    // System atoms are interned first so they get their fixed IDs. The factory keeps the reference so they are never released
+    for(int index = 0; index < (int) HtnAtom::SystemAtomCount; ++index)
+    {
+        int atomID;
+        const string *name = GetInternedString(systemAtomNames[index], &atomID);
+        FailFastAssert(atomID == index);
+        m_systemAtoms.insert(pair<const string *, int>(name, atomID));
+    }
+}
+
+HtnTermFactory::~HtnTermFactory()
+{
+    for(int index = 0; index < (int) HtnAtom::SystemAtomCount; ++index)
+    {
+        ReleaseAtom(index);
+    }
+}
+
+size_t HtnTermFactory::internedTermHash::operator()(const HtnTerm *term) const
+{
+    return term->hash();
+}
+
+bool HtnTermFactory::internedTermEqual::operator()(const HtnTerm *lhs, const HtnTerm *rhs) const
+{
+    if(lhs->m_namePtr != rhs->m_namePtr || lhs->isVariable() != rhs->isVariable() || lhs->variableFrame() != rhs->variableFrame() || lhs->arity() != rhs->arity())
+    {
+        return false;
+    }
+    
+    const vector<shared_ptr<HtnTerm>> &lhsArguments = lhs->arguments();
+    const vector<shared_ptr<HtnTerm>> &rhsArguments = rhs->arguments();
+    for(size_t index = 0; index < lhsArguments.size(); ++index)
+    {
+        if(lhsArguments[index].get() != rhsArguments[index].get())
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void HtnTermFactory::BeginArenaScope()
+{
+    // Arenas aren't thread safe
+    if(m_isConcurrent)
+    {
+        return;
+    }
+    
+    if(m_arenaScopeDepth++ == 0)
+    {
+        // These are cached by the factory forever, don't let them pin a chunk of the arena
+        True();
+        False();
+        EmptyList();
+        m_arena = shared_ptr<HtnTermArena>(new HtnTermArena(shared_from_this()));
+    }
+}
+
+void HtnTermFactory::BeginArenaRelease()
+{
+    if(m_arenaScopeDepth == 1)
+    {
+        m_isReleasingArena = true;
+    }
 }
 
 void HtnTermFactory::BeginTracking(const string &key)
 {
+    unique_lock<mutex> lock = Lock(m_mutex);
     m_termCreationTracking[key] = pair<int,int>(m_termsCreated, (int) dynamicSize());
 }
 
+void HtnTermFactory::concurrent(bool value)
+{
+    FailFastAssertDesc(m_arenaScopeDepth == 0, "Can't switch to concurrent mode inside an arena scope");
+    if(value)
+    {
+        // These are created lazily which isn't thread safe
+        True();
+        False();
+        EmptyList();
+        m_atomBlocks.reserve(MaxConcurrentAtomBlocks);
+    }
+    
+    m_isConcurrent = value;
+}
+
 shared_ptr<HtnTerm> HtnTermFactory::CreateConstant(const string &name)
 {
     m_termsCreated++;
-    shared_ptr<HtnTerm> term = shared_ptr<HtnTerm>(new HtnTerm(name, false, shared_from_this()));
+    shared_ptr<HtnTerm> term = NewTerm(name, false, shared_from_this());
     return GetInternedTerm(term);
 }
 
 shared_ptr<HtnTerm> HtnTermFactory::CreateConstant(int value)
 {
-    return CreateConstant(lexical_cast<string>(value));
+    return CreateConstant((int64_t) value);
+}
+
+// Numbers created from values get the same name they would get if they were converted with lexical_cast<string>()
+// but skip the stringstream and never need to be parsed back
+shared_ptr<HtnTerm> HtnTermFactory::CreateConstant(int64_t value)
+{
+    m_termsCreated++;
+    shared_ptr<HtnTerm> term = NewTerm(to_string((long long) value), value, shared_from_this());
+    return GetInternedTerm(term);
+}
+
+shared_ptr<HtnTerm> HtnTermFactory::CreateConstant(double value)
+{
+    // Same format lexical_cast<string>() uses: fixed with 9 digits of precision. The value is parsed back from the name
+    // so it is the same as if the name had been parsed, no matter how the constant was created first
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer), "%.9f", value);
+    m_termsCreated++;
+    shared_ptr<HtnTerm> term = NewTerm(string(buffer), strtod(buffer, nullptr), shared_from_this());
+    return GetInternedTerm(term);
 }
 
 shared_ptr<HtnTerm> HtnTermFactory::CreateConstantFunctor(const string &name, vector<string> arguments)
@@ -52,7 +176,7 @@ shared_ptr<HtnTerm> HtnTermFactory::CreateConstantFunctor(const string &name, ve
 shared_ptr<HtnTerm> HtnTermFactory::CreateFunctor(const string &name, vector<shared_ptr<HtnTerm>> arguments)
 {
     m_termsCreated++;
-    shared_ptr<HtnTerm> term = shared_ptr<HtnTerm>(new HtnTerm(name, arguments, shared_from_this()));
+    shared_ptr<HtnTerm> term = NewTerm(name, arguments, shared_from_this());
     return GetInternedTerm(term);
 }
 
@@ -70,7 +194,21 @@ std::shared_ptr<HtnTerm> HtnTermFactory::CreateList(std::vector<std::shared_ptr<
 shared_ptr<HtnTerm> HtnTermFactory::CreateVariable(const string &name)
 {
     m_termsCreated++;
-    shared_ptr<HtnTerm> term = shared_ptr<HtnTerm>(new HtnTerm(name, true, shared_from_this()));
+    shared_ptr<HtnTerm> term = NewTerm(name, true, shared_from_this());
+    return GetInternedTerm(term);
+}
+
+shared_ptr<HtnTerm> HtnTermFactory::CreateVariable(const string &name, int64_t frame)
+{
+    shared_ptr<HtnTerm> variable = CreateVariable(name);
+    return frame == 0 ? variable : CreateVariable(*variable, frame);
+}
+
+shared_ptr<HtnTerm> HtnTermFactory::CreateVariable(const HtnTerm &variable, int64_t frame)
+{
+    FailFastAssert(variable.isVariable() && frame != 0);
+    m_termsCreated++;
+    shared_ptr<HtnTerm> term = NewTerm(variable, frame, shared_from_this());
     return GetInternedTerm(term);
 }
 
@@ -90,9 +228,13 @@ shared_ptr<HtnCustomData> HtnTermFactory::customData(const string &name)
 void HtnTermFactory::DebugDumpAllocations()
 {
     int count = 0;
-    for(auto item : m_internedTerms)
+    for(TermShard &shard : m_termShards)
     {
-        if(++count > 1000) break;
+        unique_lock<mutex> lock = Lock(shard.mutex);
+        for(auto item : shard.terms)
+        {
+            if(++count > 1000) break;
+        }
     }
 }
 
@@ -106,8 +248,43 @@ shared_ptr<HtnTerm> HtnTermFactory::EmptyList()
     return m_emptyList;
 }
 
+void HtnTermFactory::EndArenaScope()
+{
+    if(m_isConcurrent)
+    {
+        return;
+    }
+    
+    FailFastAssert(m_arenaScopeDepth > 0);
+    if(--m_arenaScopeDepth == 0)
+    {
+        // The terms still alive escaped the scope so they move to the interned terms. The rest were removed when they were released
+        // or, after a bulk release, go away with the set
+        RecordSize(m_otherAllocations, -(int64_t) m_arenaTerms.size() * internedTermEntrySize);
+        InternedTermSet().swap(m_arenaTerms);
+        for(HtnTerm *term : m_arenaTermSlots)
+        {
+            if(term != nullptr)
+            {
+                term->m_arenaIndex = -1;
+                m_termShards[term->hash() % ShardCount].terms.insert(term);
+                RecordSize(m_otherAllocations, internedTermEntrySize);
+            }
+        }
+        
+        vector<HtnTerm *>().swap(m_arenaTermSlots);
+        vector<int>().swap(m_freeArenaTermSlots);
+        m_isReleasingArena = false;
+        
+        // Whatever is still alive holds the arena through its control block
+        m_arena->Close();
+        m_arena = nullptr;
+    }
+}
+
 pair<int,int> HtnTermFactory::EndTracking(const string &key)
 {
+    unique_lock<mutex> lock = Lock(m_mutex);
     auto found = m_termCreationTracking.find(key);
     int termsCreated = m_termsCreated - found->second.first;
     int memoryUsed = (int)(dynamicSize() - found->second.second);
@@ -125,94 +302,279 @@ shared_ptr<HtnTerm> HtnTermFactory::False()
     return m_false;
 }
 
-const string *HtnTermFactory::GetInternedString(const string &value)
+const string *HtnTermFactory::GetInternedString(const string &value, int *atomID)
 {
-    InternedStringMap::iterator found = m_internedStrings.find(&value);
-    if(found != m_internedStrings.end())
+    if(m_isConcurrent)
+    {
+        InternedStringMap::iterator found = m_systemAtoms.find(&value);
+        if(found != m_systemAtoms.end())
+        {
+            *atomID = found->second;
+            atom(*atomID).refCount++;
+            return found->first;
+        }
+    }
+    
+    int shardIndex = (int) (stringPtrHash()(&value) % ShardCount);
+    StringShard &shard = m_stringShards[shardIndex];
+    unique_lock<mutex> lock = Lock(shard.mutex);
+    InternedStringMap::iterator found = shard.strings.find(&value);
+    if(found != shard.strings.end())
     {
-        found->second += 1;
+        *atomID = found->second;
+        atom(*atomID).refCount++;
         return found->first;
     }
     else
     {
         string *newString = new string(value);
-        m_stringAllocations += sizeof(string) + value.size();
-        m_internedStrings.insert(pair<const string *, int>(newString, 1));
+        RecordSize(m_stringAllocations, sizeof(string) + value.size());
+        {
+            unique_lock<mutex> atomLock = Lock(m_atomMutex);
+            if(m_freeAtomIDs.size() > 0)
+            {
+                *atomID = m_freeAtomIDs.back();
+                m_freeAtomIDs.pop_back();
+            }
+            else
+            {
+                *atomID = m_atomCount++;
+                if(*atomID % AtomBlockSize == 0)
+                {
+                    FailFastAssertDesc(!m_isConcurrent || m_atomBlocks.size() < m_atomBlocks.capacity(), "Too many atoms in concurrent HtnTermFactory");
+                    m_atomBlocks.push_back(unique_ptr<AtomEntry[]>(new AtomEntry[AtomBlockSize]));
+                }
+            }
+        }
+        
+        AtomEntry &entry = atom(*atomID);
+        entry.name = newString;
+        entry.refCount = 1;
+        entry.shard = shardIndex;
+        shard.strings.insert(pair<const string *, int>(newString, *atomID));
         return newString;
     }
 }
 
+// In concurrent mode the term found might belong to another thread that just released the last reference to it
+// and is waiting for the lock to remove it. It can't be revived so it gets replaced by the new term
 shared_ptr<HtnTerm> HtnTermFactory::GetInternedTerm(shared_ptr<HtnTerm> &term)
 {
-    term->GetUniqueID(m_uniqueIDBuffer, m_uniqueIDBufferEnd);
-    InternedTermMap::iterator found = m_internedTerms.find(m_uniqueIDBuffer);
-    if(found != m_internedTerms.end())
+    if(m_arena != nullptr)
+    {
+        return GetInternedArenaTerm(term);
+    }
+    
+    TermShard &shard = m_termShards[term->hash() % ShardCount];
+    unique_lock<mutex> lock = Lock(shard.mutex);
+    InternedTermSet::iterator found = shard.terms.find(term.get());
+    if(found != shard.terms.end())
     {
         // Element did exist, return that one
-        FailFastAssert(!found->second.expired());
-        return found->second.lock();
+        shared_ptr<HtnTerm> existing = (*found)->m_self.lock();
+        if(existing != nullptr)
+        {
+            return existing;
+        }
+
+        FailFastAssert(m_isConcurrent);
+        shard.terms.erase(found);
+        shard.terms.insert(term.get());
+        term->SetInterned();
+        return term;
     }
     else
     {
         // Element didn't exist, intern it
-        size_t keySize = (size_t) *m_uniqueIDBuffer;
-        const string **id = new const string *[keySize];
-        memcpy(id, m_uniqueIDBuffer, keySize * sizeof(string *));
-        m_internedTerms.insert(pair<const string **, weak_ptr<HtnTerm>>(id, term));
-        m_otherAllocations += sizeof(pair<const string **, weak_ptr<HtnTerm>>) + keySize * sizeof(const string *);
+        shard.terms.insert(term.get());
+        RecordSize(m_otherAllocations, internedTermEntrySize);
         term->SetInterned();
         return term;
     }
 }
 
+// A term with an argument from the arena can't already be in m_termShards. Arenas are never used in concurrent mode so there is no locking
+shared_ptr<HtnTerm> HtnTermFactory::GetInternedArenaTerm(shared_ptr<HtnTerm> &term)
+{
+    FailFastAssertDesc(!m_isReleasingArena, "Terms can't be created while an arena scope is being released");
+    bool hasArenaArgument = false;
+    for(const shared_ptr<HtnTerm> &argument : term->m_arguments)
+    {
+        if(argument->m_arenaIndex != -1)
+        {
+            hasArenaArgument = true;
+            break;
+        }
+    }
+    
+    if(!hasArenaArgument)
+    {
+        InternedTermSet &terms = m_termShards[term->hash() % ShardCount].terms;
+        InternedTermSet::iterator found = terms.find(term.get());
+        if(found != terms.end())
+        {
+            return (*found)->m_self.lock();
+        }
+    }
+    
+    InternedTermSet::iterator found = m_arenaTerms.find(term.get());
+    if(found != m_arenaTerms.end())
+    {
+        return (*found)->m_self.lock();
+    }
+    
+    if(m_freeArenaTermSlots.size() > 0)
+    {
+        term->m_arenaIndex = m_freeArenaTermSlots.back();
+        m_freeArenaTermSlots.pop_back();
+        m_arenaTermSlots[term->m_arenaIndex] = term.get();
+    }
+    else
+    {
+        term->m_arenaIndex = (int) m_arenaTermSlots.size();
+        m_arenaTermSlots.push_back(term.get());
+    }
+    
+    m_arenaTerms.insert(term.get());
+    RecordSize(m_otherAllocations, internedTermEntrySize);
+    term->SetInterned();
+    return term;
+}
+
+template<class... Args> shared_ptr<HtnTerm> HtnTermFactory::NewTerm(Args&&... args)
+{
+    shared_ptr<HtnTerm> term;
+    if(m_arena == nullptr)
+    {
+        term = shared_ptr<HtnTerm>(new HtnTerm(std::forward<Args>(args)...));
+    }
+    else
+    {
+        term = allocate_shared<HtnTerm>(HtnArenaAllocator<HtnTerm>(m_arena), std::forward<Args>(args)...);
+    }
+    
+    term->m_self = term;
+    return term;
+}
+
 void HtnTermFactory::RecordAllocation(HtnTerm *term)
 {
     int size = (int) term->dynamicSize();
-    m_otherAllocations += size;
+    RecordSize(m_otherAllocations, size);
 }
 
 void HtnTermFactory::RecordDeallocation(HtnTerm *term)
 {
     int size = (int) term->dynamicSize();
-    m_otherAllocations -= size;
+    RecordSize(m_otherAllocations, -size);
     FailFastAssert(m_otherAllocations >= 0);
 }
 
-void HtnTermFactory::ReleaseInternedString(const string *value)
+void HtnTermFactory::ReleaseAtom(int atomID)
 {
-    InternedStringMap::iterator found = m_internedStrings.find(value);
-    if(found != m_internedStrings.end())
+    AtomEntry &entry = atom(atomID);
+    if(atomID < (int) HtnAtom::SystemAtomCount)
     {
-        if(found->second == 1)
+        // The factory holds a reference on these until it is destroyed
+        if(--entry.refCount == 0)
         {
-            m_stringAllocations -= sizeof(string) + value->size();
-            FailFastAssert(m_stringAllocations >= 0);
-			const std::string* temp = found->first;
-            m_internedStrings.erase(found);
-			delete temp;
-		}
-        else
+            delete entry.name;
+        }
+        
+        return;
+    }
+    
+    StringShard &shard = m_stringShards[entry.shard];
+    unique_lock<mutex> lock = Lock(shard.mutex);
+    FailFastAssert(entry.refCount > 0);
+    if(--entry.refCount == 0)
+    {
+        const string *value = entry.name;
+        RecordSize(m_stringAllocations, -(int64_t) (sizeof(string) + value->size()));
+        FailFastAssert(m_stringAllocations >= 0);
+        shard.strings.erase(value);
         {
-            found->second -= 1;
+            unique_lock<mutex> atomLock = Lock(m_atomMutex);
+            entry.name = nullptr;
+            m_freeAtomIDs.push_back(atomID);
         }
+        
+        delete value;
     }
-    else
+}
+
+void HtnTermFactory::ReleaseInternedString(const string *value)
+{
+    int atomID;
+    {
+        StringShard &shard = m_stringShards[stringPtrHash()(value) % ShardCount];
+        unique_lock<mutex> lock = Lock(shard.mutex);
+        InternedStringMap::iterator found = shard.strings.find(value);
+        FailFastAssert(found != shard.strings.end());
+        atomID = found->second;
+    }
+
+    ReleaseAtom(atomID);
+}
+
+// During a bulk release the term stays in m_arenaTerms, which is thrown away when the scope ends
+void HtnTermFactory::ReleaseArenaTerm(HtnTerm *term)
+{
+    m_arenaTermSlots[term->m_arenaIndex] = nullptr;
+    if(!m_isReleasingArena)
     {
-        FailFastAssert(false);
+        m_freeArenaTermSlots.push_back(term->m_arenaIndex);
+        m_arenaTerms.erase(term);
+        RecordSize(m_otherAllocations, -internedTermEntrySize);
     }
 }
 
+// If the term was replaced by GetInternedTerm() it is no longer in the set
 void HtnTermFactory::ReleaseInternedTerm(HtnTerm *term)
 {
-    term->GetUniqueID(m_uniqueIDBuffer, m_uniqueIDBufferEnd);
-    size_t keySize = (size_t) *m_uniqueIDBuffer;
-    m_otherAllocations -= sizeof(pair<const string **, weak_ptr<HtnTerm>>) + keySize * sizeof(const string *);
+    TermShard &shard = m_termShards[term->hash() % ShardCount];
+    unique_lock<mutex> lock = Lock(shard.mutex);
+    InternedTermSet::iterator found = shard.terms.find(term);
+    if(found != shard.terms.end() && *found == term)
+    {
+        shard.terms.erase(found);
+        RecordSize(m_otherAllocations, -internedTermEntrySize);
+    }
+    else
+    {
+        FailFastAssert(m_isConcurrent);
+    }
+}
 
-    InternedTermMap::iterator found = m_internedTerms.find(m_uniqueIDBuffer);
-    FailFastAssert(found != m_internedTerms.end());
-	const string** temp = found->first;
-    m_internedTerms.erase(found);
-	delete[] temp;
+// The intern table is the only way to get a new reference to a term nothing else holds, so while its shard is locked
+// another thread can't start using list between checking use_count() and moving the tail out of it
+bool HtnTermFactory::TakeListTail(const shared_ptr<HtnTerm> &list, shared_ptr<HtnTerm> &tail)
+{
+    TermShard &shard = m_termShards[list->hash() % ShardCount];
+    unique_lock<mutex> lock = Lock(shard.mutex);
+    if(list.use_count() != 1)
+    {
+        return false;
+    }
+    
+    tail = std::move(list->m_arguments[1]);
+    return true;
+}
+
+// A thread keeps one of these for each concurrent factory it has used
+HtnTermFactory::ThreadMemory &HtnTermFactory::threadMemory()
+{
+    static thread_local vector<ThreadMemory> threadMemories;
+    for(ThreadMemory &item : threadMemories)
+    {
+        if(item.factoryID == m_id)
+        {
+            return item;
+        }
+    }
+    
+    threadMemories.push_back(ThreadMemory { m_id, 0, false });
+    return threadMemories.back();
 }
 
 shared_ptr<HtnTerm> HtnTermFactory::True()
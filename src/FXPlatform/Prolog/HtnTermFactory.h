@@ -8,10 +8,16 @@
 
 #ifndef HtnTermFactory_hpp
 #define HtnTermFactory_hpp
+#include <atomic>
 #include <cstring>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
+#include <vector>
+#include "HtnTermArena.h"
 class HtnTerm;
 
 // Derive a class from HtnCustomData and add to the TermFactory if you want to pass global data
@@ -27,46 +33,85 @@ class HtnTermFactory : public std::enable_shared_from_this<HtnTermFactory>
 {
 public:
     HtnTermFactory();
+    ~HtnTermFactory();
+    // Adds a reference to an atom the caller already holds one on, so it doesn't need to be looked up
+    void AddAtomReference(int atomID) { atom(atomID).refCount++; }
+    // Terms created between these calls are allocated from an HtnTermArena, use HtnTermArenaScope instead of calling directly
+    void BeginArenaScope();
+    // See HtnTermArenaScope::Release()
+    void BeginArenaRelease();
     void BeginTracking(const std::string &key);
     std::shared_ptr<HtnTerm> CreateConstant(const std::string &name);
     std::shared_ptr<HtnTerm> CreateConstant(int value);
+    std::shared_ptr<HtnTerm> CreateConstant(int64_t value);
+    std::shared_ptr<HtnTerm> CreateConstant(double value);
     std::shared_ptr<HtnTerm> CreateConstantFunctor(const std::string &name, std::vector<std::string> arguments);
     std::shared_ptr<HtnTerm> CreateFunctor(const std::string &name, std::vector<std::shared_ptr<HtnTerm>> arguments);
     std::shared_ptr<HtnTerm> CreateList(std::vector<std::shared_ptr<HtnTerm>> arguments);
     std::shared_ptr<HtnTerm> CreateVariable(const std::string &name);
+    std::shared_ptr<HtnTerm> CreateVariable(const std::string &name, int64_t frame);
+    // Same name as variable but in frame, so renaming doesn't create or look up any strings
+    std::shared_ptr<HtnTerm> CreateVariable(const HtnTerm &variable, int64_t frame);
     void DebugDumpAllocations();
     std::shared_ptr<HtnTerm> EmptyList();
+    void EndArenaScope();
     std::pair<int,int> EndTracking(const std::string &key);
     std::shared_ptr<HtnTerm> False();
-    const std::string *GetInternedString(const std::string &value);
+    // Name of an atom ID returned by HtnTerm::atomID() or GetInternedString()
+    const std::string *atomName(int atomID) { return atom(atomID).name; }
+    const std::string *GetInternedString(const std::string &value) { int atomID; return GetInternedString(value, &atomID); }
+    const std::string *GetInternedString(const std::string &value, int *atomID);
     std::shared_ptr<HtnTerm> GetInternedTerm(std::shared_ptr<HtnTerm> &term);
     void RecordAllocation(HtnTerm *term);
+    // Used by HtnTermArena to count the chunks kept alive by terms that outlived their scope
+    void RecordArenaSize(int64_t size) { RecordSize(m_otherAllocations, size); }
     void RecordDeallocation(HtnTerm *term);
     std::shared_ptr<HtnTerm> True();
+    // Same as ReleaseInternedString() but doesn't need to hash the string
+    void ReleaseAtom(int atomID);
     void ReleaseInternedString(const std::string *value);
     void ReleaseInternedTerm(HtnTerm *term);
+    void ReleaseArenaTerm(HtnTerm *term);
+    // Moves the tail of list into tail if nothing else references list, so ~HtnTerm() can release long lists one item at a time
+    bool TakeListTail(const std::shared_ptr<HtnTerm> &list, std::shared_ptr<HtnTerm> &tail);
 
+    // Concurrent mode allows terms to be created and released from many threads at once. Set it before the factory is shared, outside of any HtnTermArenaScope.
+    // In concurrent mode arena scopes do nothing, and budgetedSize() and outOfMemory() are kept for each thread so one planner
+    // running out of memory doesn't stop the others
+    bool concurrent() { return m_isConcurrent; }
+    void concurrent(bool value);
     // This is how custom data can get marshalled to HtnGoalResolver custom rules
     std::shared_ptr<HtnCustomData> customData(const std::string &name);
     void customData(const std::string &name, std::shared_ptr<HtnCustomData> data) { m_customData[name] = data; }
-    bool outOfMemory() { return m_outOfMemory; }
+    bool outOfMemory() { return m_isConcurrent ? threadMemory().outOfMemory : m_outOfMemory.load(); }
     void outOfMemory(bool value)
     {
-        m_outOfMemory = value;
+        if(m_isConcurrent)
+        {
+            threadMemory().outOfMemory = value;
+        }
+        else
+        {
+            m_outOfMemory = value;
+        }
     }
+    // Resolvers and planners count the change in this against their memory budget. In concurrent mode it only changes when
+    // the calling thread allocates or releases terms, so it is only meaningful compared to an earlier value from the same thread
+    int64_t budgetedSize() { return m_isConcurrent ? threadMemory().allocations : dynamicSize(); }
     int64_t dynamicSize() { return m_otherAllocations + m_stringAllocations; }
     int64_t otherAllocationSize() { return m_otherAllocations; }
     int64_t stringSize() { return m_stringAllocations; }
-    uint64_t &uniquifier() { return m_uniquifier; }
-    
-    // This can be anything, it represents the max number of terms we support
-    // One array of strings of this size will be created
-    static const int MaxIndexTerms = 4096;
+    // Returns a different value every time it is called
+    uint64_t nextUniquifier() { return m_uniquifier++; }
+    // Returns the first of count frames no variable has been renamed into yet
+    int64_t ReserveVariableFrames(int count) { return m_nextVariableFrame.fetch_add(count); }
 
 private:
-    std::map<std::string, std::shared_ptr<HtnCustomData>> m_customData;
-    std::shared_ptr<HtnTerm> m_false;
-    std::shared_ptr<HtnTerm> m_emptyList;
+    // Interned strings and terms are split into shards by hash, each with its own lock (only used in concurrent mode)
+    static const int ShardCount = 64;
+    static const int AtomBlockSize = 4096;
+    // Blocks never move, only the array pointing to them can grow, so in concurrent mode it is reserved up front
+    static const int MaxConcurrentAtomBlocks = 4096;
 
     struct stringPtrLess
     {
@@ -92,56 +137,99 @@ private:
         }
     };
 
-    struct uniqueIDPtrHash
+    // The arguments of a term are always interned before the term is, so a term is uniquely identified by
+    // its name and the pointers to its arguments. That makes hashing and comparing O(arity) instead of O(size of the term)
+    struct internedTermHash
     {
-        size_t operator()(const std::string **value) const
-        {
-            size_t seed = 0;
-            // First "pointer" is actually a count of pointers (including the count)
-            size_t count = (size_t) *value;
-            for(int index = 0; index < count; ++index)
-            {
-                // Stolen from boost::has_combine
-                std::hash<const std::string *> hasher;
-                seed ^= hasher(*value) + 0x9e3779b9 + (seed<<6) + (seed>>2);
-                value++;
-            }
-            return seed;
-        }
+        size_t operator()(const HtnTerm *term) const;
     };
     
-    struct uniqueIDPtrEqual
+    struct internedTermEqual
     {
-        bool operator()(const std::string **lhs, const std::string **rhs) const
-        {
-            if(*lhs != *rhs)
-            {
-                // Not the same number of elements, can't be equal
-                return false;
-            }
-            else
-            {
-                // First "pointer" is actually a count of pointers (including the count)
-                size_t count = (size_t) *lhs;
-                return memcmp(lhs, rhs, count * sizeof(std::string *)) == 0;
-            }
-        }
+        bool operator()(const HtnTerm *lhs, const HtnTerm *rhs) const;
     };
-    
+
+    struct ThreadMemory
+    {
+        uint64_t factoryID;
+        int64_t allocations;
+        bool outOfMemory;
+    };
+
+    struct AtomEntry
+    {
+        const std::string *name;
+        std::atomic<int> refCount;
+        int shard;
+    };
+
+    // Maps an interned string to its atom ID
     typedef std::unordered_map<const std::string *, int, stringPtrHash, stringPtrEqual> InternedStringMap;
-    InternedStringMap m_internedStrings;
-    typedef std::unordered_map<const std::string **, std::weak_ptr<HtnTerm>, uniqueIDPtrHash, uniqueIDPtrEqual> InternedTermMap;
-    InternedTermMap m_internedTerms;
-    int64_t m_otherAllocations;
-    bool m_outOfMemory;
-    int64_t m_stringAllocations;
+    typedef std::unordered_set<HtnTerm *, internedTermHash, internedTermEqual> InternedTermSet;
+    
+    struct StringShard
+    {
+        std::mutex mutex;
+        InternedStringMap strings;
+    };
+
+    struct TermShard
+    {
+        std::mutex mutex;
+        InternedTermSet terms;
+    };
+
+    AtomEntry &atom(int atomID) { return m_atomBlocks[atomID / AtomBlockSize][atomID % AtomBlockSize]; }
+    // Only locks in concurrent mode
+    std::unique_lock<std::mutex> Lock(std::mutex &mutex)
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+        if(m_isConcurrent) { lock.lock(); }
+        return lock;
+    }
+    std::shared_ptr<HtnTerm> GetInternedArenaTerm(std::shared_ptr<HtnTerm> &term);
+    template<class... Args> std::shared_ptr<HtnTerm> NewTerm(Args&&... args);
+    void RecordSize(std::atomic<int64_t> &counter, int64_t size)
+    {
+        counter += size;
+        if(m_isConcurrent) { threadMemory().allocations += size; }
+    }
+    ThreadMemory &threadMemory();
+
+    std::shared_ptr<HtnTermArena> m_arena;
+    int m_arenaScopeDepth;
+    // Terms created in an arena scope are interned here, not in m_termShards, until the scope ends and the ones still alive get moved over.
+    // HtnTerm::m_arenaIndex is where a term is in m_arenaTermSlots, which is how the ones still alive are found even after a bulk release
+    InternedTermSet m_arenaTerms;
+    std::vector<HtnTerm *> m_arenaTermSlots;
+    std::vector<int> m_freeArenaTermSlots;
+    bool m_isReleasingArena;
+    std::map<std::string, std::shared_ptr<HtnCustomData>> m_customData;
+    std::shared_ptr<HtnTerm> m_false;
+    std::shared_ptr<HtnTerm> m_emptyList;
+    // Atom table: every interned string gets a dense ID, IDs of released strings get reused
+    std::vector<std::unique_ptr<AtomEntry[]>> m_atomBlocks;
+    int m_atomCount;
+    std::mutex m_atomMutex;
+    std::vector<int> m_freeAtomIDs;
+    // Never reused, so the ThreadMemory of a destroyed factory can't be mistaken for a new one's
+    uint64_t m_id;
+    bool m_isConcurrent;
+    std::atomic<int64_t> m_nextVariableFrame;
+    // Protects everything that isn't sharded in concurrent mode
+    std::mutex m_mutex;
+    std::atomic<int64_t> m_otherAllocations;
+    std::atomic<bool> m_outOfMemory;
+    std::atomic<int64_t> m_stringAllocations;
+    StringShard m_stringShards[ShardCount];
+    // System atoms are never released so in concurrent mode they are found here without taking a lock
+    InternedStringMap m_systemAtoms;
     std::map<std::string, std::pair<int, int>> m_termCreationTracking;
-    int m_termsCreated;
+    std::atomic<int> m_termsCreated;
+    TermShard m_termShards[ShardCount];
     std::shared_ptr<HtnTerm> m_true;
-    const std::string *m_uniqueIDBuffer[MaxIndexTerms];
-    std::string const ** m_uniqueIDBufferEnd;
     // Global counter that is incremented every time it is used
-    uint64_t m_uniquifier;
+    std::atomic<uint64_t> m_uniquifier;
 };
 
 #endif /* HtnTermFactory_hpp */
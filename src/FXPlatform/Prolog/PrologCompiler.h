@@ -26,7 +26,8 @@ class PrologCompilerBase : public Compiler<PrologDocument<VariableRule>>
 public:
     PrologCompilerBase(HtnTermFactory *termFactory, HtnRuleSet *state) :
         m_state(state),
-        m_termFactory(termFactory)
+        m_termFactory(termFactory),
+        m_rulesToReserve(0)
     {
     }
 
@@ -159,6 +160,21 @@ public:
     
 protected:
     vector<shared_ptr<HtnTerm>> m_goals;
+    // Items left in the document being compiled, reserved the first time one of them adds a rule
+    size_t m_rulesToReserve;
+    
+    // Reserving only once a rule is added means documents with only goals or directives never touch the rule storage,
+    // which can't be reserved once it is locked
+    void AddRule(shared_ptr<HtnTerm> head, const vector<shared_ptr<HtnTerm>> &tail)
+    {
+        if(m_rulesToReserve > 0)
+        {
+            m_state->ReserveRules(m_rulesToReserve);
+            m_rulesToReserve = 0;
+        }
+        
+        m_state->AddRule(head, tail);
+    }
     
     void CheckRuleRecurseTail(shared_ptr<HtnGoalResolver> resolver, const string &ruleHead, int arity, const vector<shared_ptr<HtnTerm>> &ruleTail, vector<string> &stack, set<string> &loops)
     {
@@ -299,13 +315,13 @@ protected:
     void ParseAtom(shared_ptr<Symbol> symbol)
     {
         vector<shared_ptr<HtnTerm>> emptyTail;
-        m_state->AddRule(m_termFactory->CreateConstant(symbol->ToString()), emptyTail);
+        AddRule(m_termFactory->CreateConstant(symbol->ToString()), emptyTail);
     }
     
     void ParseList(shared_ptr<Symbol> symbol)
     {
         vector<shared_ptr<HtnTerm>> emptyTail;
-        m_state->AddRule(CreateTermFromList(m_termFactory, symbol), emptyTail);
+        AddRule(CreateTermFromList(m_termFactory, symbol), emptyTail);
     }
 
     virtual void ParseRule(shared_ptr<Symbol> symbol)
@@ -319,7 +335,26 @@ protected:
             list.push_back(CreateTermFromItem(m_termFactory, item));
         }
         
-        m_state->AddRule(CreateTermFromFunctor(m_termFactory, head), list);
+        AddRule(CreateTermFromFunctor(m_termFactory, head), list);
+    }
+    
+    // Only table(/(name, arity), ...) is a directive so programs can still have facts like table(kitchen)
+    static bool IsTableDirective(shared_ptr<HtnTerm> term)
+    {
+        if(term->name() != "table")
+        {
+            return false;
+        }
+        
+        for(shared_ptr<HtnTerm> item : term->arguments())
+        {
+            if(!(item->name() == "/" && item->arity() == 2 && item->arguments()[0]->isConstant() && item->arguments()[1]->GetTermType() == HtnTermType::IntType))
+            {
+                return false;
+            }
+        }
+        
+        return true;
     }
     
     void ParseTopLevelFunctor(shared_ptr<Symbol> symbol)
@@ -332,11 +367,19 @@ protected:
         {
             m_goals.insert(m_goals.end(), term->arguments().begin(), term->arguments().end());
         }
+        else if(IsTableDirective(term))
+        {
+            // table(/(name, arity), ...) declares predicates whose answers should be remembered
+            for(shared_ptr<HtnTerm> item : term->arguments())
+            {
+                m_state->AddTabledPredicate(item->arguments()[0], (int) item->arguments()[1]->GetInt());
+            }
+        }
         else
         {
             // Interpret top level functors that aren't reserved words as facts
             vector<shared_ptr<HtnTerm>> emptyTail;
-            m_state->AddRule(term, emptyTail);
+            AddRule(term, emptyTail);
         }
     }
     
@@ -347,6 +390,7 @@ protected:
         //    string foo = ParserDebug::PrintTree(*result);
         
         // Top level symbol is a document, we want to iterate its children
+        m_rulesToReserve = (*result)[0]->children().size();
         for(auto item : (*result)[0]->children())
         {
             //        string output = ParserDebug::PrintTree(functor, 0);
@@ -368,6 +412,11 @@ protected:
                 default:
                     FailFastAssert(false);
             }
+            
+            if(m_rulesToReserve > 0)
+            {
+                m_rulesToReserve--;
+            }
         }
         
         return true;
@@ -0,0 +1,89 @@
+#include "MappedFile.h"
+#include "Windows.h"
+using namespace std;
+
+class MappedFileImpl
+{
+public:
+    MappedFileImpl() :
+        data(nullptr),
+        mapping(NULL),
+        size(0)
+    {
+    }
+
+    void *data;
+    HANDLE mapping;
+    size_t size;
+};
+
+MappedFile::MappedFile() :
+    m_impl(new MappedFileImpl())
+{
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+    delete m_impl;
+}
+
+void MappedFile::Close()
+{
+    if(m_impl->data != nullptr)
+    {
+        UnmapViewOfFile(m_impl->data);
+        m_impl->data = nullptr;
+        m_impl->size = 0;
+    }
+
+    if(m_impl->mapping != NULL)
+    {
+        CloseHandle(m_impl->mapping);
+        m_impl->mapping = NULL;
+    }
+}
+
+const uint8_t *MappedFile::data() const
+{
+    return (const uint8_t *) m_impl->data;
+}
+
+bool MappedFile::Open(const string &pathAndFile)
+{
+    Close();
+    HANDLE file = CreateFileA(pathAndFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // The mapping keeps the file open so it can be closed right away
+    LARGE_INTEGER fileSize;
+    if(GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+    {
+        m_impl->mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(m_impl->mapping != NULL)
+        {
+            m_impl->data = MapViewOfFile(m_impl->mapping, FILE_MAP_READ, 0, 0, 0);
+            if(m_impl->data != nullptr)
+            {
+                m_impl->size = (size_t) fileSize.QuadPart;
+            }
+        }
+    }
+
+    CloseHandle(file);
+    if(m_impl->data == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+size_t MappedFile::size() const
+{
+    return m_impl->size;
+}
@@ -59,6 +59,8 @@ public:
     shared_ptr<HtnPlanner::SolutionsType> m_lastSolutions;
     shared_ptr<HtnPlanner> m_planner;
     shared_ptr<HtnGoalResolver> m_resolver;
+    // Results are serialized into this buffer so its memory is reused from call to call
+    string m_resultBuffer;
     shared_ptr<HtnRuleSet> m_state;
 };
 
@@ -107,6 +109,9 @@ extern "C"  //Tells the compile to use C-linkage for the next scope.
         if (ptr->m_lastSolutions != nullptr && solutionIndex < ptr->m_lastSolutions->size())
         {
             ptr->m_state = (*ptr->m_lastSolutions)[solutionIndex]->finalState();
+            // Each solution that gets applied adds its changes on top of the last one so they need to get folded
+            // into the shared rules once in a while
+            ptr->m_state->CompactIfNeeded();
             return true;
         }
         else
@@ -186,7 +191,9 @@ extern "C"  //Tells the compile to use C-linkage for the next scope.
                 }
                 else
                 {
-                    *result = GetCharPtrFromString(HtnPlanner::ToStringSolutions(ptr->m_lastSolutions, true));
+                    ptr->m_resultBuffer.clear();
+                    HtnPlanner::AppendSolutions(ptr->m_resultBuffer, ptr->m_lastSolutions, true);
+                    *result = GetCharPtrFromString(ptr->m_resultBuffer);
                 }
                 
                 return nullptr;
@@ -268,7 +275,9 @@ extern "C"  //Tells the compile to use C-linkage for the next scope.
                 }
                 else
                 {
-                    *result = GetCharPtrFromString(HtnTerm::ToString(queryResult, false, true));
+                    ptr->m_resultBuffer.clear();
+                    HtnTerm::AppendString(ptr->m_resultBuffer, queryResult, false, true);
+                    *result = GetCharPtrFromString(ptr->m_resultBuffer);
                 }
 
                 return nullptr;
@@ -334,7 +343,9 @@ extern "C"  //Tells the compile to use C-linkage for the next scope.
                 }
                 else
                 {
-                    *result = GetCharPtrFromString(HtnGoalResolver::ToString(queryResult.get(), true));
+                    ptr->m_resultBuffer.clear();
+                    HtnGoalResolver::AppendString(ptr->m_resultBuffer, queryResult.get(), true);
+                    *result = GetCharPtrFromString(ptr->m_resultBuffer);
                 }
 
                 return nullptr;
@@ -9,10 +9,13 @@
 #include "FXPlatform/FailFast.h"
 #include "FXPlatform/Parser/ParserDebug.h"
 #include "FXPlatform/Prolog/HtnGoalResolver.h"
+#include "FXPlatform/Prolog/HtnImage.h"
 #include "FXPlatform/Prolog/HtnRuleSet.h"
 #include "FXPlatform/Prolog/HtnTermFactory.h"
 #include "FXPlatform/Htn/HtnPlanner.h"
 #include "FXPlatform/Htn/HtnCompiler.h"
+#include "FXPlatform/Htn/HtnMethod.h"
+#include "FXPlatform/Htn/HtnOperator.h"
 #include "Logger.h"
 #include "Tests/ParserTestBase.h"
 #include "UnitTest++/UnitTest++.h"
@@ -145,4 +148,94 @@ SUITE(HtnCompilerTests)
         result = (*(++loops.begin()));
         CHECK( result == "Rule Loop: a2/1...a1/1...LOOP -> a2/1");
     }
+    
+    TEST(HtnCompilerImageTests)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<HtnPlanner> planner = shared_ptr<HtnPlanner>(new HtnPlanner());
+        shared_ptr<HtnCompiler> compiler = shared_ptr<HtnCompiler>(new HtnCompiler(factory.get(), state.get(), planner.get()));
+        CHECK(compiler->Compile(string() +
+                                "have-taxi-fare(?distance) :- have-cash(?m), >=(?m, +(1.5, ?distance)). \r\n"
+                                "pay-driver(?fare) :- if(have-cash(?m), >=(?m, ?fare)), do(set-cash(?m, -(?m,?fare))). \r\n"
+                                "travel-to(?y) :- if(first(at(?x), at-taxi-stand(?t, ?x), distance(?x, ?y, ?d), have-taxi-fare(?d))), do(hail(?t,?x), ride(?t, ?x, ?y), pay-driver(+(1.50, ?d))). \r\n"
+                                "travel-to(?y) :- else, if(at(?x), bus-route(?bus, ?x, ?y)), do(wait-for(?bus, ?x), ride(?bus, ?x, ?y)). \r\n"
+                                "visit-all(?l) :- anyOf, if(member(?x, ?l)), do(travel-to(?x)). \r\n"
+                                "hail(?vehicle, ?location) :- del(), add(at(?vehicle, ?location)). \r\n"
+                                "wait-for(?bus, ?location) :- hidden, del(), add(at(?bus, ?location)). \r\n"
+                                "ride(?vehicle, ?a, ?b) :- del(at(?a), at(?vehicle, ?a)), add(at(?b), at(?vehicle, ?b)). \r\n"
+                                "set-cash(?old, ?new) :- del(have-cash(?old)), add(have-cash(?new)). \r\n"
+                                "distance(downtown, park, 2). distance(downtown, suburb, 12). \r\n"
+                                "at-taxi-stand(taxi1, downtown). bus-route(bus3, downtown, suburb). \r\n"
+                                "stops([downtown, park, suburb]). at(downtown). have-cash(12.25). \r\n"
+                                ));
+        
+        HtnImageWriter writer;
+        state->WriteImage(writer);
+        planner->WriteImage(writer);
+        vector<uint8_t> image;
+        writer.Save(image);
+        
+        // Load into a different factory like a new process would
+        shared_ptr<HtnTermFactory> factory2 = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state2 = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<HtnPlanner> planner2 = shared_ptr<HtnPlanner>(new HtnPlanner());
+        HtnImageReader reader;
+        CHECK(reader.Open(factory2.get(), image.data(), image.size()));
+        CHECK(state2->LoadImage(reader));
+        CHECK(planner2->LoadImage(reader));
+        CHECK(reader.AtEnd());
+        
+        auto allRules = [](shared_ptr<HtnRuleSet> rules)
+        {
+            string result;
+            rules->AllRules([&](const HtnRule &rule)
+                            {
+                                result += rule.ToString() + "\r\n";
+                                return true;
+                            });
+            return result;
+        };
+        auto allMethods = [](shared_ptr<HtnPlanner> domain)
+        {
+            map<int, string> ordered;
+            domain->AllMethods([&](HtnMethod *method)
+                               {
+                                   ordered[method->documentOrder()] = method->ToString() + (method->isDefault() ? " else " : " ") + lexical_cast<string>((int) method->methodType());
+                                   return true;
+                               });
+            string result;
+            for(auto item : ordered) { result += item.second + "\r\n"; }
+            return result;
+        };
+        auto allOperators = [](shared_ptr<HtnPlanner> domain)
+        {
+            string result;
+            domain->AllOperators([&](HtnOperator *op)
+                                 {
+                                     result += op->ToString() + (op->isHidden() ? " hidden" : "") + "\r\n";
+                                     return true;
+                                 });
+            return result;
+        };
+        CHECK_EQUAL(allRules(state), allRules(state2));
+        CHECK_EQUAL(allMethods(planner), allMethods(planner2));
+        CHECK_EQUAL(allOperators(planner), allOperators(planner2));
+        CHECK(state2->HasFact(factory2->CreateConstantFunctor("have-cash", {"12.25"})));
+        
+        vector<shared_ptr<HtnTerm>> goals = { factory->CreateConstantFunctor("travel-to", {"suburb"}) };
+        vector<shared_ptr<HtnTerm>> goals2 = { factory2->CreateConstantFunctor("travel-to", {"suburb"}) };
+        string plans = HtnPlanner::ToStringSolutions(planner->FindAllPlans(factory.get(), state, goals));
+        CHECK_EQUAL(plans, HtnPlanner::ToStringSolutions(planner2->FindAllPlans(factory2.get(), state2, goals2)));
+        CHECK(plans != "null");
+        
+        // Damaged images fail with an error instead of loading something wrong
+        HtnImageReader badReader;
+        CHECK(!badReader.Open(factory2.get(), image.data(), image.size() - sizeof(uint32_t)));
+        CHECK(badReader.error().size() > 0);
+        shared_ptr<HtnPlanner> planner3 = shared_ptr<HtnPlanner>(new HtnPlanner());
+        CHECK(reader.Open(factory2.get(), image.data(), image.size()));
+        CHECK(!planner3->LoadImage(reader));
+        CHECK(reader.failed());
+    }
 }
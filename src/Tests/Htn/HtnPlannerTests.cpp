@@ -14,6 +14,7 @@
 #include "FXPlatform/Prolog/HtnTermFactory.h"
 #include "Tests/ParserTestBase.h"
 #include "Logger.h"
+#include <atomic>
 #include <thread>
 #include "UnitTest++/UnitTest++.h"
 using namespace Prolog;
@@ -1461,4 +1462,73 @@ SUITE(HtnPlannerTests)
         finalFacts = HtnPlanner::ToStringFacts(result);
         CHECK_EQUAL(finalFacts,  "[ { BlowBudget(Green) => ,Color(Blue) => ,Color(Green) => ,Color(Red) => ,item(Test) => ,item(Blue) => ,item(SUCCESS,Blue) =>  } { BlowBudget(Green) => ,Color(Blue) => ,Color(Green) => ,Color(Red) => ,item(Test) => ,item(Green) =>  } ]");
     }
+    
+    // Stress test for running many planners against one compiled domain and one concurrent factory. Threads planning at the
+    // same time must all get the single threaded answer, and one thread running out of memory must not affect the others
+    TEST(PlannerConcurrentFactoryTest)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<HtnPlanner> planner = shared_ptr<HtnPlanner>(new HtnPlanner());
+        shared_ptr<HtnCompiler> compiler = shared_ptr<HtnCompiler>(new HtnCompiler(factory.get(), state.get(), planner.get()));
+        string testState = string() +
+        "count(?Cur, ?Top) :- if(<(?Cur, ?Top), is(?Next, +(?Cur, 1))), do(step(?Cur), count(?Next, ?Top)). \r\n" +
+        "count(?Cur, ?Top) :- if(>=(?Cur, ?Top)), do(finish(?Cur)). \r\n" +
+        "step(?Value) :- del(), add(visited(?Value)). \r\n" +
+        "finish(?Value) :- del(), add(finished(?Value)). \r\n" +
+        "goals(count(0, 40)).\r\n";
+        CHECK(compiler->Compile(testState));
+        factory->concurrent(true);
+        shared_ptr<HtnPlanner::SolutionsType> result = planner->FindAllPlans(factory.get(), state, compiler->goals());
+        string expected = HtnPlanner::ToStringSolutions(result) + HtnPlanner::ToStringFacts(result);
+        CHECK(result != nullptr && result->size() == 1);
+        result = nullptr;
+
+        // Every thread must get exactly the same answer as the single threaded run, even while another thread keeps running out of memory
+        const int iterations = 40;
+        atomic<int> failures(0);
+        auto runPlans = [&]()
+        {
+            vector<shared_ptr<HtnTerm>> goals = compiler->goals();
+            for(int index = 0; index < iterations; ++index)
+            {
+                shared_ptr<HtnPlanner::SolutionsType> threadResult = planner->FindAllPlans(factory.get(), state, goals);
+                if(factory->outOfMemory() || HtnPlanner::ToStringSolutions(threadResult) + HtnPlanner::ToStringFacts(threadResult) != expected)
+                {
+                    failures++;
+                }
+            }
+        };
+        
+        atomic<int> outOfMemoryCount(0);
+        auto runOutOfMemory = [&]()
+        {
+            vector<shared_ptr<HtnTerm>> goals = compiler->goals();
+            for(int index = 0; index < iterations; ++index)
+            {
+                planner->FindAllPlans(factory.get(), state, goals, 1000);
+                if(factory->outOfMemory())
+                {
+                    outOfMemoryCount++;
+                    factory->outOfMemory(false);
+                }
+            }
+        };
+        
+        vector<std::thread> threads;
+        for(int index = 0; index < 3; ++index)
+        {
+            threads.push_back(std::thread(runPlans));
+        }
+        
+        threads.push_back(std::thread(runOutOfMemory));
+        for(std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        
+        CHECK_EQUAL(0, failures.load());
+        CHECK_EQUAL(iterations, outOfMemoryCount.load());
+        CHECK(!factory->outOfMemory());
+    }
 }
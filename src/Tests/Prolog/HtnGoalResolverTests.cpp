@@ -6,6 +6,7 @@
 //  Copyright © 2018 Eric Zinda. All rights reserved.
 //
 #include <iostream>
+#include <regex>
 // #include "FXPlatform/FileStream.h"
 #include "FXPlatform/Logger.h"
 #include "FXPlatform/Prolog/HtnGoalResolver.h"
@@ -1404,6 +1405,36 @@ SUITE(HtnGoalResolverTests)
         finalUnifier = HtnGoalResolver::ToString(unifier.get());
         CHECK_EQUAL(finalUnifier, "null");
         
+        // ***** retract() with a variable removes the first fact that unifies and binds the variable
+        compiler->Clear();
+        testState = string() +
+        "itemsInBag(Name1). \r\n" +
+        "itemsInBag(Name2). \r\n" +
+        "goals( retract(itemsInBag(?X)), itemsInBag(?After) ).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL(finalUnifier, "((?X = Name1, ?After = Name2))");
+        CHECK(!state->DebugHasRule("itemsInBag(Name1)", ""));
+        CHECK(state->DebugHasRule("itemsInBag(Name2)", ""));
+        
+        // ***** retract() and retractall() only remove the facts that match when there are enough for argument indexes
+        compiler->Clear();
+        testState = string();
+        for(int index = 0; index < 100; ++index)
+        {
+            testState += "at(bus" + lexical_cast<string>(index % 10) + ", loc" + lexical_cast<string>(index) + "). ";
+        }
+        
+        testState += "at(?Any, depot). goals( retract(at(bus4, ?Where)), retractall(at(bus3, ?Where2)), count(?Count, at(?Bus, ?Location)) ).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL(finalUnifier, "((?Where = loc4, ?Count = 90))");
+        CHECK(state->DebugHasRule("at(bus3,loc30)", "") == false);
+        CHECK(state->DebugHasRule("at(bus4,loc14)", ""));
+        CHECK(state->DebugHasRule("at(?Any,depot)", ""));
+        
 		// TODO: figure out how to make this work
 		//// ***** 
 		//compiler->Clear();
@@ -1556,6 +1587,23 @@ SUITE(HtnGoalResolverTests)
         unifier = compiler->SolveGoals();
         finalUnifier = HtnGoalResolver::ToString(unifier.get());
         CHECK_EQUAL(finalUnifier, "((?Path = [1,2]), (?Path = [1,4,5,2]), (?Path = [1,4,5,3,2]), (?Path = [1,4,3,2]), (?Path = [1,4,3,5,2]), (?Path = [1,3,2]), (?Path = [1,3,4,5,2]), (?Path = [1,3,5,2]))");
+        
+        // ***** Results used to be limited to about 2000 items
+        compiler->Clear();
+        testState = "";
+        for(int index = 0; index < 2500; ++index)
+        {
+            testState += "item(" + lexical_cast<string>(index) + ").";
+        }
+        goals = "goals( findall(?X, item(?X), ?List), atom_chars(abc, ?Chars) ).\r\n";
+        CHECK(compiler->Compile(testState + goals));
+        unifier = compiler->SolveGoals(&resolver, 10000000);
+        CHECK(unifier != nullptr && unifier->size() == 1);
+        if(unifier != nullptr && unifier->size() == 1)
+        {
+            CHECK_EQUAL(2500, (*unifier)[0][0].second->listLength());
+            CHECK_EQUAL(3, (*unifier)[0][1].second->listLength());
+        }
     }
         
     TEST(HtnGoalResolverMinTests)
@@ -1968,6 +2016,16 @@ SUITE(HtnGoalResolverTests)
         unifier = compiler->SolveGoals();
         finalUnifier = HtnGoalResolver::ToString(unifier.get());
         CHECK_EQUAL(finalUnifier, "((?HighCost = 3, ?X = a, ?C = 3))");
+
+        // ***** sortBy() on atoms whose names differ by more than one character
+        compiler->Clear();
+        testState = string() +
+        "letter(c). letter(a). letter(e).\r\n" +
+        "goals(sortBy(?X, >(letter(?X)))).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL(finalUnifier, "((?X = e), (?X = c), (?X = a))");
     }
     
     TEST(HtnGoalResolverIdenticalTests)
@@ -2501,4 +2559,306 @@ SUITE(HtnGoalResolverTests)
 
         // add_3_and_double(X,Y) :- Y is (X+3)*2.
     }
+
+    TEST(HtnGoalResolverTablingTests)
+    {
+        HtnGoalResolver resolver;
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<PrologCompiler> compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), state.get()));
+        string testState;
+        string finalUnifier;
+        shared_ptr<vector<UnifierType>> unifier;
+
+        // ***** Left recursion over a cycle terminates and each answer is only returned once
+        compiler->Clear();
+        testState = string() +
+            "table(/(connected, 2)). \r\n" +
+            "edge(a, b). edge(b, c). edge(c, a). \r\n" +
+            "connected(?X, ?Y) :- connected(?X, ?Z), edge(?Z, ?Y). \r\n" +
+            "connected(?X, ?Y) :- edge(?X, ?Y). \r\n" +
+            "goals(connected(a, ?Y)).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?Y = b), (?Y = c), (?Y = a))", finalUnifier);
+        CHECK(state->answerTable() != nullptr && state->answerTable()->entries.size() == 1);
+
+        // Variants of the call replay the same answers without adding entries
+        unifier = resolver.ResolveAll(factory.get(), state.get(), { factory->CreateFunctor("connected", { factory->CreateConstant("a"), factory->CreateVariable("Other") }) });
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?Other = b), (?Other = c), (?Other = a))", finalUnifier);
+        CHECK(state->answerTable()->entries.size() == 1);
+
+        // Copies share the answers until they change
+        shared_ptr<HtnRuleSet> copy = state->CreateCopy();
+        CHECK(copy->answerTable() == state->answerTable());
+        copy->Update(factory.get(), {}, { factory->CreateFunctor("edge", { factory->CreateConstant("c"), factory->CreateConstant("d") }) });
+        CHECK(copy->answerTable() != state->answerTable());
+        unifier = resolver.ResolveAll(factory.get(), copy.get(), compiler->goals());
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?Y = b), (?Y = c), (?Y = a), (?Y = d))", finalUnifier);
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?Y = b), (?Y = c), (?Y = a))", finalUnifier);
+
+        // ***** Mutual recursion: neither table is complete until the one lowest on the stack is
+        // The copy locked the rules so start over with a new state
+        state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), state.get()));
+        testState = string() +
+            "table(/(even, 1), /(odd, 1)). \r\n" +
+            "next(0, 1). next(1, 2). next(2, 3). next(3, 4). \r\n" +
+            "even(0). \r\n" +
+            "even(?X) :- odd(?Y), next(?Y, ?X). \r\n" +
+            "odd(?X) :- even(?Y), next(?Y, ?X). \r\n" +
+            "goals(even(?X)).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?X = 0), (?X = 2), (?X = 4))", finalUnifier);
+        unifier = resolver.ResolveAll(factory.get(), state.get(), { factory->CreateFunctor("odd", { factory->CreateVariable("X") }) });
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?X = 1), (?X = 3))", finalUnifier);
+
+        // ***** Answers with variables in them and calls with repeated variables give the same results as without tabling
+        compiler->Clear();
+        testState = string() +
+            "table(/(same, 2)). \r\n" +
+            "same(?X, ?X). \r\n" +
+            "same(b, c). \r\n" +
+            "goals(same(?A, ?B), same(?C, ?C), same(a, ?D)).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        string tabledUnifier = HtnGoalResolver::ToString(unifier.get());
+        compiler->Clear();
+        testState = string() +
+            "same(?X, ?X). \r\n" +
+            "same(b, c). \r\n" +
+            "goals(same(?A, ?B), same(?C, ?C), same(a, ?D)).\r\n";
+        CHECK(compiler->Compile(testState));
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL(finalUnifier, tabledUnifier);
+
+        // ***** table() is only a directive if every argument is /(name, arity), otherwise it is just a fact
+        compiler->Clear();
+        testState = string() +
+            "table(kitchen). table(/(room, 1), hall). \r\n" +
+            "goals(table(?X)).\r\n";
+        CHECK(compiler->Compile(testState));
+        CHECK(state->answerTable() == nullptr);
+        unifier = compiler->SolveGoals();
+        finalUnifier = HtnGoalResolver::ToString(unifier.get());
+        CHECK_EQUAL("((?X = kitchen))", finalUnifier);
+
+        // ***** The answers and the resolves that find them count against the memory budget
+        compiler->Clear();
+        testState = string() +
+            "table(/(connected, 2)). \r\n" +
+            "connected(?X, ?Y) :- connected(?X, ?Z), edge(?Z, ?Y). \r\n" +
+            "connected(?X, ?Y) :- edge(?X, ?Y). \r\n";
+        for(int index = 0; index < 200; ++index)
+        {
+            testState += "edge(n" + lexical_cast<string>(index) + ", n" + lexical_cast<string>(index + 1) + "). ";
+        }
+
+        CHECK(compiler->Compile(testState));
+        int64_t tabledMemory = 0;
+        unifier = resolver.ResolveAll(factory.get(), state.get(), { factory->CreateFunctor("connected", { factory->CreateConstant("n0"), factory->CreateVariable("Y") }) }, 0, 1000000, &tabledMemory);
+        CHECK(unifier != nullptr && unifier->size() == 200);
+        CHECK(tabledMemory > state->answerTable()->dynamicSize() - (int64_t) sizeof(HtnAnswerTable));
+        CHECK(!factory->outOfMemory());
+
+        // Running out of memory in the middle leaves the table ready to be evaluated again
+        shared_ptr<HtnRuleSet> stateCopy = state->CreateCopy();
+        stateCopy->Update(factory.get(), {}, { factory->CreateFunctor("edge", { factory->CreateConstant("n200"), factory->CreateConstant("n201") }) });
+        unifier = resolver.ResolveAll(factory.get(), stateCopy.get(), { factory->CreateFunctor("connected", { factory->CreateConstant("n0"), factory->CreateVariable("Y") }) }, 0, (int) (tabledMemory / 2));
+        CHECK(unifier == nullptr);
+        CHECK(factory->outOfMemory());
+        CHECK(stateCopy->answerTable()->expanding == nullptr);
+        factory->outOfMemory(false);
+        unifier = resolver.ResolveAll(factory.get(), stateCopy.get(), { factory->CreateFunctor("connected", { factory->CreateConstant("n0"), factory->CreateVariable("Y") }) });
+        CHECK(unifier != nullptr && unifier->size() == 201);
+    }
+
+    TEST(HtnGoalResolverCompiledHeadTests)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<PrologCompiler> compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), state.get()));
+
+        // Unify() is the oracle: compiled heads have to get the same bindings, in the same order, for every goal.
+        // Don't care variables get a new number every time so the numbers are left out
+        CHECK(compiler->Compile(string() +
+            "goals(p(a, b), p(?X, ?X), p(?X, f(?Y, b)), p(_, f(_, ?Y)), p([a, b, c]), p([?H | ?T]), p(f(g(?X)), ?X), p(f(a), ?Y), q, p(f(?A), f(b)), p(f(?A), f(?A)), " +
+            "p(?X, f(?X, ?Y), g(?Y, [a, ?Z]))).\r\n"));
+        vector<shared_ptr<HtnTerm>> heads = compiler->goals();
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "goals(p(a, b), p(?A, ?B), p(?A, ?A), p(b, ?X), p(f(?X), ?X), p(_, _), p(f(?Z, b), a), p([a | ?R]), p([?A, ?B, ?C]), q, " +
+            "p(f(g(a)), a), p(?X), p(f(a), f(a)), p(?A, f(g(?B), h), ?C), p(a, f(a, b), g(b, ?L)), p(?X, ?Y, ?Z)).\r\n"));
+        vector<shared_ptr<HtnTerm>> goals = compiler->goals();
+        regex dontCareNumbers("_[0-9]+");
+        auto unifierString = [&](shared_ptr<UnifierType> unifier)
+        {
+            return unifier == nullptr ? string("null") : regex_replace(HtnGoalResolver::ToString(*unifier), dontCareNumbers, "_");
+        };
+
+        int unifiedCount = 0;
+        for(shared_ptr<HtnTerm> head : heads)
+        {
+            shared_ptr<HtnRule> rule = shared_ptr<HtnRule>(new HtnRule(head, {}));
+            for(shared_ptr<HtnTerm> goal : goals)
+            {
+                shared_ptr<UnifierType> expected = HtnGoalResolver::Unify(factory.get(), head, goal);
+                unifiedCount += expected == nullptr ? 0 : 1;
+                CHECK_EQUAL(unifierString(expected), unifierString(HtnGoalResolver::UnifyCompiled(factory.get(), *rule->headProgram(), goal)));
+                CHECK_EQUAL(unifierString(HtnGoalResolver::Unify(factory.get(), goal, head)), unifierString(HtnGoalResolver::UnifyCompiled(factory.get(), *rule->headProgram(), goal, true)));
+            }
+        }
+
+        CHECK(unifiedCount > 20);
+
+        // Resolving still works the same way through the compiled heads
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "append([], ?L, ?L). \r\n" +
+            "append([?H | ?T], ?L, [?H | ?R]) :- append(?T, ?L, ?R). \r\n" +
+            "goals(append(?X, ?Y, [a, b])).\r\n"));
+        shared_ptr<vector<UnifierType>> unifier = compiler->SolveGoals();
+        CHECK_EQUAL("((?Y = [a,b], ?X = []), (?X = [a], ?Y = [b]), (?X = [a,b], ?Y = []))", HtnGoalResolver::ToString(unifier.get()));
+    }
+
+    TEST(HtnGoalResolverLastCallTests)
+    {
+        HtnGoalResolver resolver;
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<PrologCompiler> compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), state.get()));
+        shared_ptr<vector<UnifierType>> unifier;
+        int64_t highestMemoryUsed;
+
+        // ***** Tail recursive counters don't grow the stack, so the memory used doesn't depend on how far they count
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "countDown(0). \r\n" +
+            "countDown(?N) :- >(?N, 0), is(?M, -(?N, 1)), countDown(?M). \r\n" +
+            "goals(countDown(5000)).\r\n"));
+        unifier = compiler->SolveGoals(&resolver, 1000000, &highestMemoryUsed);
+        CHECK(!factory->outOfMemory());
+        CHECK_EQUAL("(())", HtnGoalResolver::ToString(unifier.get()));
+        int64_t countMemory = highestMemoryUsed;
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "countDown(0). \r\n" +
+            "countDown(?N) :- >(?N, 0), is(?M, -(?N, 1)), countDown(?M). \r\n" +
+            "goals(countDown(50)).\r\n"));
+        unifier = compiler->SolveGoals(&resolver, 1000000, &highestMemoryUsed);
+        CHECK_EQUAL("(())", HtnGoalResolver::ToString(unifier.get()));
+        CHECK(countMemory < highestMemoryUsed * 2);
+
+        // ***** A cut after a guard leaves nothing to backtrack into, so the recursion after it doesn't grow the stack either
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "countDown(0). \r\n" +
+            "countDown(?N) :- >(?N, 0), !, is(?M, -(?N, 1)), countDown(?M). \r\n" +
+            "goals(countDown(5000)).\r\n"));
+        unifier = compiler->SolveGoals(&resolver, 1000000, &highestMemoryUsed);
+        CHECK(!factory->outOfMemory());
+        CHECK_EQUAL("(())", HtnGoalResolver::ToString(unifier.get()));
+        int64_t cutCountMemory = highestMemoryUsed;
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "countDown(0). \r\n" +
+            "countDown(?N) :- >(?N, 0), !, is(?M, -(?N, 1)), countDown(?M). \r\n" +
+            "goals(countDown(50)).\r\n"));
+        unifier = compiler->SolveGoals(&resolver, 1000000, &highestMemoryUsed);
+        CHECK_EQUAL("(())", HtnGoalResolver::ToString(unifier.get()));
+        CHECK(cutCountMemory < highestMemoryUsed * 2);
+
+        // The cut still stops the clauses after it from being tried
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "sign(?N, positive) :- >(?N, 0), !. \r\n" +
+            "sign(?N, negative) :- <(?N, 0), !. \r\n" +
+            "sign(?N, other). \r\n" +
+            "signs([], []). \r\n" +
+            "signs([?H | ?T], [?S | ?Rest]) :- sign(?H, ?S), !, signs(?T, ?Rest). \r\n" +
+            "goals(signs([1, -1, 0, 2], ?Signs)).\r\n"));
+        unifier = compiler->SolveGoals();
+        CHECK_EQUAL("((?Signs = [positive,negative,other,positive]))", HtnGoalResolver::ToString(unifier.get()));
+
+        // ***** Same for walking a list with an accumulator
+        string list = "[";
+        for(int index = 0; index < 3000; ++index)
+        {
+            list += (index == 0 ? "" : ",") + lexical_cast<string>(index);
+        }
+
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "length([], ?N, ?N). \r\n" +
+            "length([?H | ?T], ?Sofar, ?N) :- is(?Next, +(?Sofar, 1)), length(?T, ?Next, ?N). \r\n" +
+            "goals(length(" + list + "], 0, ?Length)).\r\n"));
+        unifier = compiler->SolveGoals(&resolver, 1000000, &highestMemoryUsed);
+        CHECK(!factory->outOfMemory());
+        CHECK_EQUAL("((?Length = 3000))", HtnGoalResolver::ToString(unifier.get()));
+
+        // ***** Alternatives and cuts still backtrack to the right place
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "pick(?X) :- member(?X, [a, b, c]). \r\n" +
+            "member(?X, [?X | ?T]). \r\n" +
+            "member(?X, [?H | ?T]) :- member(?X, ?T). \r\n" +
+            "firstPick(?X) :- pick(?X), !. \r\n" +
+            "goals(pick(?All)).\r\n"));
+        unifier = compiler->SolveGoals();
+        CHECK_EQUAL("((?All = a), (?All = b), (?All = c))", HtnGoalResolver::ToString(unifier.get()));
+        unifier = resolver.ResolveAll(factory.get(), state.get(), { factory->CreateFunctor("firstPick", { factory->CreateVariable("First") }) });
+        CHECK_EQUAL("((?First = a))", HtnGoalResolver::ToString(unifier.get()));
+    }
+
+    TEST(HtnGoalResolverMemoryAccountingTests)
+    {
+        HtnGoalResolver resolver;
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> state = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<PrologCompiler> compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), state.get()));
+
+        // ***** The running size of the stack is the same as measuring every node on it, as nodes are pushed, popped
+        // and dropped by last call optimization, and while alternatives are still on the stack between solutions
+        compiler->Clear();
+        CHECK(compiler->Compile(string() +
+            "member(?X, [?X | ?T]). \r\n" +
+            "member(?X, [?H | ?T]) :- member(?X, ?T). \r\n" +
+            "countDown(0). \r\n" +
+            "countDown(?N) :- >(?N, 0), is(?M, -(?N, 1)), countDown(?M). \r\n" +
+            "pair(?X, ?Y) :- member(?X, [a, b, c]), countDown(20), member(?Y, [d, e]), not(==(?X, b)). \r\n" +
+            "goals(pair(?X, ?Y), first(member(?Z, [f, g]))).\r\n"));
+        ResolveState resolveState(factory.get(), state.get(), compiler->goals(), 0, 1000000);
+        int solutionCount = 0;
+        while(resolver.ResolveNext(&resolveState) != nullptr)
+        {
+            solutionCount++;
+            int64_t stateSize = resolveState.dynamicSize();
+            int64_t nodesSize = 0;
+            for(shared_ptr<ResolveNode> node : *resolveState.resolveStack)
+            {
+                nodesSize += node->dynamicSize();
+            }
+
+            CHECK(resolveState.resolveStack->size() > 0);
+            CHECK_EQUAL(resolveState.resolveStack->size(), resolveState.measuredNodes.size());
+            CHECK_EQUAL(nodesSize, resolveState.measuredNodesSize);
+            CHECK(resolveState.highestMemoryUsed >= resolveState.measuredNodesSize);
+            CHECK(stateSize > nodesSize);
+        }
+
+        CHECK_EQUAL(4, solutionCount);
+        CHECK(!factory->outOfMemory());
+        resolveState.dynamicSize();
+        CHECK_EQUAL(0, resolveState.measuredNodes.size());
+        CHECK_EQUAL(0, resolveState.measuredNodesSize);
+    }
 }
@@ -7,6 +7,9 @@
 //
 
 #include "FXPlatform/Prolog/HtnGoalResolver.h"
+#include "FXPlatform/Prolog/HtnHeadProgram.h"
+#include "FXPlatform/Prolog/HtnPersistentBitSet.h"
+#include "FXPlatform/Prolog/HtnPersistentMap.h"
 #include "FXPlatform/Prolog/HtnRuleSet.h"
 #include "FXPlatform/Prolog/HtnTerm.h"
 #include "FXPlatform/Prolog/HtnTermFactory.h"
@@ -86,6 +89,48 @@ SUITE(HtnRuleSetTests)
         });
     }
     
+    TEST(RuleRenameVariables)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnTerm> x = factory->CreateVariable("X");
+        shared_ptr<HtnTerm> y = factory->CreateVariable("Y");
+        shared_ptr<HtnTerm> dontCare = factory->CreateVariable("_");
+        HtnRule rule(factory->CreateFunctor("head", { x, dontCare, factory->CreateConstant("a") }),
+                     { factory->CreateFunctor("tail", { y, x, dontCare }), factory->CreateFunctor("ground", { factory->CreateConstant("b") }) });
+        
+        // Renaming puts each slot in a frame of its own instead of building new names, don't care variables get a slot per occurrence
+        vector<string> expected = { "head(?X_1,?__3,a) => tail(?Y_2,?X_1,?__4), ground(b)", "head(?X_5,?__7,a) => tail(?Y_6,?X_5,?__8), ground(b)" };
+        for(int count = 0; count < 2; ++count)
+        {
+            vector<HtnTerm *> variables;
+            vector<shared_ptr<HtnTerm>> newVariables;
+            int64_t stringSize = factory->stringSize();
+            shared_ptr<HtnRule> renamed = rule.RenameVariables(factory.get(), variables, newVariables);
+            CHECK_EQUAL(stringSize, factory->stringSize());
+            CHECK_EQUAL(expected[count], renamed->ToString());
+            CHECK_EQUAL(3, (int) variables.size());
+            CHECK(variables[0] == x.get() && newVariables[0] == renamed->head()->arguments()[0]);
+            CHECK(variables[1] == y.get() && newVariables[1] == renamed->tail()[0]->arguments()[0]);
+            // Like MakeVariablesUnique(), the mapping of a don't care variable is its last occurrence
+            CHECK(variables[2] == dontCare.get() && newVariables[2] == renamed->tail()[0]->arguments()[2]);
+        }
+        
+        // A renamed variable is interned by its name and frame, and keeps its frame through the prefix the resolver gives query variables
+        shared_ptr<HtnTerm> renamedX = factory->CreateVariable(*x, 12);
+        CHECK(renamedX != x);
+        CHECK(renamedX == factory->CreateVariable(*x, 12));
+        CHECK(renamedX == factory->CreateVariable("X", 12));
+        CHECK(!(*renamedX == *x));
+        CHECK_EQUAL("X_12", renamedX->name());
+        CHECK(renamedX->TermCompare(*x) > 0);
+        int dontCareCount = 0;
+        std::map<std::string, std::shared_ptr<HtnTerm>> variableMap;
+        shared_ptr<HtnTerm> goal = factory->CreateFunctor("goal", { x, renamedX });
+        shared_ptr<HtnTerm> prefixed = goal->MakeVariablesUnique(factory.get(), false, "orig*", &dontCareCount, variableMap);
+        CHECK_EQUAL("goal(?orig*X,?orig*X_12)", prefixed->ToString());
+        CHECK(goal == prefixed->RemovePrefixFromVariables(factory.get(), "orig*"));
+    }
+    
     TEST(RuleSetBasicOperation)
     {
         shared_ptr<HtnTermFactory> factory;
@@ -307,4 +352,439 @@ SUITE(HtnRuleSetTests)
         try { ruleSet3->AddRule(factory->CreateFunctor("Fact99", { factory->CreateConstant("True") }), {}); } catch(...) { fail = true; }
         CHECK(fail);
     }
+    
+    TEST(RuleSetPredicateBuckets)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        auto checkUnifyOrder = [&](shared_ptr<HtnRuleSet> rules, shared_ptr<HtnTerm> goal, const vector<string> &ruleIDs)
+        {
+            vector<string> found;
+            rules->AllRulesThatCouldUnify(goal.get(), [&](const HtnRule &rule)
+                                          {
+                                              found.push_back(rule.ToString());
+                                              return true;
+                                          });
+            CHECK(found == ruleIDs);
+        };
+        
+        // Clauses for different predicates are interleaved
+        ruleSet->AddRule(factory->CreateConstantFunctor("p", {"1"}), {});
+        ruleSet->AddRule(factory->CreateConstantFunctor("q", {"1"}), {});
+        ruleSet->AddRule(factory->CreateConstantFunctor("p", {"1", "2"}), {});
+        ruleSet->AddRule(factory->CreateConstantFunctor("p", {"2"}), {});
+        ruleSet->AddRule(factory->CreateFunctor("p", {factory->CreateVariable("X")}), {factory->CreateFunctor("q", {factory->CreateVariable("X")})});
+        shared_ptr<HtnTerm> goal = factory->CreateFunctor("p", {factory->CreateVariable("A")});
+        checkUnifyOrder(ruleSet, goal, { "p(1) => ", "p(2) => ", "p(?X) => q(?X)" });
+        checkUnifyOrder(ruleSet, factory->CreateConstantFunctor("p", {"2"}), { "p(2) => ", "p(?X) => q(?X)" });
+        checkUnifyOrder(ruleSet, factory->CreateConstantFunctor("r", {"2"}), { });
+        CHECK(ruleSet->HasEquivalentRule(factory->CreateConstantFunctor("p", {"a", "b"})));
+        CHECK(!ruleSet->HasEquivalentRule(factory->CreateConstantFunctor("q", {"a", "b"})));
+        
+        // Additions are returned after the shared rules for the same predicate, in the order they were added
+        shared_ptr<HtnRuleSet> ruleSet2 = ruleSet->CreateCopy();
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("p", {"1"}) }, { factory->CreateConstantFunctor("p", {"3"}), factory->CreateConstantFunctor("q", {"3"}), factory->CreateConstantFunctor("p", {"4"}) });
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("p", {"3"}), factory->CreateConstantFunctor("q", {"1"}) }, { factory->CreateConstantFunctor("p", {"1"}) });
+        checkUnifyOrder(ruleSet2, goal, { "p(2) => ", "p(?X) => q(?X)", "p(4) => ", "p(1) => " });
+        checkUnifyOrder(ruleSet2, factory->CreateFunctor("q", {factory->CreateVariable("A")}), { "q(3) => " });
+        checkUnifyOrder(ruleSet, goal, { "p(1) => ", "p(2) => ", "p(?X) => q(?X)" });
+        CheckRuleOrder(ruleSet2, {
+            "p(1,2) => ",
+            "p(2) => ",
+            "p(?X) => q(?X)",
+            "q(3) => ",
+            "p(4) => ",
+            "p(1) => ",
+        });
+        
+        // Copies of the shared rules get their own buckets
+        shared_ptr<HtnRuleSet> ruleSet3 = ruleSet->CreateSharedRulesCopy();
+        ruleSet3->AddRule(factory->CreateConstantFunctor("p", {"5"}), {});
+        checkUnifyOrder(ruleSet3, goal, { "p(1) => ", "p(2) => ", "p(?X) => q(?X)", "p(5) => " });
+        checkUnifyOrder(ruleSet, goal, { "p(1) => ", "p(2) => ", "p(?X) => q(?X)" });
+    }
+    
+    TEST(RuleSetArgumentIndexing)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        
+        // Indexed lookups must return exactly what checking every rule would, in the same order
+        auto checkMatchesScan = [&](shared_ptr<HtnRuleSet> rules, shared_ptr<HtnTerm> goal, int expectedCount)
+        {
+            vector<const HtnRule *> found;
+            rules->AllRulesThatCouldUnify(goal.get(), [&](const HtnRule &rule)
+                                          {
+                                              found.push_back(&rule);
+                                              return true;
+                                          });
+            vector<const HtnRule *> scanned;
+            rules->AllRules([&](const HtnRule &rule)
+                            {
+                                if(rules->CanPotentiallyUnify(goal.get(), rule.head().get()))
+                                {
+                                    scanned.push_back(&rule);
+                                }
+                                
+                                return true;
+                            });
+            CHECK(found == scanned);
+            CHECK_EQUAL(expectedCount, (int) found.size());
+        };
+        
+        for(int index = 0; index < 100; ++index)
+        {
+            ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus" + lexical_cast<string>(index % 10), "loc" + lexical_cast<string>(index)}), {});
+            if(index == 50)
+            {
+                // Variables match any constant, compound terms never do
+                ruleSet->AddRule(factory->CreateFunctor("at", {factory->CreateVariable("X"), factory->CreateConstant("depot")}), {});
+                ruleSet->AddRule(factory->CreateFunctor("at", {factory->CreateConstantFunctor("bus3", {"a"}), factory->CreateConstant("depot")}), {});
+            }
+        }
+        
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")}), 11);
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateConstant("loc42")}), 1);
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateConstant("depot")}), 2);
+        checkMatchesScan(ruleSet, factory->CreateConstantFunctor("at", {"bus3", "loc43"}), 1);
+        checkMatchesScan(ruleSet, factory->CreateConstantFunctor("at", {"bus99", "loc99"}), 0);
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateVariable("Where")}), 102);
+        
+        // Indexes are on the shared rules, the overlay of deleted and added facts still applies
+        shared_ptr<HtnRuleSet> ruleSet2 = ruleSet->CreateCopy();
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("at", {"bus3", "loc13"}) }, { factory->CreateConstantFunctor("at", {"bus3", "loc100"}) });
+        checkMatchesScan(ruleSet2, factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")}), 11);
+        checkMatchesScan(ruleSet2, factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateConstant("loc13")}), 0);
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateConstant("loc13")}), 1);
+        
+        // Adding a rule to a copy of the shared rules starts over with new indexes
+        shared_ptr<HtnRuleSet> ruleSet3 = ruleSet->CreateSharedRulesCopy();
+        ruleSet3->AddRule(factory->CreateConstantFunctor("at", {"bus3", "loc200"}), {});
+        checkMatchesScan(ruleSet3, factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")}), 12);
+        checkMatchesScan(ruleSet, factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")}), 11);
+    }
+    
+    TEST(RuleSetPersistentMap)
+    {
+        // Random inserts, replaces and erases must match std::map, and copies must not see later changes
+        HtnPersistentMap<int, int> map;
+        std::map<int, int> expected;
+        vector<pair<HtnPersistentMap<int, int>, std::map<int, int>>> copies;
+        uint32_t random = 12345;
+        for(int index = 0; index < 20000; ++index)
+        {
+            random = random * 1103515245 + 12345;
+            int key = (random >> 8) % 1000;
+            if((random >> 20) % 3 == 0)
+            {
+                CHECK_EQUAL(expected.erase(key) == 1, map.Erase(key));
+            }
+            else
+            {
+                map.Insert(key, index);
+                expected[key] = index;
+            }
+            
+            if(index % 2000 == 0)
+            {
+                copies.push_back(pair<HtnPersistentMap<int, int>, std::map<int, int>>(map, expected));
+            }
+        }
+        
+        copies.push_back(pair<HtnPersistentMap<int, int>, std::map<int, int>>(map, expected));
+        for(auto &copy : copies)
+        {
+            CHECK_EQUAL(copy.second.size(), copy.first.size());
+            std::map<int, int>::iterator expectedIter = copy.second.begin();
+            copy.first.ForEach([&](int key, int value)
+                               {
+                                   CHECK(expectedIter != copy.second.end() && expectedIter->first == key && expectedIter->second == value);
+                                   ++expectedIter;
+                                   return true;
+                               });
+            CHECK(expectedIter == copy.second.end());
+            for(int key = 0; key < 1000; key += 7)
+            {
+                const int *found = copy.first.Find(key);
+                CHECK_EQUAL(copy.second.count(key) == 1, found != nullptr);
+                if(found != nullptr) { CHECK_EQUAL(copy.second[key], *found); }
+            }
+        }
+        
+        // ForEachFrom starts at the first key that isn't less than the one given
+        int firstKey = -1;
+        map.ForEachFrom(500, [&](int key, int)
+                        {
+                            firstKey = key;
+                            return false;
+                        });
+        CHECK_EQUAL(expected.lower_bound(500)->first, firstKey);
+    }
+    
+    TEST(RuleSetPersistentBitSet)
+    {
+        // Random sets across several blocks must match std::set, and copies must not see later changes
+        HtnPersistentBitSet bits;
+        std::set<uint32_t> expected;
+        vector<pair<HtnPersistentBitSet, std::set<uint32_t>>> copies;
+        uint32_t random = 12345;
+        for(int index = 0; index < 5000; ++index)
+        {
+            random = random * 1103515245 + 12345;
+            uint32_t position = (random >> 8) % 20000;
+            bits.Set(position);
+            expected.insert(position);
+            if(index % 500 == 0)
+            {
+                copies.push_back(pair<HtnPersistentBitSet, std::set<uint32_t>>(bits, expected));
+            }
+        }
+        
+        copies.push_back(pair<HtnPersistentBitSet, std::set<uint32_t>>(bits, expected));
+        for(auto &copy : copies)
+        {
+            CHECK_EQUAL(copy.second.size(), copy.first.count());
+            for(uint32_t position = 0; position < 25000; ++position)
+            {
+                CHECK_EQUAL(copy.second.count(position) == 1, copy.first.Test(position));
+            }
+        }
+    }
+    
+    TEST(RuleSetDeletedSharedFacts)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        auto countMatches = [&](shared_ptr<HtnRuleSet> rules, shared_ptr<HtnTerm> goal)
+        {
+            int count = 0;
+            rules->AllRulesThatCouldUnify(goal.get(), [&](const HtnRule &)
+                                          {
+                                              count++;
+                                              return true;
+                                          });
+            return count;
+        };
+        
+        // Enough rules that the ordinals span more than one block of bits
+        for(int index = 0; index < 10000; ++index)
+        {
+            ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus" + lexical_cast<string>(index % 10), "loc" + lexical_cast<string>(index)}), {});
+        }
+        
+        ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus1", "loc5000"}), { factory->CreateConstant("true") });
+        shared_ptr<HtnTerm> allAt = factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateVariable("Where")});
+        shared_ptr<HtnRuleSet> ruleSet2 = ruleSet->CreateCopy();
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("at", {"bus3", "loc3"}), factory->CreateConstantFunctor("at", {"bus3", "loc9993"}) }, {});
+        shared_ptr<HtnRuleSet> ruleSet3 = ruleSet2->CreateCopy();
+        ruleSet3->Update(factory.get(), { factory->CreateConstantFunctor("at", {"bus0", "loc5000"}) }, { factory->CreateConstantFunctor("at", {"bus3", "loc3"}) });
+        
+        CHECK_EQUAL(10001, countMatches(ruleSet, allAt));
+        CHECK_EQUAL(9999, countMatches(ruleSet2, allAt));
+        CHECK_EQUAL(9999, countMatches(ruleSet3, allAt));
+        CHECK(!ruleSet2->HasFact(factory->CreateConstantFunctor("at", {"bus3", "loc3"})));
+        CHECK(ruleSet3->HasFact(factory->CreateConstantFunctor("at", {"bus3", "loc3"})));
+        CHECK(!ruleSet3->HasFact(factory->CreateConstantFunctor("at", {"bus0", "loc5000"})));
+        
+        // Rules with the same head as a deleted fact are not deleted, and added facts come after the shared rules
+        vector<string> found;
+        ruleSet3->AllRules([&](const HtnRule &rule)
+                           {
+                               string text = rule.ToString();
+                               if(text.find("loc5000") != string::npos || text.find("loc3)") != string::npos) { found.push_back(text); }
+                               return true;
+                           });
+        CHECK_EQUAL(2, (int) found.size());
+        CHECK_EQUAL("at(bus1,loc5000) => true", found[0]);
+        CHECK_EQUAL("at(bus3,loc3) => ", found[1]);
+        CHECK(ruleSet3->HasEquivalentRule(allAt));
+    }
+    
+    TEST(RuleSetRuleCursor)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        for(int index = 0; index < 40; ++index)
+        {
+            ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus" + lexical_cast<string>(index % 4), "loc" + lexical_cast<string>(index)}), {});
+        }
+
+        ruleSet->AddRule(factory->CreateFunctor("at", {factory->CreateConstant("bus1"), factory->CreateVariable("Anywhere")}), { factory->CreateConstant("true") });
+        shared_ptr<HtnRuleSet> ruleSet2 = ruleSet->CreateCopy();
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("at", {"bus1", "loc5"}) }, { factory->CreateConstantFunctor("at", {"bus1", "loc99"}) });
+
+        // Returns the same rules as AllRulesThatCouldUnify(), in the same order, using the index
+        shared_ptr<HtnTerm> bus1 = factory->CreateFunctor("at", {factory->CreateConstant("bus1"), factory->CreateVariable("Where")});
+        vector<string> expected;
+        ruleSet2->AllRulesThatCouldUnify(bus1.get(), [&](const HtnRule &rule)
+                                         {
+                                             expected.push_back(rule.ToString());
+                                             return true;
+                                         });
+        CHECK_EQUAL(11, (int) expected.size());
+        CHECK_EQUAL("at(bus1,loc1) => ", expected[0]);
+        CHECK_EQUAL("at(bus1,?Anywhere) => true", expected[9]);
+        CHECK_EQUAL("at(bus1,loc99) => ", expected[10]);
+
+        HtnRuleSet::RuleCursor cursor(*ruleSet2, bus1.get());
+        vector<string> found;
+        found.push_back(cursor.Next()->ToString());
+
+        // Changes after it was created don't affect it
+        ruleSet2->Update(factory.get(), { factory->CreateConstantFunctor("at", {"bus1", "loc9"}), factory->CreateConstantFunctor("at", {"bus1", "loc99"}) }, { factory->CreateConstantFunctor("at", {"bus1", "loc100"}) });
+        for(const HtnRule *rule = cursor.Next(); rule != nullptr; rule = cursor.Next())
+        {
+            found.push_back(rule->ToString());
+        }
+
+        CHECK(expected == found);
+        CHECK(cursor.Next() == nullptr);
+    }
+
+    TEST(RuleSetSharedSize)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        
+        // Compiled heads are part of the shared rules, so rules that only differ by their heads differ by the size of the compiled heads
+        shared_ptr<HtnTerm> smallHead = factory->CreateConstantFunctor("at", {"bus"});
+        shared_ptr<HtnTerm> largeHead = factory->CreateFunctor("at", { factory->CreateVariable("Bus"), factory->CreateConstantFunctor("loc", {"x", "y", "z"}) });
+        int64_t emptySize = ruleSet->dynamicSharedSize();
+        ruleSet->AddRule(smallHead, { factory->CreateConstant("true") });
+        int64_t smallSize = ruleSet->dynamicSharedSize() - emptySize;
+        ruleSet->AddRule(largeHead, { factory->CreateConstant("true") });
+        int64_t largeSize = ruleSet->dynamicSharedSize() - emptySize - smallSize;
+        CHECK_EQUAL(HtnHeadProgram::Compile(largeHead)->dynamicSize() - HtnHeadProgram::Compile(smallHead)->dynamicSize(), largeSize - smallSize);
+        CHECK(largeSize > smallSize);
+    }
+    
+    TEST(RuleSetCompact)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        for(int index = 0; index < 100; ++index)
+        {
+            ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus" + lexical_cast<string>(index), "loc" + lexical_cast<string>(index)}), {});
+        }
+        
+        // A rule can have the same head as a fact that gets added later
+        ruleSet->AddRule(factory->CreateConstantFunctor("stop", {"depot"}), { factory->CreateConstantFunctor("at", {"bus1", "depot"}) });
+        
+        // Move the buses around a day at a time like applying plans would
+        shared_ptr<HtnRuleSet> state = ruleSet->CreateCopy();
+        vector<shared_ptr<HtnRuleSet>> days;
+        for(int day = 1; day <= 30; ++day)
+        {
+            state = state->CreateCopy();
+            for(int index = 0; index < 100; index += 3)
+            {
+                string bus = "bus" + lexical_cast<string>(index);
+                state->Update(factory.get(),
+                              { factory->CreateConstantFunctor("at", {bus, "loc" + lexical_cast<string>((index + day - 1) % 100)}) },
+                              { factory->CreateConstantFunctor("at", {bus, "loc" + lexical_cast<string>((index + day) % 100)}) });
+            }
+            
+            days.push_back(state);
+        }
+        
+        state->Update(factory.get(), {}, { factory->CreateConstantFunctor("stop", {"depot"}) });
+        string facts = state->ToStringFacts();
+        string lastDayFacts = days[days.size() - 2]->ToStringFacts();
+        shared_ptr<HtnRuleSet> compacted = state->CreateCopy();
+        compacted->Compact();
+        CHECK_EQUAL(facts, compacted->ToStringFacts());
+        CHECK_EQUAL((int64_t) sizeof(HtnRuleSet), compacted->dynamicSize());
+        CHECK(compacted->HasFact(factory->CreateConstantFunctor("stop", {"depot"})));
+        
+        // Copies made before still see their own facts
+        CHECK_EQUAL(facts, state->ToStringFacts());
+        CHECK_EQUAL(lastDayFacts, days[days.size() - 2]->ToStringFacts());
+        
+        // The compacted rules can be changed and copied like any other
+        shared_ptr<HtnRuleSet> next = compacted->CreateCopy();
+        next->Update(factory.get(), { factory->CreateConstantFunctor("stop", {"depot"}) }, {});
+        CHECK(!next->HasFact(factory->CreateConstantFunctor("stop", {"depot"})));
+        CHECK(compacted->HasFact(factory->CreateConstantFunctor("stop", {"depot"})));
+        
+        // Only compacts automatically once there have been enough changes
+        CHECK(!next->CompactIfNeeded());
+        for(int index = 0; index < 1100; ++index)
+        {
+            next->Update(factory.get(), {}, { factory->CreateConstantFunctor("extra", {"item" + lexical_cast<string>(index)}) });
+        }
+        
+        string nextFacts = next->ToStringFacts();
+        CHECK(next->CompactIfNeeded());
+        CHECK_EQUAL(nextFacts, next->ToStringFacts());
+    }
+    
+    TEST(RuleSetHasFact)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus1", "home"}), {});
+        ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus2", "home"}), { factory->CreateConstant("true") });
+        ruleSet->AddRule(factory->CreateFunctor("at", {factory->CreateVariable("X"), factory->CreateConstant("work")}), {});
+        
+        // Only rules without a tail are facts, and the head has to be the same term
+        CHECK(ruleSet->HasFact(factory->CreateConstantFunctor("at", {"bus1", "home"})));
+        CHECK(!ruleSet->HasFact(factory->CreateConstantFunctor("at", {"bus2", "home"})));
+        CHECK(!ruleSet->HasFact(factory->CreateConstantFunctor("at", {"bus1", "work"})));
+        CHECK(ruleSet->HasFact(factory->CreateFunctor("at", {factory->CreateVariable("X"), factory->CreateConstant("work")})));
+        
+        // Ground facts can't be added twice
+        bool fail = false;
+        try { ruleSet->AddRule(factory->CreateConstantFunctor("at", {"bus1", "home"}), {}); } catch(...) { fail = true; }
+        CHECK(fail);
+    }
+    
+    TEST(RuleSetBulkLoad)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnRuleSet> ruleSet = shared_ptr<HtnRuleSet>(new HtnRuleSet());
+        shared_ptr<PrologCompiler> compiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), ruleSet.get()));
+        auto countMatches = [&](shared_ptr<HtnTerm> goal)
+        {
+            int count = 0;
+            ruleSet->AllRulesThatCouldUnify(goal.get(), [&](const HtnRule &)
+                                            {
+                                                count++;
+                                                return true;
+                                            });
+            return count;
+        };
+        
+        string document;
+        for(int index = 0; index < 1000; ++index)
+        {
+            document += "at(bus" + lexical_cast<string>(index % 10) + ", loc" + lexical_cast<string>(index) + "). ";
+        }
+        
+        CHECK(compiler->Compile(document + "at(?X, depot). goals(at(bus3, ?Where)). "));
+        CHECK_EQUAL(1001, countMatches(factory->CreateFunctor("at", {factory->CreateVariable("Bus"), factory->CreateVariable("Where")})));
+        CHECK_EQUAL(101, countMatches(factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")})));
+        CHECK_EQUAL(101, (int) compiler->SolveGoals()->size());
+        
+        // Loading another document after the indexes were built must rebuild them
+        CHECK(compiler->Compile("at(bus3, garage). "));
+        CHECK_EQUAL(102, countMatches(factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateVariable("Where")})));
+        
+        // Duplicates are found by head even if the earlier one is a rule
+        bool fail = false;
+        try { compiler->Compile("at(bus4, loc14). "); } catch(...) { fail = true; }
+        CHECK(fail);
+        fail = false;
+        try { compiler->Compile("stop(depot) :- at(bus1, depot). stop(depot). "); } catch(...) { fail = true; }
+        CHECK(fail);
+        
+        // Documents without rules can still be compiled after the rules are locked or changed
+        shared_ptr<HtnRuleSet> copy = ruleSet->CreateCopy();
+        compiler->goals().clear();
+        CHECK(compiler->Compile("goals(at(bus3, garage)). "));
+        CHECK_EQUAL(1, (int) compiler->SolveGoals()->size());
+        copy->Update(factory.get(), { factory->CreateFunctor("at", {factory->CreateConstant("bus3"), factory->CreateConstant("garage")}) }, {});
+        shared_ptr<PrologCompiler> copyCompiler = shared_ptr<PrologCompiler>(new PrologCompiler(factory.get(), copy.get()));
+        CHECK(copyCompiler->Compile("goals(at(bus3, ?Where)). "));
+        CHECK_EQUAL(101, (int) copyCompiler->SolveGoals()->size());
+    }
 }
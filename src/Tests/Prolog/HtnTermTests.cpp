@@ -33,6 +33,17 @@ SUITE(HtnTermTests)
         CHECK(query->Compile("vocabulary(\"blue\", Pred, Argcount, adjective, X)."));
         result = HtnTerm::ToString(query->result(), false, true);
         CHECK_EQUAL("{\"vocabulary\":[{\"\\\"blue\\\"\":[]},{\"Pred\":[]},{\"Argcount\":[]},{\"adjective\":[]},{\"X\":[]}]}", result);
+        
+        // Appending writes the same text after whatever is already in the buffer
+        string buffer = "prefix:";
+        HtnTerm::AppendString(buffer, query->result(), false, true);
+        CHECK_EQUAL("prefix:" + result, buffer);
+        query->Clear();
+        CHECK(query->Compile("a([b, 'C', T], [])."));
+        buffer.clear();
+        query->result()[0]->AppendString(buffer, false, true);
+        CHECK_EQUAL("{\"a\":[[{\"b\":[]},{\"'C'\":[]},{\"T\":[]}],[]]}", buffer);
+        CHECK_EQUAL(buffer, query->result()[0]->ToString(false, true));
     }
     
     TEST(HtnTermUniqueID)
@@ -43,6 +54,203 @@ SUITE(HtnTermTests)
         
     }
     
+    TEST(HtnTermInterning)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        
+        // Same structure is the same term, different structure with the same names is not
+        CHECK(factory->CreateConstantFunctor("a", {"b", "c"}) == factory->CreateConstantFunctor("a", {"b", "c"}));
+        CHECK(factory->CreateConstantFunctor("a", {"b", "c"}) != factory->CreateFunctor("a", {factory->CreateConstantFunctor("b", {"c"})}));
+        CHECK(factory->CreateConstant("a") != factory->CreateVariable("a"));
+        CHECK(factory->CreateConstantFunctor("a", {"b"})->hash() == factory->CreateConstantFunctor("a", {"b"})->hash());
+        
+        // Big terms used to be limited by the size of the buffer used to build their ID
+        vector<shared_ptr<HtnTerm>> items;
+        for(int index = 0; index < 10000; ++index)
+        {
+            items.push_back(factory->CreateConstant(index));
+        }
+        
+        shared_ptr<HtnTerm> list = factory->CreateList(items);
+        CHECK(list == factory->CreateList(items));
+        items.pop_back();
+        CHECK(list != factory->CreateList(items));
+        
+        // Everything but the cached empty list gets released when the terms go away
+        shared_ptr<HtnTermFactory> emptyFactory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        emptyFactory->EmptyList();
+        int64_t emptySize = emptyFactory->dynamicSize();
+        list = nullptr;
+        items.clear();
+        CHECK_EQUAL(emptySize, factory->dynamicSize());
+    }
+    
+    TEST(HtnTermAtomTable)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        
+        // System atoms have fixed IDs
+        CHECK(factory->CreateConstant("!")->isCut());
+        CHECK(factory->True()->isTrue());
+        CHECK(!factory->CreateVariable("true")->isTrue());
+        CHECK(factory->EmptyList()->isAtom(HtnAtom::EmptyList));
+        CHECK(factory->CreateConstantFunctor("tryEnd", {"1"})->isAtom(HtnAtom::TryEnd));
+        CHECK(factory->CreateConstantFunctor("+", {"1", "2"})->isArithmetic());
+        CHECK(!factory->CreateConstantFunctor("plus", {"1", "2"})->isArithmetic());
+        CHECK_EQUAL(">=", *factory->atomName((int) HtnAtom::GreaterThanOrEqual));
+        
+        // Everything else gets a dense ID that is shared by terms with the same name and reused once the name is released
+        shared_ptr<HtnTerm> a = factory->CreateConstant("a");
+        CHECK_EQUAL((int) HtnAtom::SystemAtomCount, a->atomID());
+        CHECK_EQUAL(a->atomID(), factory->CreateConstantFunctor("a", {"b"})->atomID());
+        CHECK_EQUAL("a", *factory->atomName(a->atomID()));
+        int aID = a->atomID();
+        a = nullptr;
+        CHECK_EQUAL(aID, factory->CreateConstant("c")->atomID());
+    }
+    
+    TEST(HtnTermNativeNumbers)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        
+        // Numbers created from values must be the same interned terms as the ones created from strings
+        CHECK(factory->CreateConstant((int64_t) 5) == factory->CreateConstant("5"));
+        CHECK(factory->CreateConstant(-2.5) == factory->CreateConstant("-2.500000000"));
+        CHECK(factory->CreateConstant((int64_t) 5)->GetTermType() == HtnTermType::IntType);
+        CHECK(factory->CreateConstant(2.5)->GetTermType() == HtnTermType::FloatType);
+        CHECK(factory->CreateConstant("5a")->GetTermType() == HtnTermType::Atom);
+        CHECK(factory->CreateConstant("-")->GetTermType() == HtnTermType::Atom);
+        CHECK(factory->CreateVariable("X")->GetTermType() == HtnTermType::Variable);
+        CHECK(factory->CreateConstantFunctor("a", {"1"})->GetTermType() == HtnTermType::Compound);
+        
+        // Values are preserved exactly
+        CHECK_EQUAL(9007199254740993, factory->CreateConstant("9007199254740993")->GetInt());
+        CHECK_EQUAL(9007199254740993, factory->CreateConstant((int64_t) 9007199254740993)->GetInt());
+        CHECK_EQUAL(2.5, factory->CreateConstant("2.5")->GetDouble());
+        CHECK_EQUAL(2, factory->CreateConstant("2.5")->GetInt());
+        CHECK_EQUAL(3.0, factory->CreateConstant("3")->GetDouble());
+        
+        // Arithmetic keeps ints as ints and produces the same names as before
+        CHECK_EQUAL("7", factory->CreateFunctor("+", { factory->CreateConstant("3"), factory->CreateConstant("4") })->Eval(factory.get())->ToString());
+        CHECK_EQUAL("7.500000000", factory->CreateFunctor("+", { factory->CreateConstant("3.5"), factory->CreateConstant("4") })->Eval(factory.get())->ToString());
+        CHECK_EQUAL("true", factory->CreateFunctor("<", { factory->CreateConstant("3.5"), factory->CreateConstant("4") })->Eval(factory.get())->ToString());
+        CHECK(factory->CreateConstant((int64_t) 9007199254740993)->TermCompare(*factory->CreateConstant((int64_t) 9007199254740992)) == 1);
+        
+        // A float's value comes from its name, so it doesn't matter whether it was first created from a value or from a string
+        shared_ptr<HtnTermFactory> valueFirst = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnTerm> fromValue = valueFirst->CreateConstant(0.1 + 0.2);
+        CHECK(fromValue == valueFirst->CreateConstant("0.300000000"));
+        CHECK_EQUAL(strtod("0.300000000", nullptr), fromValue->GetDouble());
+        shared_ptr<HtnTermFactory> stringFirst = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        shared_ptr<HtnTerm> fromString = stringFirst->CreateConstant("0.300000000");
+        CHECK(fromString == stringFirst->CreateConstant(0.1 + 0.2));
+        CHECK_EQUAL(fromValue->GetDouble(), fromString->GetDouble());
+        CHECK_EQUAL(0.0, factory->CreateConstant(1e-10)->GetDouble());
+        CHECK_EQUAL("false", factory->CreateFunctor(">", { factory->CreateConstant(1e-10), factory->CreateConstant("0") })->Eval(factory.get())->ToString());
+        CHECK_EQUAL("0.999999999", factory->CreateFunctor("*", { factory->CreateFunctor("/", { factory->CreateConstant("1"), factory->CreateConstant("3.0") })->Eval(factory.get()), factory->CreateConstant("3") })->Eval(factory.get())->ToString());
+    }
+    
+    TEST(HtnTermArenaTest)
+    {
+        // Empty chunks are kept for reuse until the arena is closed, then they are all freed at once
+        HtnTermArena arena;
+        vector<void *> blocks;
+        for(int index = 0; index < 2000; ++index)
+        {
+            blocks.push_back(arena.Allocate(100));
+        }
+        
+        CHECK(arena.chunkCount() > 1);
+        void *last = blocks.back();
+        arena.Deallocate(blocks.back(), 100);
+        blocks.pop_back();
+        CHECK(last == arena.Allocate(100));
+        blocks.push_back(last);
+        int chunkCount = arena.chunkCount();
+        for(void *block : blocks)
+        {
+            arena.Deallocate(block, 100);
+        }
+        
+        CHECK_EQUAL(chunkCount, arena.chunkCount());
+        blocks.clear();
+        for(int index = 0; index < 2000; ++index)
+        {
+            blocks.push_back(arena.Allocate(100));
+        }
+        
+        CHECK_EQUAL(chunkCount, arena.chunkCount());
+        for(void *block : blocks)
+        {
+            arena.Deallocate(block, 100);
+        }
+        
+        arena.Close();
+        CHECK_EQUAL(0, arena.chunkCount());
+        
+        // Terms created in a scope are interned with everything else and can outlive it
+        // Starting a scope creates the terms the factory caches
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        factory->EmptyList();
+        factory->True();
+        factory->False();
+        int64_t emptySize = factory->dynamicSize();
+        shared_ptr<HtnTerm> outside = factory->CreateConstantFunctor("a", {"b"});
+        shared_ptr<HtnTerm> escaped;
+        {
+            HtnTermArenaScope scope(factory.get());
+            {
+                HtnTermArenaScope nestedScope(factory.get());
+                CHECK(outside == factory->CreateConstantFunctor("a", {"b"}));
+            }
+            
+            vector<shared_ptr<HtnTerm>> items;
+            for(int index = 0; index < 1000; ++index)
+            {
+                items.push_back(factory->CreateConstantFunctor("item", {lexical_cast<string>(index)}));
+            }
+            
+            escaped = factory->CreateList(items);
+        }
+        
+        vector<shared_ptr<HtnTerm>> items;
+        for(int index = 0; index < 1000; ++index)
+        {
+            items.push_back(factory->CreateConstantFunctor("item", {lexical_cast<string>(index)}));
+        }
+        
+        CHECK(escaped == factory->CreateList(items));
+        items.clear();
+        escaped = nullptr;
+        outside = nullptr;
+        CHECK_EQUAL(emptySize, factory->dynamicSize());
+        
+        // Terms released in bulk are gone when the scope ends, the ones that escaped are still interned and their chunk is counted
+        int64_t escapedSize;
+        {
+            HtnTermArenaScope scope(factory.get());
+            vector<shared_ptr<HtnTerm>> items;
+            for(int index = 0; index < 1000; ++index)
+            {
+                items.push_back(factory->CreateConstantFunctor("item", {lexical_cast<string>(index)}));
+            }
+            
+            // Released and created again before the bulk release
+            items[0] = nullptr;
+            items[0] = factory->CreateConstantFunctor("item", {"0"});
+            escaped = factory->CreateFunctor("escaped", { items[0] });
+            escapedSize = factory->dynamicSize();
+            scope.Release();
+            items.clear();
+        }
+        
+        CHECK(factory->dynamicSize() > emptySize + 32 * 1024);
+        CHECK(factory->dynamicSize() < escapedSize);
+        CHECK(escaped == factory->CreateFunctor("escaped", { factory->CreateConstantFunctor("item", {"0"}) }));
+        escaped = nullptr;
+        CHECK_EQUAL(emptySize, factory->dynamicSize());
+    }
+    
     void RoundTripExpr(shared_ptr<HtnTermFactory> factory, shared_ptr<HtnRuleSet> state, shared_ptr<HtnGoalResolver> resolver, string expr)
     {
         shared_ptr<PrologQueryCompiler> query = shared_ptr<PrologQueryCompiler>(new PrologQueryCompiler(factory.get()));
@@ -53,6 +261,35 @@ SUITE(HtnTermTests)
         CHECK_EQUAL("((?X = " + expr + "))", result);
     }
     
+    TEST(HtnTermLongListTest)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        vector<shared_ptr<HtnTerm>> items;
+        for(int index = 0; index < 200000; ++index)
+        {
+            items.push_back(factory->CreateConstant(index % 10));
+        }
+        
+        // Length is known without walking the list
+        shared_ptr<HtnTerm> list = factory->CreateList(items);
+        CHECK_EQUAL(200000, list->listLength());
+        CHECK_EQUAL(199999, list->arguments()[1]->listLength());
+        CHECK_EQUAL(0, factory->EmptyList()->listLength());
+        CHECK_EQUAL(-1, factory->CreateFunctor(".", { items[0], factory->CreateVariable("Tail") })->listLength());
+        CHECK_EQUAL(-1, factory->CreateConstant("a")->listLength());
+        
+        vector<shared_ptr<HtnTerm>> elements;
+        CHECK(list->GetListElements(elements));
+        CHECK(elements == items);
+        CHECK(!factory->CreateConstant("a")->GetListElements(elements));
+        
+        // Long lists can be printed and released without recursing once per item
+        CHECK_EQUAL(400001, list->ToString().size());
+        items.clear();
+        elements.clear();
+        list = nullptr;
+    }
+    
     // Make sure list expressions round trip to test ToString()
     TEST(HtnTermListToStringTest)
     {
@@ -161,5 +398,31 @@ SUITE(HtnTermTests)
             index++;
         }
     }
+    
+    TEST(HtnTermCompareLongList)
+    {
+        shared_ptr<HtnTermFactory> factory = shared_ptr<HtnTermFactory>(new HtnTermFactory());
+        vector<shared_ptr<HtnTerm>> items;
+        for(int index = 0; index < 200000; ++index)
+        {
+            items.push_back(factory->CreateConstant(index % 10));
+        }
+        
+        // Lists nest in their second argument so comparing long ones must not recurse per item
+        shared_ptr<HtnTerm> list = factory->CreateList(items);
+        CHECK_EQUAL(0, list->TermCompare(*list));
+        items.back() = factory->CreateConstant(20);
+        shared_ptr<HtnTerm> bigger = factory->CreateList(items);
+        CHECK_EQUAL(-1, list->TermCompare(*bigger));
+        CHECK_EQUAL(1, bigger->TermCompare(*list));
+        
+        // Arguments are compared left to right before the list tail
+        CHECK_EQUAL(-1, factory->CreateConstantFunctor("f", {"a", "z"})->TermCompare(*factory->CreateConstantFunctor("f", {"b", "a"})));
+        CHECK_EQUAL(1, factory->CreateFunctor("f", {factory->CreateConstantFunctor("g", {"b"}), factory->CreateConstant("a")})->TermCompare(
+            *factory->CreateFunctor("f", {factory->CreateConstantFunctor("g", {"a"}), factory->CreateConstant("z")})));
+        items.clear();
+        list = nullptr;
+        bigger = nullptr;
+    }
 }
 
@@ -6,6 +6,8 @@
 #include "FXPlatform/Directory.h"
 #include "FXPlatform/Htn/HtnCompiler.h"
 #include "FXPlatform/Htn/HtnPlanner.h"
+#include "FXPlatform/MappedFile.h"
+#include "FXPlatform/Prolog/HtnImage.h"
 #include "FXPlatform/Prolog/HtnRuleSet.h"
 #include "FXPlatform/Prolog/HtnTermFactory.h"
 #include "FXPlatform/Prolog/PrologQueryCompiler.h"
@@ -51,6 +53,26 @@ void ResetEnvironment()
     resolver = shared_ptr<HtnGoalResolver>(new HtnGoalResolver());
 }
 
+// Images are written by --compile-image and hold the rules, methods and operators of the documents that were compiled
+bool LoadImage(const string &pathAndFile, string &error)
+{
+    MappedFile file;
+    if(!file.Open(pathAndFile))
+    {
+        error = "error loading file '" + pathAndFile + "'";
+        return false;
+    }
+    
+    HtnImageReader reader;
+    if(!reader.Open(factory.get(), file.data(), file.size()) || !state->LoadImage(reader) || !planner->LoadImage(reader))
+    {
+        error = reader.error();
+        return false;
+    }
+    
+    return true;
+}
+
 bool LoadFiles(const vector<string> &paths)
 {
     for(auto pathAndFile : paths)
@@ -84,6 +106,19 @@ bool LoadFiles(const vector<string> &paths)
                 return false;
             }
         }
+        else if(extension == "img")
+        {
+            string error;
+            if(LoadImage(pathAndFile, error))
+            {
+                fprintf(stdout, "Succesfully loaded %s as image\r\n", pathAndFile.c_str());
+            }
+            else
+            {
+                fprintf(stdout, "Error loading %s as image, %s\r\n", pathAndFile.c_str(), error.c_str());
+                return false;
+            }
+        }
     }
     
     return true;
@@ -99,6 +134,9 @@ bool cmdHelp(const string &which)
                 "Pass the name of one or more Hierarchical Task Network or Prolog documents\r\n"
                 "on the command line and then execute prolog queries or HTN goals interactively.\r\n"
                 "Files with '.pl' exensions are parsed as Prolog and '.htn' documents are parsed as HTN.\r\n"
+                "Files with '.img' extensions are images written by:\r\n"
+                "    indhtn --compile-image Output.img Taxi.htn ...\r\n"
+                "which compiles the documents and saves the result so it loads without parsing.\r\n"
                 "Example of executing normal Prolog query: \r\n"
                 "    indprolog Taxi.htn \r\n"
                 "\r\n"
@@ -288,6 +326,37 @@ int main (int argc, char *argv[])
 	{
         cmdHelp("/?c");
 	}
+    else if(string(argv[1]) == "--compile-image")
+    {
+        if(argc < 4)
+        {
+            cmdHelp("/?c");
+            return 1;
+        }
+        
+        for(int argIndex = 3; argIndex < argc; ++argIndex)
+        {
+            loadedFilePaths.push_back(string(argv[argIndex]));
+        }
+        
+        ResetEnvironment();
+        if(!LoadFiles(loadedFilePaths))
+        {
+            return 1;
+        }
+        
+        HtnImageWriter writer;
+        state->WriteImage(writer);
+        planner->WriteImage(writer);
+        if(!writer.SaveToFile(argv[2]))
+        {
+            fprintf(stdout, "Error writing image %s\r\n", argv[2]);
+            return 1;
+        }
+        
+        fprintf(stdout, "Succesfully wrote image %s\r\n", argv[2]);
+        return 0;
+    }
 	else
 	{
         // Load up all the files we were passed on the command line